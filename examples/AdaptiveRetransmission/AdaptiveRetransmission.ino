@@ -0,0 +1,101 @@
+/*
+ Adaptive Retransmission
+
+ Sends small requests to a TCP echo server and times the replies, first
+ with the fixed 200 ms retransmission timeout, then with the timeout
+ derived from the measured round trip.  With packet loss on the path the
+ slow replies are the ones that needed a retransmission, so the average
+ and the worst reply time show how fast each setting recovers.
+
+ On the host run an echo server and add some loss, for example:
+
+   sudo tc qdisc add dev eth0 root netem loss 10% delay 2ms
+   ncat -l 7 --keep-open --exec /bin/cat
+
+ (remove the loss afterwards with: sudo tc qdisc del dev eth0 root)
+ then set serverIP below to the host address.
+
+ 2023 Dave Nardella
+
+*/
+
+#include <SPI.h>
+#include <Ethernet_SPI2.h>
+
+byte mac[] = {
+  0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xEF
+};
+
+IPAddress ip(192, 168, 0, 178);
+IPAddress serverIP(192, 168, 0, 10);
+const uint16_t serverPort = 7;
+
+const uint16_t requests = 500;
+const uint8_t requestSize = 32;
+
+uint8_t buffer[requestSize];
+
+void runTest(bool adaptive)
+{
+  EthernetClient_SPI2 client;
+
+  Ethernet_SPI2.setAdaptiveRetransmission(adaptive);
+  if (!client.connect(serverIP, serverPort)) {
+    Serial.println("connection failed");
+    return;
+  }
+
+  uint32_t sum = 0, worst = 0, slow = 0;
+  uint16_t done = 0;
+  for (uint16_t i = 0; i < requests && client.connected(); i++) {
+    memset(buffer, 'a' + (i % 26), requestSize);
+    uint32_t start = micros();
+    client.write(buffer, requestSize);
+    uint8_t got = 0;
+    while (got < requestSize && client.connected()) {
+      int n = client.read(buffer + got, requestSize - got);
+      if (n > 0) got += n;
+    }
+    uint32_t elapsed = micros() - start;
+    if (got < requestSize) break;
+    if (adaptive) Ethernet_SPI2.addRttSample(serverIP, elapsed);
+    sum += elapsed;
+    if (elapsed > worst) worst = elapsed;
+    if (elapsed > 20000) slow++; // needed a retransmission
+    done++;
+    Ethernet_SPI2.maintain();
+  }
+  client.stop();
+
+  Serial.print(adaptive ? "adaptive" : "200 ms");
+  Serial.print("\t");
+  Serial.print(done);
+  Serial.print("\t");
+  Serial.print(done ? sum / done : 0);
+  Serial.print("\t");
+  Serial.print(worst);
+  Serial.print("\t");
+  Serial.print(slow);
+  Serial.print("\t");
+  Serial.println(Ethernet_SPI2.smoothedRtt(serverIP));
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial) {
+    ; // wait for serial port to connect. Needed for native USB port only
+  }
+
+  Ethernet_SPI2.init(9);
+  Ethernet_SPI2.begin(mac, ip);
+  delay(1000);
+
+  Serial.println("timeout\treplies\tavg us\tmax us\tslow\tsrtt us");
+  runTest(false);
+  delay(500);
+  runTest(true);
+  Serial.println("done");
+}
+
+void loop() {
+}
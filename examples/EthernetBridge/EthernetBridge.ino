@@ -0,0 +1,221 @@
+/*
+ Ethernet Bridge
+
+ Turns the board into a two port switch: every frame received on one
+ adapter is sent out of the other, unless the destination is known to
+ live on the port it came from.  Devices can then be daisy-chained
+ without an external switch.
+
+ The first adapter (stock Ethernet library, SPI) is driven through a small
+ MACRAW adapter below, the second one (Ethernet_SPI2) through
+ EthernetRaw_SPI2.  The second adapter keeps its own IP stack and serves
+ the bridge statistics on port 80 to the hosts on its side.
+
+ Every 5 seconds the forwarding rate (frames/s) and the latency are
+ printed.  Load the bridge with, for example, iperf3 between two hosts
+ connected to the two ports.
+
+ 2023 Dave Nardella
+
+*/
+
+#include <SPI.h>
+#include <Ethernet.h>
+#include <utility/w5100.h>
+#include <Ethernet_SPI2.h>
+#include <EthernetBridge_SPI2.h>
+
+byte mac_SPI1[] = {
+  0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED
+};
+
+byte mac_SPI2[] = {
+  0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xEF
+};
+
+IPAddress ip_SPI1(192, 168, 0, 177);
+IPAddress ip_SPI2(192, 168, 0, 178);
+
+// MACRAW on socket 0 of the stock library's chip, through its low level
+// W5100 class.  Socket 0 must not be used by anything else.
+class StockRawPort : public EthernetBridgePort_SPI2 {
+public:
+  StockRawPort() : pending(false) { }
+
+  bool begin() {
+    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    W5100.writeSnMR(0, SnMR::MACRAW);
+    W5100.execCmdSn(0, Sock_OPEN);
+    bool ok = W5100.readSnSR(0) == SnSR::MACRAW;
+    SPI.endTransaction();
+    return ok;
+  }
+
+  virtual int readFrames(uint8_t *buf, uint16_t size, uint16_t *lens, uint8_t maxFrames) {
+    uint8_t n = 0;
+    uint16_t used = 0;
+    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    uint16_t rsr = W5100.readSnRX_RSR(0);
+    uint16_t ptr = W5100.readSnRX_RD(0);
+    while (n < maxFrames && rsr >= 2) {
+      uint8_t head[2];
+      readRing(ptr, head, 2);
+      // the length counts the 2 header bytes
+      uint16_t len = ((head[0] << 8) | head[1]) - 2;
+      if (len + 2 > rsr || used + len > size) break;
+      readRing(ptr + 2, buf + used, len);
+      lens[n++] = len;
+      used += len;
+      ptr += len + 2;
+      rsr -= len + 2;
+    }
+    if (n) {
+      W5100.writeSnRX_RD(0, ptr);
+      W5100.execCmdSn(0, Sock_RECV);
+    }
+    SPI.endTransaction();
+    return n;
+  }
+
+  virtual bool sendFrame(const uint8_t *frame, uint16_t len, bool wait) {
+    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    if (W5100.readSnTX_FSR(0) < len) {
+      SPI.endTransaction();
+      return false;
+    }
+    uint16_t ptr = W5100.readSnTX_WR(0);
+    writeRing(ptr, frame, len);
+    W5100.writeSnTX_WR(0, ptr + len);
+    if (pending) waitSent();
+    W5100.execCmdSn(0, Sock_SEND);
+    pending = true;
+    if (wait) waitSent();
+    SPI.endTransaction();
+    return true;
+  }
+
+private:
+  bool pending;
+
+  void waitSent() {
+    while (!(W5100.readSnIR(0) & SnIR::SEND_OK)) ;
+    W5100.writeSnIR(0, SnIR::SEND_OK);
+    pending = false;
+  }
+
+  void readRing(uint16_t ptr, uint8_t *dst, uint16_t len) {
+    uint16_t offset = ptr & W5100.SMASK;
+    if (W5100.hasOffsetAddressMapping() || offset + len <= W5100.SSIZE) {
+      W5100.read(W5100.RBASE(0) + offset, dst, len);
+    } else {
+      uint16_t size = W5100.SSIZE - offset;
+      W5100.read(W5100.RBASE(0) + offset, dst, size);
+      W5100.read(W5100.RBASE(0), dst + size, len - size);
+    }
+  }
+
+  void writeRing(uint16_t ptr, const uint8_t *src, uint16_t len) {
+    uint16_t offset = ptr & W5100.SMASK;
+    if (W5100.hasOffsetAddressMapping() || offset + len <= W5100.SSIZE) {
+      W5100.write(W5100.SBASE(0) + offset, src, len);
+    } else {
+      uint16_t size = W5100.SSIZE - offset;
+      W5100.write(W5100.SBASE(0) + offset, src, size);
+      W5100.write(W5100.SBASE(0), src + size, len - size);
+    }
+  }
+};
+
+StockRawPort port_SPI1;
+EthernetRaw_SPI2 raw_SPI2;
+EthernetRawPort_SPI2 port_SPI2(raw_SPI2);
+EthernetBridge_SPI2 bridge(port_SPI1, port_SPI2);
+EthernetServer_SPI2 server(80);
+
+EthernetBridgeStats_SPI2 last;
+uint32_t lastReport = 0;
+
+uint32_t sum(const uint32_t *counter) {
+  return counter[0] + counter[1];
+}
+
+void report() {
+  const EthernetBridgeStats_SPI2 &st = bridge.stats();
+  uint32_t now = millis();
+  uint32_t elapsed = now - lastReport;
+  uint32_t out = sum(st.forwarded) + sum(st.flooded) - sum(last.forwarded) - sum(last.flooded);
+  uint32_t count = st.latencyCount - last.latencyCount;
+
+  Serial.print("frames/s: ");
+  Serial.print(elapsed ? out * 1000 / elapsed : 0);
+  Serial.print("  latency avg/max us: ");
+  Serial.print(count ? (st.latencySum - last.latencySum) / count : 0);
+  Serial.print("/");
+  Serial.print(st.latencyMax);
+  Serial.print("  filtered: ");
+  Serial.print(sum(st.filtered) - sum(last.filtered));
+  Serial.print("  dropped: ");
+  Serial.println(sum(st.txErrors) - sum(last.txErrors));
+
+  last = st;
+  lastReport = now;
+}
+
+void serveStats() {
+  EthernetClient_SPI2 client = server.available();
+  if (!client) return;
+  const EthernetBridgeStats_SPI2 &st = bridge.stats();
+  client.println("HTTP/1.1 200 OK");
+  client.println("Content-Type: text/plain");
+  client.println("Connection: close");
+  client.println();
+  for (uint8_t p = 0; p < 2; p++) {
+    client.print("port ");
+    client.print(p);
+    client.print(": rx ");
+    client.print(st.rxFrames[p]);
+    client.print(" forwarded ");
+    client.print(st.forwarded[p]);
+    client.print(" flooded ");
+    client.print(st.flooded[p]);
+    client.print(" filtered ");
+    client.print(st.filtered[p]);
+    client.print(" dropped ");
+    client.println(st.txErrors[p]);
+  }
+  client.stop();
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial) {
+    ; // wait for serial port to connect. Needed for native USB port only
+  }
+  Serial.println("Ethernet Bridge");
+
+  Ethernet.init(10);
+  Ethernet.begin(mac_SPI1, ip_SPI1);
+  Ethernet_SPI2.init(9);
+  Ethernet_SPI2.begin(mac_SPI2, ip_SPI2);
+
+  // MACRAW needs socket 0, open it before anything else
+  if (!port_SPI1.begin()) {
+    Serial.println("cannot open MACRAW on the SPI adapter");
+    while (true) delay(1);
+  }
+  // no MAC filter: the bridge needs every frame
+  if (!raw_SPI2.begin(false)) {
+    Serial.println("cannot open MACRAW on the SPI2 adapter");
+    while (true) delay(1);
+  }
+  // frames for our own stack are not forwarded
+  bridge.setLocalMAC(mac_SPI2);
+  server.begin();
+  lastReport = millis();
+}
+
+void loop() {
+  bridge.poll();
+  serveStats();
+  if (millis() - lastReport >= 5000) report();
+}
@@ -0,0 +1,121 @@
+/*
+ Offload M4
+
+ GIGA R1 (or Portenta H7): the network runs on the M4 core while the M7
+ keeps computing.  Upload this same sketch to both cores (Flash split
+ with room for the M4).  The M4 brings Ethernet_SPI2 up with DHCP and
+ serves the requests of the M7, which downloads a page every 2 seconds
+ through EthernetOffloadClient_SPI2 and counts primes in between.
+
+ Every 5 seconds the M7 prints how many numbers it checked and how many
+ bytes it downloaded; without the offload the downloads would stall the
+ computation.
+
+ 2023 Dave Nardella
+
+*/
+
+#include <SPI.h>
+#include <Ethernet_SPI2.h>
+#include <EthernetOffload_SPI2.h>
+
+#ifdef CORE_CM4
+
+byte mac[] = {
+  0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xEF
+};
+
+EthernetOffloadService_SPI2 service;
+
+void setup() {
+  Ethernet_SPI2.init(9);
+  while (Ethernet_SPI2.begin(mac) == 0) {
+    delay(1000); // no DHCP server yet
+  }
+  if (!service.begin()) {
+    // the shared block overlaps the RAM of the M4: see
+    // ETHERNET_OFFLOAD_ADDR in EthernetOffload_SPI2.h
+    while (true) delay(1000);
+  }
+}
+
+void loop() {
+  service.poll();
+}
+
+#else // CORE_CM7
+
+#include <RPC.h>
+
+const char server[] = "example.com";
+
+EthernetOffloadClient_SPI2 client;
+uint32_t candidate = 3;
+uint32_t primes = 1;
+uint32_t checked = 0;
+uint32_t downloaded = 0;
+uint32_t lastFetch = 0;
+uint32_t lastReport = 0;
+
+bool isPrime(uint32_t n) {
+  for (uint32_t d = 3; d * d <= n; d += 2) {
+    if (n % d == 0) return false;
+  }
+  return true;
+}
+
+void fetch() {
+  if (!client.connected()) {
+    client.stop();
+    if (!client.connect(server, 80)) return;
+    client.println("GET / HTTP/1.1");
+    client.print("Host: ");
+    client.println(server);
+    client.println("Connection: close");
+    client.println();
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial) {
+    ; // wait for serial port to connect. Needed for native USB port only
+  }
+  RPC.begin(); // boots the M4
+  Serial.println("waiting for the M4...");
+  if (!EthernetOffload_SPI2.begin()) {
+    Serial.println("no network service on the M4, or the shared block is unusable");
+    while (true) delay(1);
+  }
+  Serial.print("IP address: ");
+  Serial.println(EthernetOffload_SPI2.localIP());
+}
+
+void loop() {
+  // compute for a while, the M4 moves the data meanwhile
+  for (uint16_t i = 0; i < 1000; i++) {
+    if (isPrime(candidate)) primes++;
+    candidate += 2;
+    checked++;
+  }
+
+  uint8_t buf[256];
+  int n;
+  while ((n = client.read(buf, sizeof(buf))) > 0) downloaded += n;
+
+  if (millis() - lastFetch >= 2000) {
+    lastFetch = millis();
+    fetch();
+  }
+  if (millis() - lastReport >= 5000) {
+    lastReport = millis();
+    Serial.print("checked: ");
+    Serial.print(checked);
+    Serial.print("  primes: ");
+    Serial.print(primes);
+    Serial.print("  downloaded: ");
+    Serial.println(downloaded);
+  }
+}
+
+#endif
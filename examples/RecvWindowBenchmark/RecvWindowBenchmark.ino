@@ -0,0 +1,93 @@
+/*
+ Receive Window Benchmark
+
+ Downloads a fixed amount of data over TCP with different receive window
+ update thresholds and prints throughput and the number of socket
+ commands (Sock_RECV and friends) issued for each setting.
+
+ On the host run a simple source of data, for example:
+
+   while true; do head -c 1048576 /dev/zero | nc -l -p 5001 -q 1; done
+
+ then set serverIP below to the host address.
+
+ 2023 Dave Nardella
+
+*/
+
+#include <SPI.h>
+#include <Ethernet_SPI2.h>
+
+byte mac[] = {
+  0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xEF
+};
+
+IPAddress ip(192, 168, 0, 178);
+IPAddress serverIP(192, 168, 0, 10);
+const uint16_t serverPort = 5001;
+
+const uint32_t totalBytes = 1048576;     // must match what the host sends
+
+// 0 means adaptive
+const uint16_t thresholds[] = { 250, 512, 1024, 0 };
+const uint16_t readSizes[] = { 1, 64, 1024 };
+
+uint8_t buffer[1024];
+
+void runTest(uint16_t threshold, uint16_t readSize)
+{
+  EthernetClient_SPI2 client;
+
+  if (!client.connect(serverIP, serverPort)) {
+    Serial.println("connection failed");
+    return;
+  }
+  client.setWindowUpdateThreshold(threshold);
+
+  uint32_t received = 0;
+  uint32_t cmds = Ethernet_SPI2.socketCommandCount();
+  uint32_t start = millis();
+  while (received < totalBytes && (client.connected() || client.available())) {
+    int n = client.read(buffer, readSize);
+    if (n > 0) received += n;
+  }
+  uint32_t elapsed = millis() - start;
+  cmds = Ethernet_SPI2.socketCommandCount() - cmds;
+  client.stop();
+
+  if (threshold)
+    Serial.print(threshold);
+  else
+    Serial.print("adaptive");
+  Serial.print("\t");
+  Serial.print(readSize);
+  Serial.print("\t");
+  Serial.print(received);
+  Serial.print("\t");
+  Serial.print(elapsed ? (received / elapsed) : 0); // bytes/ms = KB/s
+  Serial.print("\t");
+  Serial.println(cmds);
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial) {
+    ; // wait for serial port to connect. Needed for native USB port only
+  }
+
+  Ethernet_SPI2.init(9);
+  Ethernet_SPI2.begin(mac, ip);
+  delay(1000);
+
+  Serial.println("threshold\tread\tbytes\tKB/s\tcommands");
+  for (unsigned r = 0; r < sizeof(readSizes) / sizeof(readSizes[0]); r++) {
+    for (unsigned t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); t++) {
+      runTest(thresholds[t], readSizes[r]);
+      delay(500);
+    }
+  }
+  Serial.println("done");
+}
+
+void loop() {
+}
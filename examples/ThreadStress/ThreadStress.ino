@@ -0,0 +1,178 @@
+/*
+ Thread Stress
+
+ Mbed OS boards only (GIGA R1, Portenta H7).  Several threads use the
+ network at the same time: each TCP thread keeps its own connection to an
+ echo server and checks every byte that comes back, reconnecting now and
+ then so sockets are opened and closed concurrently; one more thread does
+ the same with UDP datagrams.  The main thread runs maintain() and prints
+ the counters every 5 seconds.  Any mismatch means a locking problem.
+
+ On the host run echo servers, for example:
+
+   socat TCP4-LISTEN:7,fork,reuseaddr EXEC:cat &
+   socat UDP4-RECVFROM:7,fork EXEC:cat &
+
+ then set serverIP below to the host address.
+
+ extras/test/ThreadStress.cpp runs the same kind of load on a PC, against
+ a fake chip and under ThreadSanitizer.
+
+ 2023 Dave Nardella
+
+*/
+
+#ifndef ARDUINO_ARCH_MBED
+#error "This example needs Mbed OS threads (GIGA R1, Portenta H7)"
+#endif
+
+#include <SPI.h>
+#include <Ethernet_SPI2.h>
+#include <mbed.h>
+
+byte mac[] = {
+  0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xEF
+};
+
+IPAddress ip(192, 168, 0, 178);
+IPAddress serverIP(192, 168, 0, 10);
+const uint16_t serverPort = 7;
+
+const uint8_t tcpThreads = 4;
+const uint16_t blockSize = 512;
+const uint16_t reconnectEvery = 200; // blocks
+
+struct Counters {
+  volatile uint32_t blocks;
+  volatile uint32_t bytes;
+  volatile uint32_t mismatches;
+  volatile uint32_t failures;
+};
+
+Counters counters[tcpThreads + 1]; // the last one is UDP
+rtos::Thread *threads[tcpThreads + 1];
+
+// A pattern that differs per thread and per block, so data crossing
+// between sockets or blocks is caught
+void fill(uint8_t *buf, uint16_t len, uint8_t id, uint32_t block) {
+  for (uint16_t i = 0; i < len; i++) {
+    buf[i] = (uint8_t)(id * 61 + block * 7 + i);
+  }
+}
+
+void tcpWorker(uint8_t id) {
+  Counters &c = counters[id];
+  uint8_t out[blockSize], in[blockSize];
+  uint32_t block = 0;
+
+  while (true) {
+    EthernetClient_SPI2 client;
+    if (!client.connect(serverIP, serverPort)) {
+      c.failures++;
+      rtos::ThisThread::sleep_for(100ms);
+      continue;
+    }
+    for (uint16_t n = 0; n < reconnectEvery && client.connected(); n++, block++) {
+      uint16_t len = 1 + (block * 37 + id) % blockSize;
+      fill(out, len, id, block);
+      if (client.write(out, len) != len) {
+        c.failures++;
+        break;
+      }
+      uint16_t got = 0;
+      uint32_t start = millis();
+      while (got < len && client.connected() && millis() - start < 2000) {
+        int r = client.read(in + got, len - got);
+        if (r > 0) got += r;
+        else rtos::ThisThread::yield();
+      }
+      if (got < len) {
+        c.failures++;
+        break;
+      }
+      if (memcmp(in, out, len) != 0) c.mismatches++;
+      c.blocks++;
+      c.bytes += len;
+    }
+    client.stop();
+  }
+}
+
+void udpWorker() {
+  Counters &c = counters[tcpThreads];
+  uint8_t out[blockSize], in[blockSize];
+  uint32_t block = 0;
+  EthernetUDP_SPI2 udp;
+
+  udp.begin(8888);
+  while (true) {
+    uint16_t len = 1 + (block * 53) % blockSize;
+    fill(out, len, tcpThreads, block);
+    udp.beginPacket(serverIP, serverPort);
+    udp.write(out, len);
+    if (!udp.endPacket()) {
+      c.failures++;
+      continue;
+    }
+    uint32_t start = millis();
+    int size = 0;
+    while ((size = udp.parsePacket()) == 0 && millis() - start < 500) {
+      rtos::ThisThread::yield();
+    }
+    if (size == 0) {
+      c.failures++; // lost, UDP may drop
+    } else {
+      int got = udp.read(in, sizeof(in));
+      if (got != len || memcmp(in, out, len) != 0) c.mismatches++;
+      c.blocks++;
+      c.bytes += got;
+    }
+    block++;
+  }
+}
+
+void report() {
+  for (uint8_t i = 0; i <= tcpThreads; i++) {
+    Serial.print(i < tcpThreads ? "tcp" : "udp");
+    Serial.print(i);
+    Serial.print("\tblocks ");
+    Serial.print(counters[i].blocks);
+    Serial.print("\tbytes ");
+    Serial.print(counters[i].bytes);
+    Serial.print("\tmismatches ");
+    Serial.print(counters[i].mismatches);
+    Serial.print("\tfailures ");
+    Serial.println(counters[i].failures);
+  }
+  Serial.println();
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial) {
+    ; // wait for serial port to connect. Needed for native USB port only
+  }
+  Serial.println("Thread Stress");
+
+  Ethernet_SPI2.init(9);
+  Ethernet_SPI2.begin(mac, ip);
+  delay(1000);
+
+  for (uint8_t i = 0; i < tcpThreads; i++) {
+    threads[i] = new rtos::Thread(osPriorityNormal, 4096);
+    threads[i]->start([i]() { tcpWorker(i); });
+  }
+  threads[tcpThreads] = new rtos::Thread(osPriorityNormal, 4096);
+  threads[tcpThreads]->start(udpWorker);
+}
+
+uint32_t lastReport = 0;
+
+void loop() {
+  Ethernet_SPI2.maintain();
+  if (millis() - lastReport >= 5000) {
+    lastReport = millis();
+    report();
+  }
+  delay(10);
+}
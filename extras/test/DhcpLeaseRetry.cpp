@@ -0,0 +1,196 @@
+/*
+ DHCP lease retry test
+
+ Runs DhcpClass_SPI2 on the host against a scripted DHCP server and a
+ fake clock.  After the lease is bound the server goes silent, and the
+ test checks that:
+  - a failed rebind is retried as a rebind (DISCOVER), never as a renew
+    REQUEST to the server the rebind has forgotten
+  - the bind after the lease expired is retried after a backoff, and
+    binds again once the server answers
+
+ Build and run from this directory:
+
+   g++ -std=gnu++11 -Istubs -I../../src DhcpLeaseRetry.cpp ../../src/Dhcp_SPI2.cpp -o DhcpLeaseRetry
+   ./DhcpLeaseRetry
+
+ 2023 Dave Nardella
+
+*/
+
+#include <stdio.h>
+#include "Ethernet_SPI2.h"
+#include "Dhcp_SPI2.h"
+#include "utility/w5100_SPI2.h"
+
+static unsigned long now;
+unsigned long millis() { return now; }
+long random(long min, long max) { return min; }
+void yield() { }
+
+static bool serverUp = true;
+static uint8_t sent[64];         // message type of every message sent
+static int sentCount;
+static uint8_t reply[300];      // the answer waiting to be read
+static int replyLen, replyPos;
+
+static const uint8_t serverIp[4] = { 192, 168, 1, 1 };
+static const uint8_t leasedIp[4] = { 192, 168, 1, 50 };
+static const uint32_t LEASE = 1000, T1 = 500, T2 = 875;
+
+static uint8_t *putOpt32(uint8_t *opt, uint8_t code, uint32_t value)
+{
+	*opt++ = code;
+	*opt++ = 4;
+	*opt++ = value >> 24;
+	*opt++ = value >> 16;
+	*opt++ = value >> 8;
+	*opt++ = value;
+	return opt;
+}
+
+// What a server answers to a DISCOVER (OFFER) or a REQUEST (ACK)
+static void answer(const uint8_t *request, uint8_t type)
+{
+	memset(reply, 0, sizeof(reply));
+	reply[0] = DHCP_BOOTREPLY;
+	reply[1] = DHCP_HTYPE10MB;
+	reply[2] = DHCP_HLENETHERNET;
+	memcpy(reply + 4, request + 4, 4);      // xid
+	memcpy(reply + 16, leasedIp, 4);        // yiaddr
+	memcpy(reply + 28, request + 28, 6);    // chaddr
+	uint8_t *opt = reply + DHCP_COOKIE_OFFSET;
+	*opt++ = (uint8_t)(MAGIC_COOKIE >> 24);
+	*opt++ = (uint8_t)(MAGIC_COOKIE >> 16);
+	*opt++ = (uint8_t)(MAGIC_COOKIE >> 8);
+	*opt++ = (uint8_t)MAGIC_COOKIE;
+	*opt++ = dhcpMessageType;
+	*opt++ = 1;
+	*opt++ = type;
+	*opt++ = dhcpServerIdentifier;
+	*opt++ = 4;
+	memcpy(opt, serverIp, 4);
+	opt += 4;
+	opt = putOpt32(opt, dhcpIPaddrLeaseTime, LEASE);
+	opt = putOpt32(opt, dhcpT1value, T1);
+	opt = putOpt32(opt, dhcpT2value, T2);
+	*opt++ = endOption;
+	replyLen = opt - reply;
+	replyPos = 0;
+}
+
+// The socket calls DhcpClass_SPI2 makes, backed by the script above
+uint8_t EthernetUDP_SPI2::begin(uint16_t port) { _port = port; return 1; }
+uint8_t EthernetUDP_SPI2::beginMulticast(IPAddress, uint16_t) { return 0; }
+void EthernetUDP_SPI2::stop() { replyLen = 0; }
+int EthernetUDP_SPI2::beginPacket(IPAddress, uint16_t) { return 0; }
+int EthernetUDP_SPI2::beginPacket(const char *, uint16_t) { return 0; }
+int EthernetUDP_SPI2::endPacket() { return 0; }
+size_t EthernetUDP_SPI2::write(uint8_t) { return 0; }
+size_t EthernetUDP_SPI2::write(const uint8_t *, size_t) { return 0; }
+int EthernetUDP_SPI2::available() { return replyLen - replyPos; }
+int EthernetUDP_SPI2::read() { return replyPos < replyLen ? reply[replyPos++] : -1; }
+int EthernetUDP_SPI2::peek() { return replyPos < replyLen ? reply[replyPos] : -1; }
+
+int EthernetUDP_SPI2::sendTo(IPAddress ip, uint16_t port, const uint8_t *buffer, uint16_t size, bool wait)
+{
+	uint8_t type = buffer[242];
+	if (sentCount < (int)sizeof(sent)) sent[sentCount++] = type;
+	if (serverUp) answer(buffer, type == DHCP_DISCOVER ? DHCP_OFFER : DHCP_ACK);
+	return 1;
+}
+
+int EthernetUDP_SPI2::parsePacket()
+{
+	if (replyPos != 0 || replyLen == 0) return 0;
+	_remoteIP = IPAddress(serverIp[0], serverIp[1], serverIp[2], serverIp[3]);
+	_remotePort = DHCP_SERVER_PORT;
+	return replyLen;
+}
+
+int EthernetUDP_SPI2::read(unsigned char *buffer, size_t len)
+{
+	if (len > (size_t)(replyLen - replyPos)) len = replyLen - replyPos;
+	memcpy(buffer, reply + replyPos, len);
+	replyPos += len;
+	return len;
+}
+
+int EthernetUDP_SPI2::peek(uint8_t *buffer, size_t len, size_t offset)
+{
+	if (replyPos + (int)offset >= replyLen) return 0;
+	if (len > replyLen - replyPos - offset) len = replyLen - replyPos - offset;
+	memcpy(buffer, reply + replyPos + offset, len);
+	return len;
+}
+
+void EthernetUDP_SPI2::flush() { replyLen = 0; }
+
+static int failures;
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL line %d: %s\n", __LINE__, #cond); failures++; } } while (0)
+
+static DhcpClass_SPI2 dhcp;
+
+// One maintain() step, as Ethernet_SPI2.maintain() drives it
+static int step()
+{
+	if (dhcp.binding()) {
+		int ret = dhcp.poll_DHCP_lease();
+		return ret == 1 ? DHCP_CHECK_BIND_OK : ret < 0 ? DHCP_CHECK_BIND_FAIL : DHCP_CHECK_NONE;
+	}
+	return dhcp.checkLease();
+}
+
+// Runs steps of 100 ms until rc comes back or the time limit passes
+static bool runUntil(int rc, unsigned long limit)
+{
+	for (unsigned long end = now + limit; now < end; now += 100) {
+		if (step() == rc) return true;
+	}
+	return false;
+}
+
+int main()
+{
+	uint8_t mac[6] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
+
+	now = 1000;
+	CHECK(dhcp.beginAsync(mac, IPAddress((uint32_t)0), 10000, 2000) == 1);
+	CHECK(runUntil(DHCP_CHECK_BIND_OK, 10000));
+	CHECK(dhcp.getLocalIp() == IPAddress(192, 168, 1, 50));
+
+	// the server goes away: the renews fail, then the rebind
+	serverUp = false;
+	CHECK(runUntil(DHCP_CHECK_REBIND_FAIL, T2 * 1000 + 20000));
+
+	// the retry half way to expiry is a rebind again, never a renew
+	sentCount = 0;
+	int rc = DHCP_CHECK_NONE;
+	while (rc != DHCP_CHECK_LEASE_EXPIRED && now < (LEASE + 30) * 1000) {
+		rc = step();
+		CHECK(rc != DHCP_CHECK_RENEW_FAIL);
+		now += 100;
+	}
+	CHECK(rc == DHCP_CHECK_LEASE_EXPIRED);
+	CHECK(sentCount > 0);
+	for (int i = 0; i < sentCount; i++) CHECK(sent[i] == DHCP_DISCOVER);
+
+	// the bind after expiry fails, and is started again after the backoff
+	CHECK(runUntil(DHCP_CHECK_BIND_FAIL, 12000));
+	CHECK(dhcp.restarting());
+	CHECK(!dhcp.binding());
+	now += DHCP_RETRY_MIN / 2;
+	step();
+	CHECK(!dhcp.binding());
+	now += DHCP_RETRY_MIN;
+	step();
+	CHECK(dhcp.binding());
+
+	// with the server back the lease is bound again
+	serverUp = true;
+	CHECK(runUntil(DHCP_CHECK_BIND_OK, 10000));
+	CHECK(dhcp.getLocalIp() == IPAddress(192, 168, 1, 50));
+
+	if (failures == 0) printf("DhcpLeaseRetry: all checks passed\n");
+	return failures != 0;
+}
@@ -0,0 +1,419 @@
+/*
+ Thread stress test
+
+ Host counterpart of examples/ThreadStress: the library built with the
+ Mbed locking (ARDUINO_ARCH_MBED, rtos::Mutex on std::recursive_mutex)
+ is driven from several std::threads against a fake W5500 behind SPI1.
+ The fake echoes every TCP and UDP send back into the socket's RX
+ buffer, so each thread can check it gets exactly its own data back.
+ UDP sends can be held in flight, as the chip does while it resolves a
+ new destination, to check that async sends are pipelined and that
+ TX_WR never moves under a SEND.
+
+ The fake chip is only touched through SPI, so with ThreadSanitizer any
+ register or buffer access outside the bus lock, and any state[] access
+ racing another thread, shows up as a data race.
+
+ Build and run from this directory:
+
+   g++ -std=gnu++11 -O1 -g -fsanitize=thread -pthread -DARDUINO_ARCH_MBED \
+     -Istubs -I../../src ThreadStress.cpp ../../src/*.cpp ../../src/utility/*.cpp \
+     -o ThreadStress
+   ./ThreadStress
+
+ 2023 Dave Nardella
+
+*/
+
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "Ethernet_SPI2.h"
+#include "utility/w5100_SPI2.h"
+
+#ifndef ETHERNET_SPI2_LOCKING
+#error "build with -DARDUINO_ARCH_MBED, the locking is what is tested"
+#endif
+
+#ifndef TCP_THREADS
+#define TCP_THREADS	4
+#endif
+#define ITERATIONS	200
+
+/*****************************************/
+/*          Arduino core                 */
+/*****************************************/
+
+static const std::chrono::steady_clock::time_point boot = std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+unsigned long micros()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+void delay(unsigned long ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+void delayMicroseconds(unsigned int us) { std::this_thread::sleep_for(std::chrono::microseconds(us)); }
+void yield() { std::this_thread::yield(); }
+long random(long min, long max) { return min; }
+void pinMode(uint8_t, uint8_t) { }
+const IPAddress INADDR_NONE(0, 0, 0, 0);
+SPIClass SPI1;
+
+/*****************************************/
+/*          Fake W5500                   */
+/*****************************************/
+
+// Register offsets, as in the W5500 datasheet
+#define MR		0x00
+#define PHYCFGR		0x2E
+#define VERSIONR	0x39
+#define Sn_MR		0x00
+#define Sn_CR		0x01
+#define Sn_IR		0x02
+#define Sn_SR		0x03
+#define Sn_DIPR		0x0C
+#define Sn_DPORT	0x10
+#define Sn_RXBUF_SIZE	0x1E
+#define Sn_TXBUF_SIZE	0x1F
+#define Sn_TX_FSR	0x20
+#define Sn_TX_RD	0x22
+#define Sn_TX_WR	0x24
+#define Sn_RX_RSR	0x26
+#define Sn_RX_RD	0x28
+#define Sn_RX_WR	0x2A
+
+static uint8_t common[0x100];
+static uint8_t sockreg[8][0x100];
+static uint8_t txbuf[8][16384];
+static uint8_t rxbuf[8][16384];
+
+// the SPI frame being clocked: address, control byte, then data
+static bool selected;
+static uint32_t framePos;
+static uint16_t frameAddr;
+static uint8_t frameCtrl;
+
+// UDP SENDs held in flight until released, or until polled too long
+static std::atomic<bool> holdUdp(false);
+static std::atomic<int> forcedSends(0);
+static bool inFlight[8];
+static uint16_t sendEnd[8];   // TX_WR when SEND was issued
+static uint32_t heldPolls[8];
+static int faults;            // protocol errors seen by the chip
+
+static uint16_t get16(uint8_t s, uint8_t reg) { return (sockreg[s][reg] << 8) | sockreg[s][reg + 1]; }
+static void set16(uint8_t s, uint8_t reg, uint16_t v) { sockreg[s][reg] = v >> 8; sockreg[s][reg + 1] = v; }
+
+static void chipReset()
+{
+	memset(common, 0, sizeof(common));
+	memset(sockreg, 0, sizeof(sockreg));
+	common[PHYCFGR] = 0x07; // link up, 100 Mbit full duplex
+	common[VERSIONR] = 0x04;
+	for (uint8_t s = 0; s < 8; s++) {
+		sockreg[s][Sn_RXBUF_SIZE] = 2;
+		sockreg[s][Sn_TXBUF_SIZE] = 2;
+	}
+}
+
+static void chipFault(uint8_t s, const char *what)
+{
+	printf("FAIL socket %d: %s\n", s, what);
+	faults++;
+}
+
+// The peer echoes what SEND took, up to end; UDP gets the W5500 RX header
+static void echo(uint8_t s, uint16_t end)
+{
+	uint16_t txmask = sockreg[s][Sn_TXBUF_SIZE] * 1024 - 1;
+	uint16_t rxsize = sockreg[s][Sn_RXBUF_SIZE] * 1024;
+	uint16_t rd = get16(s, Sn_TX_RD), len = end - rd;
+	uint8_t head[8];
+	uint8_t headLen = 0;
+
+	if (sockreg[s][Sn_SR] == SnSR::UDP) {
+		memcpy(head, &sockreg[s][Sn_DIPR], 6);
+		head[6] = len >> 8;
+		head[7] = len;
+		headLen = 8;
+	}
+	uint16_t wr = get16(s, Sn_RX_WR);
+	if ((uint16_t)(wr - get16(s, Sn_RX_RD)) + headLen + len <= rxsize) {
+		for (uint8_t i = 0; i < headLen; i++, wr++) rxbuf[s][wr & (rxsize - 1)] = head[i];
+		for (uint16_t i = 0; i < len; i++, wr++) rxbuf[s][wr & (rxsize - 1)] = txbuf[s][(rd + i) & txmask];
+		set16(s, Sn_RX_WR, wr);
+	}
+	set16(s, Sn_TX_RD, end);
+	sockreg[s][Sn_IR] |= SnIR::SEND_OK;
+}
+
+static void send(uint8_t s)
+{
+	if (inFlight[s]) {
+		chipFault(s, "SEND while a SEND is in flight");
+		return;
+	}
+	if (sockreg[s][Sn_SR] == SnSR::UDP && holdUdp) {
+		inFlight[s] = true;
+		sendEnd[s] = get16(s, Sn_TX_WR);
+		heldPolls[s] = 0;
+		return;
+	}
+	echo(s, get16(s, Sn_TX_WR));
+}
+
+// A held SEND completes once released, when the driver polls Sn_IR
+static void pollSend(uint8_t s)
+{
+	if (!inFlight[s]) return;
+	if (holdUdp && ++heldPolls[s] < 100000) return;
+	if (holdUdp) forcedSends++;
+	inFlight[s] = false;
+	echo(s, sendEnd[s]);
+}
+
+static void command(uint8_t s, uint8_t cmd)
+{
+	switch (cmd) {
+	case Sock_OPEN:
+		switch (sockreg[s][Sn_MR] & 0x0F) {
+		case 1: sockreg[s][Sn_SR] = SnSR::INIT; break;
+		case 2: sockreg[s][Sn_SR] = SnSR::UDP; break;
+		case 3: sockreg[s][Sn_SR] = SnSR::IPRAW; break;
+		case 4: sockreg[s][Sn_SR] = SnSR::MACRAW; break;
+		}
+		for (uint8_t r = Sn_TX_RD; r < Sn_RX_WR + 2; r++) sockreg[s][r] = 0;
+		inFlight[s] = false;
+		break;
+	case Sock_LISTEN: sockreg[s][Sn_SR] = SnSR::LISTEN; break;
+	case Sock_CONNECT: sockreg[s][Sn_SR] = SnSR::ESTABLISHED; break;
+	case Sock_DISCON:
+	case Sock_CLOSE: sockreg[s][Sn_SR] = SnSR::CLOSED; break;
+	case Sock_SEND:
+	case Sock_SEND_MAC: send(s); break;
+	}
+}
+
+static uint8_t chipRead(uint8_t block, uint16_t addr)
+{
+	if (block == 0) return common[addr & 0xFF];
+	uint8_t s = (block - 1) >> 2;
+	switch ((block - 1) & 3) {
+	case 0: {
+		uint8_t reg = addr & 0xFF;
+		uint16_t size = sockreg[s][Sn_TXBUF_SIZE] * 1024;
+		set16(s, Sn_TX_FSR, size - (uint16_t)(get16(s, Sn_TX_WR) - get16(s, Sn_TX_RD)));
+		set16(s, Sn_RX_RSR, get16(s, Sn_RX_WR) - get16(s, Sn_RX_RD));
+		if (reg == Sn_IR) pollSend(s);
+		return sockreg[s][reg];
+	}
+	case 1: return txbuf[s][addr & (sockreg[s][Sn_TXBUF_SIZE] * 1024 - 1)];
+	case 2: return rxbuf[s][addr & (sockreg[s][Sn_RXBUF_SIZE] * 1024 - 1)];
+	}
+	return 0;
+}
+
+static void chipWrite(uint8_t block, uint16_t addr, uint8_t d)
+{
+	if (block == 0) {
+		if ((addr & 0xFF) == MR && (d & 0x80)) chipReset();
+		else common[addr & 0xFF] = d;
+		return;
+	}
+	uint8_t s = (block - 1) >> 2;
+	switch ((block - 1) & 3) {
+	case 0: {
+		uint8_t reg = addr & 0xFF;
+		if ((reg == Sn_TX_WR || reg == Sn_TX_WR + 1) && inFlight[s]) {
+			chipFault(s, "TX_WR moved under a SEND");
+		}
+		if (reg == Sn_CR) command(s, d);
+		else if (reg == Sn_IR) sockreg[s][reg] &= ~d;
+		else sockreg[s][reg] = d;
+		break;
+	}
+	case 1: txbuf[s][addr & (sockreg[s][Sn_TXBUF_SIZE] * 1024 - 1)] = d; break;
+	case 2: rxbuf[s][addr & (sockreg[s][Sn_RXBUF_SIZE] * 1024 - 1)] = d; break;
+	}
+}
+
+static uint8_t chipByte(uint8_t d)
+{
+	if (!selected) return 0;
+	switch (framePos++) {
+	case 0: frameAddr = d << 8; return 0;
+	case 1: frameAddr |= d; return 0;
+	case 2: frameCtrl = d; return 0;
+	}
+	uint8_t block = frameCtrl >> 3;
+	if (block >= 32) return 0;
+	if (frameCtrl & 0x04) {
+		chipWrite(block, frameAddr++, d);
+		return 0;
+	}
+	return chipRead(block, frameAddr++);
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	selected = (val == LOW);
+	framePos = 0;
+}
+
+uint8_t SPIClass::transfer(uint8_t d) { return chipByte(d); }
+
+void SPIClass::transfer(void *buf, size_t n)
+{
+	uint8_t *b = (uint8_t *)buf;
+	for (size_t i = 0; i < n; i++) b[i] = chipByte(b[i]);
+}
+
+/*****************************************/
+/*          Threads                      */
+/*****************************************/
+
+static const IPAddress peer(10, 0, 0, 2);
+static std::atomic<int> failures(0);
+static std::atomic<bool> running(true);
+
+static void fail(const char *who, int n, const char *what)
+{
+	printf("FAIL %s %d: %s\n", who, n, what);
+	failures++;
+}
+
+// Connect, send a pattern of its own, read it back, close
+static void tcpThread(int id)
+{
+	uint8_t out[300], in[300];
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		EthernetClient_SPI2 client;
+		if (!client.connect(peer, 7)) {
+			// every socket may be busy for a moment
+			yield();
+			continue;
+		}
+		uint16_t len = 50 + (i * 7 + id * 13) % 250;
+		for (uint16_t j = 0; j < len; j++) out[j] = id * 31 + i + j;
+		if (client.write(out, len) != len) fail("tcp", id, "short write");
+		uint16_t got = 0;
+		unsigned long start = millis();
+		while (got < len && millis() - start < 1000) {
+			int n = client.read(in + got, len - got);
+			if (n > 0) got += n;
+		}
+		if (got != len || memcmp(in, out, len) != 0) fail("tcp", id, "echo mismatch");
+		if (client.available()) fail("tcp", id, "data of another socket");
+		client.stop();
+	}
+}
+
+// Datagrams through both send paths, checked with their source
+static void udpThread()
+{
+	EthernetUDP_SPI2 udp;
+	uint8_t out[200], in[200];
+
+	if (!udp.begin(5000)) {
+		fail("udp", 0, "no socket");
+		return;
+	}
+	for (int i = 0; i < ITERATIONS * 2; i++) {
+		uint16_t len = 20 + i % 180;
+		for (uint16_t j = 0; j < len; j++) out[j] = i ^ j;
+		if (i & 1) {
+			udp.sendTo(peer, 7, out, len);
+		} else {
+			udp.beginPacket(peer, 7);
+			udp.write(out, len);
+			udp.endPacket();
+		}
+		int n = udp.parsePacket();
+		if (n != len) {
+			fail("udp", i, "datagram lost or merged");
+			continue;
+		}
+		udp.read(in, len);
+		if (memcmp(in, out, len) != 0) fail("udp", i, "echo mismatch");
+		if (udp.remoteIP() != peer || udp.remotePort() != 7) fail("udp", i, "wrong source");
+	}
+
+	// Async: the next datagram is written while the previous one is held
+	// in flight, and only its endPacket() waits for that one
+	uint8_t out2[200];
+	udp.setAsyncSend(true);
+	for (int i = 0; i < ITERATIONS; i++) {
+		uint16_t len = 20 + i % 180, len2 = 200 - i % 180;
+		for (uint16_t j = 0; j < len; j++) out[j] = i + j;
+		for (uint16_t j = 0; j < len2; j++) out2[j] = i * 3 + j;
+		holdUdp = true;
+		udp.beginPacket(peer, 7);
+		udp.write(out, len);
+		if (!udp.endPacket()) fail("udp async", i, "endPacket failed");
+		int forced = forcedSends;
+		udp.beginPacket(peer, 7);
+		if (udp.write(out2, len2) != len2) fail("udp async", i, "short write");
+		if (forcedSends != forced) fail("udp async", i, "write() waited for the send in flight");
+		holdUdp = false;
+		if (!udp.endPacket()) fail("udp async", i, "endPacket failed");
+		while (udp.sendStatus() == SendPending_SPI2) yield();
+		if (udp.parsePacket() != len) {
+			fail("udp async", i, "first datagram lost or merged");
+			continue;
+		}
+		udp.read(in, len);
+		if (memcmp(in, out, len) != 0) fail("udp async", i, "first echo mismatch");
+		if (udp.parsePacket() != len2) {
+			fail("udp async", i, "second datagram lost or merged");
+			continue;
+		}
+		udp.read(in, len2);
+		if (memcmp(in, out2, len2) != 0) fail("udp async", i, "second echo mismatch");
+	}
+	udp.stop();
+}
+
+// What the sketch's loop() would do meanwhile
+static void maintainThread()
+{
+	while (running) {
+		Ethernet_SPI2.maintain();
+		Ethernet_SPI2.linkStatus();
+		yield();
+	}
+}
+
+int main()
+{
+	uint8_t mac[6] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
+
+	Ethernet_SPI2.begin(mac, IPAddress(10, 0, 0, 1));
+	if (W5100_SPI2.getChip() != 55) {
+		printf("FAIL: fake W5500 not detected\n");
+		return 1;
+	}
+	// tuneRetransmission() then reads every socket's peer
+	Ethernet_SPI2.setAdaptiveRetransmission(true);
+	Ethernet_SPI2.setLinkPolicy(LinkCloseTCP_SPI2);
+
+	std::thread tcp[TCP_THREADS];
+	for (int i = 0; i < TCP_THREADS; i++) tcp[i] = std::thread(tcpThread, i);
+	std::thread udp(udpThread);
+	std::thread maint(maintainThread);
+
+	for (int i = 0; i < TCP_THREADS; i++) tcp[i].join();
+	udp.join();
+	running = false;
+	maint.join();
+
+	failures += faults;
+	if (failures == 0) printf("ThreadStress: all checks passed\n");
+	return failures != 0;
+}
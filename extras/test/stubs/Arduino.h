@@ -0,0 +1,36 @@
+#pragma once
+// Just enough of the Arduino core to build the library on the host
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+typedef uint8_t byte;
+typedef bool boolean;
+#define ARDUINO 10819
+unsigned long millis(); unsigned long micros(); void delay(unsigned long); void delayMicroseconds(unsigned int);
+long random(long, long); long random(long);
+void pinMode(uint8_t, uint8_t); void digitalWrite(uint8_t, uint8_t);
+#define OUTPUT 1
+#define INPUT 0
+#define LOW 0
+#define HIGH 1
+void yield(void);
+class IPAddress;
+class Print { public: virtual size_t write(uint8_t)=0; virtual size_t write(const uint8_t*b,size_t n){size_t r=0;while(n--)r+=write(*b++);return r;} size_t write(const char*s){return write((const uint8_t*)s,strlen(s));} void setWriteError(int e=1){} size_t print(const char*){return 0;} size_t print(int){return 0;} size_t println(const char* s=""){return 0;} size_t println(int){return 0;} size_t print(unsigned long){return 0;} size_t println(unsigned long){return 0;}  size_t print(double){return 0;} size_t print(unsigned int){return 0;} size_t println(unsigned int){return 0;} size_t print(long){return 0;} size_t println(long){return 0;} size_t print(const IPAddress&){return 0;} size_t println(const IPAddress&){return 0;} size_t print(char){return 0;} size_t print(unsigned long,int){return 0;} size_t print(uint8_t,int){return 0;} size_t println(double){return 0;}};
+class Stream : public Print { public: virtual int available()=0; virtual int read()=0; virtual int peek()=0; virtual void flush(){} };
+class IPAddress { uint8_t b[4]; public:
+ IPAddress(){memset(b,0,4);} IPAddress(uint8_t a,uint8_t c,uint8_t d,uint8_t e){b[0]=a;b[1]=c;b[2]=d;b[3]=e;}
+ IPAddress(uint32_t v){memcpy(b,&v,4);} IPAddress(unsigned long v):IPAddress((uint32_t)v){} IPAddress(const uint8_t*p){memcpy(b,p,4);}
+ operator uint32_t() const {uint32_t v; memcpy(&v,b,4); return v;}
+ bool operator==(const IPAddress&o) const {return !memcmp(b,o.b,4);} bool operator!=(const IPAddress&o) const {return !(*this==o);}
+ bool operator==(const uint8_t*p) const {return !memcmp(b,p,4);}
+ uint8_t operator[](int i) const {return b[i];} uint8_t& operator[](int i){return b[i];}
+ IPAddress& operator=(const uint8_t*p){memcpy(b,p,4);return *this;} IPAddress& operator=(uint32_t v){memcpy(b,&v,4);return *this;}
+ uint8_t* raw_address(){return b;}
+};
+extern const IPAddress INADDR_NONE;
+class HardwareSerial : public Stream { public: size_t write(uint8_t){return 1;} int available(){return 0;} int read(){return 0;} int peek(){return 0;} void begin(long){} operator bool(){return true;} };
+extern HardwareSerial Serial;
+#include "Client.h"
+#include "Server.h"
+#include "Udp.h"
@@ -0,0 +1,8 @@
+#pragma once
+#include "Arduino.h"
+#define MSBFIRST 1
+#define SPI_MODE0 0
+struct SPISettings { SPISettings(uint32_t,uint8_t,uint8_t){} };
+// transfer() is left to the test, which puts a fake chip behind it
+struct SPIClass { void begin(){} void beginTransaction(SPISettings){} void endTransaction(){} uint8_t transfer(uint8_t d); void transfer(void *buf, size_t n); void usingInterrupt(int){} };
+extern SPIClass SPI1; extern SPIClass SPI;
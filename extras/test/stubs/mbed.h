@@ -0,0 +1,23 @@
+#pragma once
+// The parts of Mbed OS the library uses, on std::thread primitives.
+// rtos::Mutex is recursive, like the Mbed one.
+#include <mutex>
+namespace rtos {
+class Mutex {
+public:
+	void lock() { _m.lock(); }
+	void unlock() { _m.unlock(); }
+	bool trylock() { return _m.try_lock(); }
+private:
+	std::recursive_mutex _m;
+};
+}
+namespace mbed {
+template<class L> class ScopedLock {
+public:
+	ScopedLock(L &l) : _l(l) { _l.lock(); }
+	~ScopedLock() { _l.unlock(); }
+private:
+	L &_l;
+};
+}
@@ -16,12 +16,34 @@
 #include "utility/w5100_SPI2.h"
 
 int DhcpClass_SPI2::beginWithDHCP(uint8_t *mac, unsigned long timeout, unsigned long responseTimeout)
+{
+	init_DHCP(mac, timeout, responseTimeout);
+	return request_DHCP_lease();
+}
+
+int DhcpClass_SPI2::beginAsync(uint8_t *mac, IPAddress previousIp, unsigned long timeout, unsigned long responseTimeout)
+{
+	init_DHCP(mac, timeout, responseTimeout);
+	if (previousIp != IPAddress((uint32_t)0)) {
+		// INIT-REBOOT: REQUEST the old address without a server identifier
+		for (int i = 0; i < 4; i++) _dhcpLocalIp[i] = previousIp[i];
+		_dhcp_state = STATE_DHCP_REBOOT;
+	}
+	_binding = start_DHCP_lease();
+	return _binding;
+}
+
+void DhcpClass_SPI2::init_DHCP(uint8_t *mac, unsigned long timeout, unsigned long responseTimeout)
 {
 	_dhcpLeaseTime=0;
 	_dhcpT1=0;
 	_dhcpT2=0;
 	_timeout = timeout;
 	_responseTimeout = responseTimeout;
+	_binding = false;
+	_restart = false;
+	_retryMillis = 0;
+	_leaseOp = DHCP_CHECK_NONE;
 
 	// zero out _dhcpMacAddr
 	memset(_dhcpMacAddr, 0, 6);
@@ -29,20 +51,40 @@ int DhcpClass_SPI2::beginWithDHCP(uint8_t *mac, unsigned long timeout, unsigned
 
 	memcpy((void*)_dhcpMacAddr, (void*)mac, 6);
 	_dhcp_state = STATE_DHCP_START;
-	return request_DHCP_lease();
+}
+
+void DhcpClass_SPI2::end()
+{
+	_dhcpUdpSocket.stop();
+	_binding = false;
 }
 
 void DhcpClass_SPI2::reset_DHCP_lease()
 {
 	// zero out _dhcpSubnetMask, _dhcpGatewayIp, _dhcpLocalIp, _dhcpDhcpServerIp, _dhcpDnsServerIp
-	memset(_dhcpLocalIp, 0, 20);
+	memset(_dhcpLocalIp, 0, sizeof(_dhcpLocalIp));
+	memset(_dhcpSubnetMask, 0, sizeof(_dhcpSubnetMask));
+	memset(_dhcpGatewayIp, 0, sizeof(_dhcpGatewayIp));
+	memset(_dhcpDhcpServerIp, 0, sizeof(_dhcpDhcpServerIp));
+	memset(_dhcpDnsServerIp, 0, sizeof(_dhcpDnsServerIp));
+	_dhcpDnsServerCount = 0;
 }
 
 	//return:0 on error, 1 if request is sent and response is received
 int DhcpClass_SPI2::request_DHCP_lease()
 {
-	uint8_t messageType = 0;
+	if (!start_DHCP_lease()) return 0;
 
+	int result;
+	while ((result = poll_DHCP_lease()) == 0) {
+		yield();
+	}
+	return result == 1;
+}
+
+	//return:0 if we couldn't get a socket
+int DhcpClass_SPI2::start_DHCP_lease()
+{
 	// Pick an initial transaction ID
 	_dhcpTransactionId = random(1UL, 2000UL);
 	_dhcpInitialTransactionId = _dhcpTransactionId;
@@ -55,69 +97,112 @@ int DhcpClass_SPI2::request_DHCP_lease()
 
 	presend_DHCP();
 
-	int result = 0;
+	_startMillis = millis();
+	_lastSendMillis = _startMillis;
+	return 1;
+}
 
-	unsigned long startTime = millis();
+// Binding again after an expired lease failed: wait, then start over
+void DhcpClass_SPI2::restart_failed()
+{
+	_binding = false;
+	_dhcp_state = STATE_DHCP_START;
+	_failMillis = millis();
+	if (_retryMillis == 0) {
+		_retryMillis = DHCP_RETRY_MIN;
+	} else if (_retryMillis < DHCP_RETRY_MAX) {
+		_retryMillis <<= 1;
+	}
+}
+
+void DhcpClass_SPI2::bind_DHCP_lease()
+{
+	_dhcp_state = STATE_DHCP_LEASED;
+	_retryMillis = 0;
+	//use default lease time if we didn't get it
+	if (_dhcpLeaseTime == 0) {
+		_dhcpLeaseTime = DEFAULT_LEASE;
+	}
+	// Calculate T1 & T2 if we didn't get it
+	if (_dhcpT1 == 0) {
+		// T1 should be 50% of _dhcpLeaseTime
+		_dhcpT1 = _dhcpLeaseTime >> 1;
+	}
+	if (_dhcpT2 == 0) {
+		// T2 should be 87.5% (7/8ths) of _dhcpLeaseTime
+		_dhcpT2 = _dhcpLeaseTime - (_dhcpLeaseTime >> 3);
+	}
+	_renewInSec = _dhcpT1;
+	_rebindInSec = _dhcpT2;
+	_expireInSec = _dhcpLeaseTime;
+}
 
-	while (_dhcp_state != STATE_DHCP_LEASED) {
-		if (_dhcp_state == STATE_DHCP_START) {
-			_dhcpTransactionId++;
-			send_DHCP_MESSAGE(DHCP_DISCOVER, ((millis() - startTime) / 1000));
-			_dhcp_state = STATE_DHCP_DISCOVER;
-		} else if (_dhcp_state == STATE_DHCP_REREQUEST) {
-			_dhcpTransactionId++;
-			send_DHCP_MESSAGE(DHCP_REQUEST, ((millis() - startTime)/1000));
+	//return:0 while in progress, 1 once leased, -1 on timeout
+int DhcpClass_SPI2::poll_DHCP_lease()
+{
+	uint8_t messageType = 0;
+	unsigned long now = millis();
+	uint16_t secondsElapsed = (now - _startMillis) / 1000;
+
+	if (_dhcp_state == STATE_DHCP_START) {
+		_dhcpTransactionId++;
+		send_DHCP_MESSAGE(DHCP_DISCOVER, secondsElapsed);
+		_dhcp_state = STATE_DHCP_DISCOVER;
+		_lastSendMillis = now;
+	} else if (_dhcp_state == STATE_DHCP_REREQUEST || _dhcp_state == STATE_DHCP_REBOOT) {
+		_dhcpTransactionId++;
+		send_DHCP_MESSAGE(DHCP_REQUEST, secondsElapsed);
+		_dhcp_state = STATE_DHCP_REQUEST;
+		_lastSendMillis = now;
+	} else if (_dhcp_state == STATE_DHCP_DISCOVER) {
+		uint32_t respId;
+		messageType = parseDHCPResponse(respId);
+		if (messageType == DHCP_OFFER) {
+			// We'll use the transaction ID that the offer came with,
+			// rather than the one we were up to
+			_dhcpTransactionId = respId;
+			send_DHCP_MESSAGE(DHCP_REQUEST, secondsElapsed);
 			_dhcp_state = STATE_DHCP_REQUEST;
-		} else if (_dhcp_state == STATE_DHCP_DISCOVER) {
-			uint32_t respId;
-			messageType = parseDHCPResponse(_responseTimeout, respId);
-			if (messageType == DHCP_OFFER) {
-				// We'll use the transaction ID that the offer came with,
-				// rather than the one we were up to
-				_dhcpTransactionId = respId;
-				send_DHCP_MESSAGE(DHCP_REQUEST, ((millis() - startTime) / 1000));
-				_dhcp_state = STATE_DHCP_REQUEST;
-			}
-		} else if (_dhcp_state == STATE_DHCP_REQUEST) {
-			uint32_t respId;
-			messageType = parseDHCPResponse(_responseTimeout, respId);
-			if (messageType == DHCP_ACK) {
-				_dhcp_state = STATE_DHCP_LEASED;
-				result = 1;
-				//use default lease time if we didn't get it
-				if (_dhcpLeaseTime == 0) {
-					_dhcpLeaseTime = DEFAULT_LEASE;
-				}
-				// Calculate T1 & T2 if we didn't get it
-				if (_dhcpT1 == 0) {
-					// T1 should be 50% of _dhcpLeaseTime
-					_dhcpT1 = _dhcpLeaseTime >> 1;
-				}
-				if (_dhcpT2 == 0) {
-					// T2 should be 87.5% (7/8ths) of _dhcpLeaseTime
-					_dhcpT2 = _dhcpLeaseTime - (_dhcpLeaseTime >> 3);
-				}
-				_renewInSec = _dhcpT1;
-				_rebindInSec = _dhcpT2;
-			} else if (messageType == DHCP_NAK) {
-				_dhcp_state = STATE_DHCP_START;
-			}
+			_lastSendMillis = now;
+		} else if (messageType == DHCP_ACK && _rapidCommit && _replyRapidCommit) {
+			// Rapid Commit: the server skipped OFFER/REQUEST
+			bind_DHCP_lease();
 		}
-
-		if (messageType == 255) {
-			messageType = 0;
+	} else if (_dhcp_state == STATE_DHCP_REQUEST) {
+		uint32_t respId;
+		messageType = parseDHCPResponse(respId);
+		if (messageType == DHCP_ACK) {
+			bind_DHCP_lease();
+		} else if (messageType == DHCP_NAK) {
+			// also where a refused INIT-REBOOT ends up
+			reset_DHCP_lease();
 			_dhcp_state = STATE_DHCP_START;
 		}
+	}
 
-		if (result != 1 && ((millis() - startTime) > _timeout))
-			break;
+	// No answer in time: start over with a DISCOVER
+	if (messageType == 0 && _dhcp_state != STATE_DHCP_LEASED &&
+	  (now - _lastSendMillis) > _responseTimeout) {
+		_dhcp_state = STATE_DHCP_START;
 	}
 
-	// We're done with the socket now
-	_dhcpUdpSocket.stop();
-	_dhcpTransactionId++;
+	int result = 0;
+	if (_dhcp_state == STATE_DHCP_LEASED) {
+		result = 1;
+	} else if ((now - _startMillis) > _timeout) {
+		result = -1;
+	}
 
-	_lastCheckLeaseMillis = millis();
+	if (result != 0) {
+		// We're done with the socket now
+		_dhcpUdpSocket.stop();
+		_dhcpTransactionId++;
+		_lastCheckLeaseMillis = millis();
+		if (result < 0 && _binding && _restart) {
+			restart_failed();
+		}
+		_binding = false;
+	}
 	return result;
 }
 
@@ -127,16 +212,11 @@ void DhcpClass_SPI2::presend_DHCP()
 
 void DhcpClass_SPI2::send_DHCP_MESSAGE(uint8_t messageType, uint16_t secondsElapsed)
 {
-	uint8_t buffer[32];
-	memset(buffer, 0, 32);
+	// The whole message is built here and written to the chip at once
+	uint8_t buffer[DHCP_MAX_MESSAGE];
+	memset(buffer, 0, 240);
 	IPAddress dest_addr(255, 255, 255, 255); // Broadcast address
 
-	if (_dhcpUdpSocket.beginPacket(dest_addr, DHCP_SERVER_PORT) == -1) {
-		//Serial.printf("DHCP transmit error\n");
-		// FIXME Need to return errors
-		return;
-	}
-
 	buffer[0] = DHCP_BOOTREQUEST;   // op
 	buffer[1] = DHCP_HTYPE10MB;     // htype
 	buffer[2] = DHCP_HLENETHERNET;  // hlen
@@ -159,101 +239,82 @@ void DhcpClass_SPI2::send_DHCP_MESSAGE(uint8_t messageType, uint16_t secondsElap
 	// siaddr: already zeroed
 	// giaddr: already zeroed
 
-	//put data in W5100 transmit buffer
-	_dhcpUdpSocket.write(buffer, 28);
-
-	memset(buffer, 0, 32); // clear local buffer
-
-	memcpy(buffer, _dhcpMacAddr, 6); // chaddr
-
-	//put data in W5100 transmit buffer
-	_dhcpUdpSocket.write(buffer, 16);
-
-	memset(buffer, 0, 32); // clear local buffer
+	memcpy(buffer + 28, _dhcpMacAddr, 6); // chaddr
 
 	// leave zeroed out for sname && file
-	// put in W5100 transmit buffer x 6 (192 bytes)
 
-	for(int i = 0; i < 6; i++) {
-		_dhcpUdpSocket.write(buffer, 32);
-	}
+	uint8_t *opt = buffer + 236;
 
 	// OPT - Magic Cookie
-	buffer[0] = (uint8_t)((MAGIC_COOKIE >> 24)& 0xFF);
-	buffer[1] = (uint8_t)((MAGIC_COOKIE >> 16)& 0xFF);
-	buffer[2] = (uint8_t)((MAGIC_COOKIE >> 8)& 0xFF);
-	buffer[3] = (uint8_t)(MAGIC_COOKIE& 0xFF);
+	*opt++ = (uint8_t)((MAGIC_COOKIE >> 24)& 0xFF);
+	*opt++ = (uint8_t)((MAGIC_COOKIE >> 16)& 0xFF);
+	*opt++ = (uint8_t)((MAGIC_COOKIE >> 8)& 0xFF);
+	*opt++ = (uint8_t)(MAGIC_COOKIE& 0xFF);
 
 	// OPT - message type
-	buffer[4] = dhcpMessageType;
-	buffer[5] = 0x01;
-	buffer[6] = messageType; //DHCP_REQUEST;
+	*opt++ = dhcpMessageType;
+	*opt++ = 0x01;
+	*opt++ = messageType; //DHCP_REQUEST;
 
 	// OPT - client identifier
-	buffer[7] = dhcpClientIdentifier;
-	buffer[8] = 0x07;
-	buffer[9] = 0x01;
-	memcpy(buffer + 10, _dhcpMacAddr, 6);
+	*opt++ = dhcpClientIdentifier;
+	*opt++ = 0x07;
+	*opt++ = 0x01;
+	memcpy(opt, _dhcpMacAddr, 6);
+	opt += 6;
 
 	// OPT - host name
-	buffer[16] = hostName;
-	buffer[17] = strlen(HOST_NAME) + 6; // length of hostname + last 3 bytes of mac address
-	strcpy((char*)&(buffer[18]), HOST_NAME);
-
-	printByte((char*)&(buffer[24]), _dhcpMacAddr[3]);
-	printByte((char*)&(buffer[26]), _dhcpMacAddr[4]);
-	printByte((char*)&(buffer[28]), _dhcpMacAddr[5]);
-
-	//put data in W5100 transmit buffer
-	_dhcpUdpSocket.write(buffer, 30);
+	*opt++ = hostName;
+	*opt++ = strlen(HOST_NAME) + 6; // length of hostname + last 3 bytes of mac address
+	memcpy(opt, HOST_NAME, strlen(HOST_NAME));
+	opt += strlen(HOST_NAME);
+
+	printByte((char*)opt, _dhcpMacAddr[3]);
+	printByte((char*)opt + 2, _dhcpMacAddr[4]);
+	printByte((char*)opt + 4, _dhcpMacAddr[5]);
+	opt += 6;
+
+	if (messageType == DHCP_DISCOVER && _rapidCommit) {
+		*opt++ = dhcpRapidCommit;
+		*opt++ = 0x00;
+	}
 
 	if (messageType == DHCP_REQUEST) {
-		buffer[0] = dhcpRequestedIPaddr;
-		buffer[1] = 0x04;
-		buffer[2] = _dhcpLocalIp[0];
-		buffer[3] = _dhcpLocalIp[1];
-		buffer[4] = _dhcpLocalIp[2];
-		buffer[5] = _dhcpLocalIp[3];
-
-		buffer[6] = dhcpServerIdentifier;
-		buffer[7] = 0x04;
-		buffer[8] = _dhcpDhcpServerIp[0];
-		buffer[9] = _dhcpDhcpServerIp[1];
-		buffer[10] = _dhcpDhcpServerIp[2];
-		buffer[11] = _dhcpDhcpServerIp[3];
-
-		//put data in W5100 transmit buffer
-		_dhcpUdpSocket.write(buffer, 12);
+		*opt++ = dhcpRequestedIPaddr;
+		*opt++ = 0x04;
+		memcpy(opt, _dhcpLocalIp, 4);
+		opt += 4;
+
+		// not known (and not allowed) when rebooting
+		if (IPAddress(_dhcpDhcpServerIp) != IPAddress((uint32_t)0)) {
+			*opt++ = dhcpServerIdentifier;
+			*opt++ = 0x04;
+			memcpy(opt, _dhcpDhcpServerIp, 4);
+			opt += 4;
+		}
 	}
 
-	buffer[0] = dhcpParamRequest;
-	buffer[1] = 0x06;
-	buffer[2] = subnetMask;
-	buffer[3] = routersOnSubnet;
-	buffer[4] = dns;
-	buffer[5] = domainName;
-	buffer[6] = dhcpT1value;
-	buffer[7] = dhcpT2value;
-	buffer[8] = endOption;
-
-	//put data in W5100 transmit buffer
-	_dhcpUdpSocket.write(buffer, 9);
-
-	_dhcpUdpSocket.endPacket();
+	*opt++ = dhcpParamRequest;
+	*opt++ = 0x06;
+	*opt++ = subnetMask;
+	*opt++ = routersOnSubnet;
+	*opt++ = dns;
+	*opt++ = domainName;
+	*opt++ = dhcpT1value;
+	*opt++ = dhcpT2value;
+	*opt++ = endOption;
+
+	// FIXME Need to return errors
+	_dhcpUdpSocket.sendTo(dest_addr, DHCP_SERVER_PORT, buffer, opt - buffer);
 }
 
-uint8_t DhcpClass_SPI2::parseDHCPResponse(unsigned long responseTimeout, uint32_t& transactionId)
+	//return:message type of the reply, 0 if none or not for us
+uint8_t DhcpClass_SPI2::parseDHCPResponse(uint32_t& transactionId)
 {
 	uint8_t type = 0;
-	uint8_t opt_len = 0;
-
-	unsigned long startTime = millis();
 
-	while (_dhcpUdpSocket.parsePacket() <= 0) {
-		if ((millis() - startTime) > responseTimeout) {
-			return 255;
-		}
-		delay(50);
+	if (_dhcpUdpSocket.parsePacket() <= 0) {
+		return 0;
 	}
 	// start reading in the packet
 	RIP_MSG_FIXED fixedMsg;
@@ -271,82 +332,139 @@ uint8_t DhcpClass_SPI2::parseDHCPResponse(unsigned long responseTimeout, uint32_
 
 		memcpy(_dhcpLocalIp, fixedMsg.yiaddr, 4);
 
-		// Skip to the option part
-		_dhcpUdpSocket.read((uint8_t *)NULL, 240 - (int)sizeof(RIP_MSG_FIXED));
+		// Jump over sname and file and fetch the whole option part at once
+		uint8_t buffer[DHCP_OPTIONS_SIZE];
+		int len = _dhcpUdpSocket.peek(buffer, sizeof(buffer),
+			DHCP_COOKIE_OFFSET - sizeof(RIP_MSG_FIXED));
+
+		_replyType = 0;
+		_replyOverload = 0;
+		_replyRapidCommit = false;
+		if (len > 4 && buffer[0] == (uint8_t)(MAGIC_COOKIE >> 24) &&
+		  buffer[1] == (uint8_t)(MAGIC_COOKIE >> 16) &&
+		  buffer[2] == (uint8_t)(MAGIC_COOKIE >> 8) &&
+		  buffer[3] == (uint8_t)MAGIC_COOKIE) {
+			parseOptions(buffer + 4, len - 4);
+
+			// Option overload: more options are held in file and/or sname
+			uint8_t overload = _replyOverload;
+			if (overload & 1) {
+				len = _dhcpUdpSocket.peek(buffer, 128, DHCP_FILE_OFFSET - sizeof(RIP_MSG_FIXED));
+				parseOptions(buffer, len);
+			}
+			if (overload & 2) {
+				len = _dhcpUdpSocket.peek(buffer, 64, DHCP_SNAME_OFFSET - sizeof(RIP_MSG_FIXED));
+				parseOptions(buffer, len);
+			}
+		}
+		type = _replyType;
+	}
 
-		while (_dhcpUdpSocket.available() > 0) {
-			switch (_dhcpUdpSocket.read()) {
-			case endOption :
-				break;
+	// Need to skip to end of the packet regardless here
+	_dhcpUdpSocket.flush(); // FIXME
 
-			case padOption :
-				break;
+	return type;
+}
 
-			case dhcpMessageType :
-				opt_len = _dhcpUdpSocket.read();
-				type = _dhcpUdpSocket.read();
+const DhcpClass_SPI2::dhcpoption_t DhcpClass_SPI2::_options[] = {
+	{ dhcpMessageType,     1, &DhcpClass_SPI2::optMessageType },
+	{ subnetMask,          4, &DhcpClass_SPI2::optSubnetMask },
+	{ routersOnSubnet,     4, &DhcpClass_SPI2::optRouter },
+	{ dns,                 4, &DhcpClass_SPI2::optDns },
+	{ dhcpServerIdentifier, 4, &DhcpClass_SPI2::optServerId },
+	{ dhcpIPaddrLeaseTime, 4, &DhcpClass_SPI2::optLeaseTime },
+	{ dhcpT1value,         4, &DhcpClass_SPI2::optT1 },
+	{ dhcpT2value,         4, &DhcpClass_SPI2::optT2 },
+	{ dhcpOptionOverload,  1, &DhcpClass_SPI2::optOverload },
+	{ dhcpRapidCommit,     0, &DhcpClass_SPI2::optRapidCommit }
+};
+
+// Walk a block of options held in RAM
+void DhcpClass_SPI2::parseOptions(const uint8_t *opt, uint16_t len)
+{
+	const uint8_t *end = opt + len;
+	while (opt < end) {
+		uint8_t code = *opt++;
+		if (code == padOption) continue;
+		if (code == endOption || opt >= end) break;
+		uint8_t opt_len = *opt++;
+		if (opt + opt_len > end) break; // truncated option
+
+		for (uint8_t i = 0; i < sizeof(_options) / sizeof(_options[0]); i++) {
+			if (_options[i].code == code) {
+				if (opt_len >= _options[i].minLen) {
+					(this->*_options[i].handler)(opt, opt_len);
+				}
 				break;
+			}
+		}
+		opt += opt_len;
+	}
+}
 
-			case subnetMask :
-				opt_len = _dhcpUdpSocket.read();
-				_dhcpUdpSocket.read(_dhcpSubnetMask, 4);
-				break;
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
 
-			case routersOnSubnet :
-				opt_len = _dhcpUdpSocket.read();
-				_dhcpUdpSocket.read(_dhcpGatewayIp, 4);
-				_dhcpUdpSocket.read((uint8_t *)NULL, opt_len - 4);
-				break;
+void DhcpClass_SPI2::optMessageType(const uint8_t *val, uint8_t)
+{
+	_replyType = val[0];
+}
 
-			case dns :
-				opt_len = _dhcpUdpSocket.read();
-				_dhcpUdpSocket.read(_dhcpDnsServerIp, 4);
-				_dhcpUdpSocket.read((uint8_t *)NULL, opt_len - 4);
-				break;
+void DhcpClass_SPI2::optSubnetMask(const uint8_t *val, uint8_t)
+{
+	memcpy(_dhcpSubnetMask, val, 4);
+}
 
-			case dhcpServerIdentifier :
-				opt_len = _dhcpUdpSocket.read();
-				if ( IPAddress(_dhcpDhcpServerIp) == IPAddress((uint32_t)0) ||
-				  IPAddress(_dhcpDhcpServerIp) == _dhcpUdpSocket.remoteIP() ) {
-					_dhcpUdpSocket.read(_dhcpDhcpServerIp, sizeof(_dhcpDhcpServerIp));
-				} else {
-					// Skip over the rest of this option
-					_dhcpUdpSocket.read((uint8_t *)NULL, opt_len);
-				}
-				break;
+void DhcpClass_SPI2::optRouter(const uint8_t *val, uint8_t)
+{
+	// Only the first router is used
+	memcpy(_dhcpGatewayIp, val, 4);
+}
 
-			case dhcpT1value :
-				opt_len = _dhcpUdpSocket.read();
-				_dhcpUdpSocket.read((uint8_t*)&_dhcpT1, sizeof(_dhcpT1));
-				_dhcpT1 = ntohl(_dhcpT1);
-				break;
+void DhcpClass_SPI2::optDns(const uint8_t *val, uint8_t len)
+{
+	// Keep as many servers as we have room for
+	_dhcpDnsServerCount = len / 4;
+	if (_dhcpDnsServerCount > MAX_DNS_SERVERS) {
+		_dhcpDnsServerCount = MAX_DNS_SERVERS;
+	}
+	memcpy(_dhcpDnsServerIp, val, _dhcpDnsServerCount * 4);
+}
 
-			case dhcpT2value :
-				opt_len = _dhcpUdpSocket.read();
-				_dhcpUdpSocket.read((uint8_t*)&_dhcpT2, sizeof(_dhcpT2));
-				_dhcpT2 = ntohl(_dhcpT2);
-				break;
+void DhcpClass_SPI2::optServerId(const uint8_t *val, uint8_t)
+{
+	if ( IPAddress(_dhcpDhcpServerIp) == IPAddress((uint32_t)0) ||
+	  IPAddress(_dhcpDhcpServerIp) == _dhcpUdpSocket.remoteIP() ) {
+		memcpy(_dhcpDhcpServerIp, val, 4);
+	}
+}
 
-			case dhcpIPaddrLeaseTime :
-				opt_len = _dhcpUdpSocket.read();
-				_dhcpUdpSocket.read((uint8_t*)&_dhcpLeaseTime, sizeof(_dhcpLeaseTime));
-				_dhcpLeaseTime = ntohl(_dhcpLeaseTime);
-				_renewInSec = _dhcpLeaseTime;
-				break;
+void DhcpClass_SPI2::optLeaseTime(const uint8_t *val, uint8_t)
+{
+	_dhcpLeaseTime = get32(val);
+	_renewInSec = _dhcpLeaseTime;
+}
 
-			default :
-				opt_len = _dhcpUdpSocket.read();
-				// Skip over the rest of this option
-				_dhcpUdpSocket.read((uint8_t *)NULL, opt_len);
-				break;
-			}
-		}
-	}
+void DhcpClass_SPI2::optT1(const uint8_t *val, uint8_t)
+{
+	_dhcpT1 = get32(val);
+}
 
-	// Need to skip to end of the packet regardless here
-	_dhcpUdpSocket.flush(); // FIXME
+void DhcpClass_SPI2::optT2(const uint8_t *val, uint8_t)
+{
+	_dhcpT2 = get32(val);
+}
 
-	return type;
+void DhcpClass_SPI2::optOverload(const uint8_t *val, uint8_t)
+{
+	_replyOverload = val[0];
+}
+
+void DhcpClass_SPI2::optRapidCommit(const uint8_t *, uint8_t)
+{
+	_replyRapidCommit = true;
 }
 
 
@@ -357,6 +475,11 @@ uint8_t DhcpClass_SPI2::parseDHCPResponse(unsigned long responseTimeout, uint32_
     2/DHCP_CHECK_RENEW_OK: renew success
     3/DHCP_CHECK_REBIND_FAIL: rebind fail
     4/DHCP_CHECK_REBIND_OK: rebind success
+    7/DHCP_CHECK_LEASE_EXPIRED: lease lost, a new one is being requested
+
+    Renew and rebind don't block: each call advances the exchange by one
+    step, and the current lease stays in use until it is replaced or
+    expires.
 */
 int DhcpClass_SPI2::checkLease()
 {
@@ -385,25 +508,95 @@ int DhcpClass_SPI2::checkLease()
 		} else {
 			_rebindInSec -= elapsed;
 		}
+		if (_expireInSec < elapsed) {
+			_expireInSec = 0;
+		} else {
+			_expireInSec -= elapsed;
+		}
 	}
 
-	// if we have a lease but should renew, do it
-	if (_renewInSec == 0 &&_dhcp_state == STATE_DHCP_LEASED) {
-		_dhcp_state = STATE_DHCP_REREQUEST;
-		rc = 1 + request_DHCP_lease();
+	if (_leaseOp != DHCP_CHECK_NONE) {
+		int ret = poll_DHCP_lease();
+		if (ret != 0) {
+			rc = _leaseOp + (ret == 1);
+			_leaseOp = DHCP_CHECK_NONE;
+			if (ret < 0) {
+				// keep the lease we have, try again half way to the next deadline
+				_dhcp_state = STATE_DHCP_LEASED;
+				if (rc == DHCP_CHECK_RENEW_FAIL) {
+					_renewInSec = _rebindInSec >> 1;
+				} else {
+					// the server is forgotten, so the retry must be a
+					// rebind too: renew and rebind come due together
+					_rebindInSec = _expireInSec >> 1;
+					_renewInSec = _rebindInSec;
+				}
+			}
+			return rc;
+		}
+		if ((_leaseOp == DHCP_CHECK_RENEW_FAIL && _rebindInSec == 0) || _expireInSec == 0) {
+			// out of time for this attempt, escalate below
+			_dhcpUdpSocket.stop();
+			_leaseOp = DHCP_CHECK_NONE;
+			_dhcp_state = STATE_DHCP_LEASED;
+		} else {
+			return rc;
+		}
 	}
 
-	// if we have a lease or is renewing but should bind, do it
-	if (_rebindInSec == 0 && (_dhcp_state == STATE_DHCP_LEASED ||
-	  _dhcp_state == STATE_DHCP_START)) {
+	if (_retryMillis != 0) {
+		// a restart failed, try again once the backoff is over
+		if (now - _failMillis >= _retryMillis) {
+			_binding = start_DHCP_lease();
+			if (!_binding) restart_failed();
+		}
+		return rc;
+	}
+
+	if (_dhcp_state != STATE_DHCP_LEASED) return rc;
+
+	if (_expireInSec == 0) {
+		// the lease is gone, start over as if just powered up
+		reset_DHCP_lease();
+		_dhcp_state = STATE_DHCP_START;
+		_restart = true;
+		_binding = start_DHCP_lease();
+		if (!_binding) restart_failed();
+		rc = DHCP_CHECK_LEASE_EXPIRED;
+	} else if (_rebindInSec == 0) {
+		// if we have a lease but should rebind, do it
 		// this should basically restart completely
 		_dhcp_state = STATE_DHCP_START;
 		reset_DHCP_lease();
-		rc = 3 + request_DHCP_lease();
+		_leaseOp = DHCP_CHECK_REBIND_FAIL;
+	} else if (_renewInSec == 0) {
+		// if we have a lease but should renew, do it
+		_dhcp_state = STATE_DHCP_REREQUEST;
+		_leaseOp = DHCP_CHECK_RENEW_FAIL;
+	}
+
+	if (_leaseOp != DHCP_CHECK_NONE && !start_DHCP_lease()) {
+		// no socket now, count it as a failed attempt
+		rc = _leaseOp;
+		_leaseOp = DHCP_CHECK_NONE;
+		_dhcp_state = STATE_DHCP_LEASED;
 	}
 	return rc;
 }
 
+// Start a renew on the next checkLease()
+void DhcpClass_SPI2::renewNow()
+{
+	if (_dhcp_state == STATE_DHCP_LEASED && _leaseOp == DHCP_CHECK_NONE) {
+		if (_dhcpDhcpServerIp[0] == 0) {
+			// a rebind failed and forgot the server, renewing can't work
+			_rebindInSec = 0;
+		} else {
+			_renewInSec = 0;
+		}
+	}
+}
+
 IPAddress DhcpClass_SPI2::getLocalIp()
 {
 	return IPAddress(_dhcpLocalIp);
@@ -424,9 +617,10 @@ IPAddress DhcpClass_SPI2::getDhcpServerIp()
 	return IPAddress(_dhcpDhcpServerIp);
 }
 
-IPAddress DhcpClass_SPI2::getDnsServerIp()
+IPAddress DhcpClass_SPI2::getDnsServerIp(uint8_t index)
 {
-	return IPAddress(_dhcpDnsServerIp);
+	if (index >= MAX_DNS_SERVERS) return IPAddress((uint32_t)0);
+	return IPAddress(_dhcpDnsServerIp[index]);
 }
 
 void DhcpClass_SPI2::printByte(char * buf, uint8_t n )
@@ -20,6 +20,7 @@
 #define	STATE_DHCP_LEASED	3
 #define	STATE_DHCP_REREQUEST	4
 #define	STATE_DHCP_RELEASE	5
+#define	STATE_DHCP_REBOOT	6	/* INIT-REBOOT: ask again for the previous address */
 
 #define DHCP_FLAGSBROADCAST	0x8000
 
@@ -49,16 +50,26 @@
 #define DHCP_SECS		0
 
 #define MAGIC_COOKIE		0x63825363
+#define DHCP_MAX_MESSAGE	320	/* fixed part (240) plus the options we send */
+#define DHCP_OPTIONS_SIZE	316	/* magic cookie plus the 312 bytes of options */
+#define DHCP_SNAME_OFFSET	44
+#define DHCP_FILE_OFFSET	108
+#define DHCP_COOKIE_OFFSET	236
 #define MAX_DHCP_OPT		16
 
 #define HOST_NAME "WIZnet"
 #define DEFAULT_LEASE	(900) //default lease time in seconds
+#define DHCP_RETRY_MIN	(4000)	//first backoff after a failed restart, ms
+#define DHCP_RETRY_MAX	(64000)	//the backoff doubles up to this
 
 #define DHCP_CHECK_NONE         (0)
 #define DHCP_CHECK_RENEW_FAIL   (1)
 #define DHCP_CHECK_RENEW_OK     (2)
 #define DHCP_CHECK_REBIND_FAIL  (3)
 #define DHCP_CHECK_REBIND_OK    (4)
+#define DHCP_CHECK_BIND_FAIL    (5)
+#define DHCP_CHECK_BIND_OK      (6)
+#define DHCP_CHECK_LEASE_EXPIRED (7)
 
 enum
 {
@@ -114,7 +125,7 @@ enum
 	xDisplayManager		=	49,*/
 	dhcpRequestedIPaddr	=	50,
 	dhcpIPaddrLeaseTime	=	51,
-	/*dhcpOptionOverload	=	52,*/
+	dhcpOptionOverload	=	52,
 	dhcpMessageType		=	53,
 	dhcpServerIdentifier	=	54,
 	dhcpParamRequest	=	55,
@@ -124,6 +135,7 @@ enum
 	dhcpT2value		=	59,
 	/*dhcpClassIdentifier	=	60,*/
 	dhcpClientIdentifier	=	61,
+	dhcpRapidCommit		=	80,	/* RFC 4039 */
 	endOption		=	255
 };
 
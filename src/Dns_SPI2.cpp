@@ -42,6 +42,8 @@
 #define TYPE_A                   (0x0001)
 #define CLASS_IN                 (0x0001)
 #define LABEL_COMPRESSION_MASK   (0xC0)
+// Largest query we build: header, a 255 byte name and type/class
+#define MAX_REQUEST_SIZE         (DNS_HEADER_SIZE + 256 + 4)
 // Port number that DNS servers listen on
 #define DNS_PORT        53
 
@@ -51,11 +53,55 @@
 #define INVALID_SERVER   -2
 #define TRUNCATED        -3
 #define INVALID_RESPONSE -4
+#define NO_QUERY_SLOT    -7
+
+// Query states
+#define QUERY_FREE       0
+#define QUERY_PENDING    1
+#define QUERY_DONE       2
+
+typedef struct {
+	uint32_t hash;     // nameHash() of the host name
+	uint8_t  addr[4];
+	uint8_t  negative; // the name doesn't resolve
+	uint32_t expires;  // millis() when the entry goes stale
+	uint32_t used;     // millis() of the last hit, 0 = free
+} dnsentry_t;
+
+static dnsentry_t dns_cache[DNS_CACHE_SIZE];
+
+// The cache is shared by the resolvers of all threads
+#ifdef ETHERNET_SPI2_LOCKING
+static rtos::Mutex dns_cache_lock;
+#define DNS_CACHE_LOCK() mbed::ScopedLock<rtos::Mutex> cache_guard(dns_cache_lock)
+#else
+#define DNS_CACHE_LOCK()
+#endif
+
+DNSClient_SPI2::DNSClient_SPI2() : iServerCount(0), iStagger(0), iSocketOpen(false),
+  iSendPending(false)
+{
+	memset(iQueries, 0, sizeof(iQueries));
+}
+
+DNSClient_SPI2::~DNSClient_SPI2()
+{
+	if (iSocketOpen) iUdp.stop();
+}
 
 void DNSClient_SPI2::begin(const IPAddress& aDNSServer)
 {
-	iDNSServer = aDNSServer;
-	iRequestId = 0;
+	begin(&aDNSServer, 1);
+}
+
+void DNSClient_SPI2::begin(const IPAddress* aDNSServers, uint8_t aCount)
+{
+	iServerCount = 0;
+	for (uint8_t i=0; i < aCount && iServerCount < MAX_DNS_SERVERS; i++) {
+		if (aDNSServers[i] != INADDR_NONE) {
+			iDNSServers[iServerCount++] = aDNSServers[i];
+		}
+	}
 }
 
 
@@ -95,54 +141,287 @@ int DNSClient_SPI2::inet_aton(const char* address, IPAddress& result)
 
 int DNSClient_SPI2::getHostByName(const char* aHostname, IPAddress& aResult, uint16_t timeout)
 {
+	int handle = resolveStart(aHostname, timeout);
+	if (handle < 0) return handle;
+
+	int ret;
+	while ((ret = resolveResult(handle, aResult)) == 0) {
+		resolvePoll();
+		yield();
+	}
+	return ret;
+}
+
+int DNSClient_SPI2::resolveStart(const char* aHostname, uint16_t timeout)
+{
+	uint8_t slot;
+	for (slot=0; slot < DNS_MAX_QUERIES; slot++) {
+		if (iQueries[slot].state == QUERY_FREE) break;
+	}
+	if (slot == DNS_MAX_QUERIES) return NO_QUERY_SLOT;
+
+	query_t *q = &iQueries[slot];
+	q->name = aHostname;
+	q->timeout = timeout;
+	q->tries = 0;
+	q->state = QUERY_PENDING;
+
+	// See if it's a numeric IP address, or we already know the answer
+	IPAddress addr;
 	int ret = 0;
+	if (inet_aton(aHostname, addr)) {
+		ret = SUCCESS;
+	} else {
+		q->hash = nameHash(aHostname);
+		ret = cacheLookup(q->hash, addr);
+	}
+	if (ret == 0 && iServerCount == 0) {
+		ret = INVALID_SERVER;
+	}
+	if (ret != 0) {
+		q->state = QUERY_DONE;
+		q->result = ret;
+		for (uint8_t i=0; i < 4; i++) q->addr[i] = addr[i];
+		return slot;
+	}
 
-	// See if it's a numeric IP address
-	if (inet_aton(aHostname, aResult)) {
-		// It is, our work here is done
-		return 1;
+	// All the lookups share one socket, answers are matched by ID
+	if (!iSocketOpen) {
+		if (iUdp.begin(1024+(millis() & 0xF)) != 1) {
+			q->state = QUERY_FREE;
+			return TIMED_OUT;
+		}
+		iSocketOpen = true;
+		iSendPending = false;
 	}
 
-	// Check we've got a valid DNS server to use
-	if (iDNSServer == INADDR_NONE) {
-		return INVALID_SERVER;
+	bool unique;
+	do {
+		q->id = micros() ^ (millis() << 4);
+		unique = true;
+		for (uint8_t i=0; i < DNS_MAX_QUERIES; i++) {
+			if (i != slot && iQueries[i].state == QUERY_PENDING &&
+			  iQueries[i].id == q->id) unique = false;
+		}
+	} while (!unique);
+
+	ret = StartRound(slot);
+	if (ret != 1) complete(slot, ret == 0 ? TIMED_OUT : ret, addr);
+	return slot;
+}
+
+int DNSClient_SPI2::resolvePoll()
+{
+	if (!iSocketOpen) return 0;
+
+	// Collect whatever answers have arrived
+	while (iUdp.parsePacket() > 0) {
+		uint8_t slot;
+		IPAddress addr;
+		int ret = ProcessResponse(slot, addr);
+		// The first real answer wins.  A server failing on its own
+		// doesn't end the lookup when others may still answer.
+		if (slot < DNS_MAX_QUERIES &&
+		  (ret == SUCCESS || iNegative || iServerCount == 1)) {
+			complete(slot, ret, addr);
+		}
 	}
-	
-	// Find a socket to use
-	if (iUdp.begin(1024+(millis() & 0xF)) == 1) {
-		// Try up to three times
-		int retries = 0;
-		// while ((retries < 3) && (ret <= 0)) {
-		// Send DNS request
-		ret = iUdp.beginPacket(iDNSServer, DNS_PORT);
-		if (ret != 0) {
-			// Now output the request data
-			ret = BuildRequest(aHostname);
-			if (ret != 0) {
-				// And finally send the request
-				ret = iUdp.endPacket();
-				if (ret != 0) {
-					// Now wait for a response
-					int wait_retries = 0;
-					ret = TIMED_OUT;
-					while ((wait_retries < 3) && (ret == TIMED_OUT)) {
-						ret = ProcessResponse(timeout, aResult);
-						wait_retries++;
-					}
-				}
+
+	// Resend the queries that went unanswered, give up after a few tries
+	iNegative = false;
+	sendBusy(); // collect the outcome of the last query sent
+	int pending = 0;
+	uint32_t now = millis();
+	for (uint8_t slot=0; slot < DNS_MAX_QUERIES; slot++) {
+		query_t *q = &iQueries[slot];
+		if (q->state != QUERY_PENDING) continue;
+		if (now - q->started >= q->timeout || q->failed >= iServerCount) {
+			int ret = TIMED_OUT;
+			if (q->tries < DNS_MAX_RETRIES) ret = StartRound(slot);
+			if (ret != 1) {
+				complete(slot, ret == 0 ? TIMED_OUT : ret, IPAddress());
+				continue;
 			}
+		} else if (q->nextServer < iServerCount && now - q->sent >= iStagger &&
+		  !sendBusy()) {
+			// The previous server is slow or unreachable, ask the next one too
+			if (SendRequest(slot, q->nextServer++) != 1) q->failed++;
 		}
-		retries++;
-		//}
+		pending++;
+	}
 
-		// We're done with the socket now
+	if (pending == 0) {
 		iUdp.stop();
+		iSocketOpen = false;
+		iSendPending = false;
 	}
+	return pending;
+}
 
+int DNSClient_SPI2::resolveResult(int aHandle, IPAddress& aResult)
+{
+	if (aHandle < 0 || aHandle >= DNS_MAX_QUERIES) return NO_QUERY_SLOT;
+	query_t *q = &iQueries[aHandle];
+	if (q->state == QUERY_FREE) return NO_QUERY_SLOT;
+	if (q->state == QUERY_PENDING) return 0;
+
+	q->state = QUERY_FREE;
+	if (q->result == SUCCESS) aResult = q->addr;
+	return q->result;
+}
+
+void DNSClient_SPI2::resolveCancel(int aHandle)
+{
+	if (aHandle < 0 || aHandle >= DNS_MAX_QUERIES) return;
+	iQueries[aHandle].state = QUERY_FREE;
+}
+
+// Begin a round of tries: ask the first server now, resolvePoll() asks
+// the others after the stagger.  Succeeds unless no query can go out.
+int DNSClient_SPI2::StartRound(uint8_t aSlot)
+{
+	query_t *q = &iQueries[aSlot];
+	q->tries++;
+	q->started = millis();
+	q->sent = q->started - iStagger;
+	q->nextServer = 0;
+	q->failed = 0;
+	iNegative = false;
+
+	if (sendBusy()) return 1; // resolvePoll() sends it once the socket is free
+	int ret = SendRequest(aSlot, q->nextServer++);
+	if (ret == 0) {
+		q->failed++;
+		if (q->nextServer < iServerCount) ret = 1; // try the next one
+	}
 	return ret;
 }
 
-uint16_t DNSClient_SPI2::BuildRequest(const char* aName)
+// The socket sends one query at a time, without waiting for it (and the
+// ARP before it): true while the last one is still going out.  A query
+// that couldn't be sent counts as that server failing, so the next one
+// is asked right away.
+bool DNSClient_SPI2::sendBusy()
+{
+	if (!iSendPending) return false;
+	int ret = iUdp.sendStatus();
+	if (ret == SendPending_SPI2) return true;
+	iSendPending = false;
+	query_t *q = &iQueries[iSendSlot];
+	if (ret == SendTimeout_SPI2 && q->state == QUERY_PENDING && q->id == iSendId) {
+		q->failed++;
+		q->sent = millis() - iStagger;
+	}
+	return false;
+}
+
+int DNSClient_SPI2::SendRequest(uint8_t aSlot, uint8_t aServer)
+{
+	query_t *q = &iQueries[aSlot];
+
+	// Build the whole query in RAM, then hand it to the chip in one go
+	uint8_t buffer[MAX_REQUEST_SIZE];
+	uint16_t len = BuildRequest(q->name, q->id, buffer);
+	if (len == 0) return INVALID_RESPONSE;
+	int ret = iUdp.sendTo(iDNSServers[aServer], DNS_PORT, buffer, len, false);
+	if (ret == 1) {
+		q->sent = millis();
+		iSendPending = true;
+		iSendSlot = aSlot;
+		iSendId = q->id;
+	}
+	return ret;
+}
+
+// Record the outcome of a query and feed the cache
+void DNSClient_SPI2::complete(uint8_t aSlot, int aResult, const IPAddress& aAddress)
+{
+	query_t *q = &iQueries[aSlot];
+	q->state = QUERY_DONE;
+	q->result = aResult;
+	for (uint8_t i=0; i < 4; i++) q->addr[i] = aAddress[i];
+
+	if (aResult == SUCCESS) {
+		cacheStore(q->hash, aAddress, iTTL, false);
+	} else if (iNegative) {
+		cacheStore(q->hash, aAddress, DNS_NEGATIVE_TTL, true);
+	}
+}
+
+void DNSClient_SPI2::flushCache()
+{
+	DNS_CACHE_LOCK();
+	memset(dns_cache, 0, sizeof(dns_cache));
+}
+
+// FNV-1a over the lower case name, ignoring a trailing dot
+uint32_t DNSClient_SPI2::nameHash(const char* aName)
+{
+	uint32_t hash = 2166136261UL;
+	while (*aName) {
+		char c = *aName++;
+		if (c == '.' && *aName == 0) break;
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		hash ^= (uint8_t)c;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+// Returns 1 and the address on a hit, INVALID_RESPONSE for a name known
+// not to exist, or 0 if the name isn't cached
+int DNSClient_SPI2::cacheLookup(uint32_t aHash, IPAddress& aResult)
+{
+	DNS_CACHE_LOCK();
+	uint32_t now = millis();
+	for (uint8_t i=0; i < DNS_CACHE_SIZE; i++) {
+		dnsentry_t *e = &dns_cache[i];
+		if (e->used == 0 || e->hash != aHash) continue;
+		if ((int32_t)(e->expires - now) <= 0) {
+			e->used = 0; // expired
+			return 0;
+		}
+		e->used = now | 1;
+		if (e->negative) return INVALID_RESPONSE;
+		aResult = e->addr;
+		return SUCCESS;
+	}
+	return 0;
+}
+
+void DNSClient_SPI2::cacheStore(uint32_t aHash, const IPAddress& aAddress, uint32_t aTTL, bool aNegative)
+{
+	if (aTTL == 0) return;
+	if (aTTL > DNS_MAX_TTL) aTTL = DNS_MAX_TTL;
+
+	DNS_CACHE_LOCK();
+	uint32_t now = millis();
+	dnsentry_t *e = NULL;
+	// Reuse the entry for this name, else a free or expired one, else
+	// evict the least recently used
+	for (uint8_t i=0; i < DNS_CACHE_SIZE; i++) {
+		dnsentry_t *c = &dns_cache[i];
+		if (c->used != 0 && c->hash == aHash) {
+			e = c;
+			break;
+		}
+		if (c->used == 0 || (int32_t)(c->expires - now) <= 0) {
+			if (e == NULL || e->used != 0) e = c;
+			c->used = 0;
+		} else if (e == NULL || (e->used != 0 && (int32_t)(c->used - e->used) < 0)) {
+			e = c;
+		}
+	}
+	e->hash = aHash;
+	for (uint8_t i=0; i < 4; i++) e->addr[i] = aAddress[i];
+	e->negative = aNegative;
+	e->expires = now + aTTL * 1000;
+	e->used = now | 1;
+}
+
+// Build the query in aBuffer (MAX_REQUEST_SIZE bytes), returns its length
+// or 0 if the name doesn't fit
+uint16_t DNSClient_SPI2::BuildRequest(const char* aName, uint16_t aId, uint8_t* aBuffer)
 {
 	// Build header
 	//                                    1  1  1  1  1  1
@@ -160,27 +439,18 @@ uint16_t DNSClient_SPI2::BuildRequest(const char* aName)
 	//    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
 	//    |                    ARCOUNT                    |
 	//    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
-	// As we only support one request at a time at present, we can simplify
-	// some of this header
-	iRequestId = millis(); // generate a random ID
-	uint16_t twoByteBuffer;
-
-	// FIXME We should also check that there's enough space available to write to, rather
-	// FIXME than assume there's enough space (as the code does at present)
-	iUdp.write((uint8_t*)&iRequestId, sizeof(iRequestId));
-
-	twoByteBuffer = htons(QUERY_FLAG | OPCODE_STANDARD_QUERY | RECURSION_DESIRED_FLAG);
-	iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
-
-	twoByteBuffer = htons(1);  // One question record
-	iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
-
-	twoByteBuffer = 0;  // Zero answer records
-	iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
-
-	iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
-	// and zero additional records
-	iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
+	// We only ask one question per request, so we can simplify some
+	// of this header
+	uint8_t *p = aBuffer;
+	uint16_t flags = QUERY_FLAG | OPCODE_STANDARD_QUERY | RECURSION_DESIRED_FLAG;
+
+	memcpy(p, &aId, sizeof(aId)); // already in wire order
+	p[2] = flags >> 8;
+	p[3] = flags & 0xFF;
+	p[4] = 0;  // One question record
+	p[5] = 1;
+	memset(p + 6, 0, 6); // Zero answer, authority and additional records
+	p += DNS_HEADER_SIZE;
 
 	// Build question
 	const char* start =aName;
@@ -195,41 +465,37 @@ uint16_t DNSClient_SPI2::BuildRequest(const char* aName)
 		}
 
 		if (end-start > 0) {
-			// Write out the size of this section
+			// Write out the size of this section, then the section
 			len = end-start;
-			iUdp.write(&len, sizeof(len));
-			// And then write out the section
-			iUdp.write((uint8_t*)start, end-start);
+			if (len > 63 || (p - aBuffer) + 1 + len > MAX_REQUEST_SIZE - 5) {
+				return 0;
+			}
+			*p++ = len;
+			memcpy(p, start, len);
+			p += len;
 		}
 		start = end+1;
 	}
 
 	// We've got to the end of the question name, so
 	// terminate it with a zero-length section
-	len = 0;
-	iUdp.write(&len, sizeof(len));
+	*p++ = 0;
 	// Finally the type and class of question
-	twoByteBuffer = htons(TYPE_A);
-	iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
-
-	twoByteBuffer = htons(CLASS_IN);  // Internet class of question
-	iUdp.write((uint8_t*)&twoByteBuffer, sizeof(twoByteBuffer));
-	// Success!  Everything buffered okay
-	return 1;
+	*p++ = TYPE_A >> 8;
+	*p++ = TYPE_A & 0xFF;
+	*p++ = CLASS_IN >> 8;  // Internet class of question
+	*p++ = CLASS_IN & 0xFF;
+	return p - aBuffer;
 }
 
 
-uint16_t DNSClient_SPI2::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
+// Parse the packet just received, aSlot tells which query it answers
+// (DNS_MAX_QUERIES if none)
+int DNSClient_SPI2::ProcessResponse(uint8_t& aSlot, IPAddress& aAddress)
 {
-	uint32_t startTime = millis();
-
-	// Wait for a response packet
-	while (iUdp.parsePacket() <= 0) {
-		if ((millis() - startTime) > aTimeout) {
-			return TIMED_OUT;
-		}
-		delay(50);
-	}
+	iTTL = 0;
+	iNegative = false;
+	aSlot = DNS_MAX_QUERIES;
 
 	// We've had a reply!
 	// Read the UDP header
@@ -239,22 +505,35 @@ uint16_t DNSClient_SPI2::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 		uint16_t word[DNS_HEADER_SIZE/2];
 	} header;
 
-	// Check that it's a response from the right server and the right port
-	if ( (iDNSServer != iUdp.remoteIP()) || (iUdp.remotePort() != DNS_PORT) ) {
+	// Check that it's a response from one of our servers and the right port
+	uint8_t server;
+	for (server=0; server < iServerCount; server++) {
+		if (iDNSServers[server] == iUdp.remoteIP()) break;
+	}
+	if ( (server == iServerCount) || (iUdp.remotePort() != DNS_PORT) ) {
 		// It's not from who we expected
+		iUdp.flush();
 		return INVALID_SERVER;
 	}
 
 	// Read through the rest of the response
 	if (iUdp.available() < DNS_HEADER_SIZE) {
+		iUdp.flush();
 		return TRUNCATED;
 	}
 	iUdp.read(header.byte, DNS_HEADER_SIZE);
 
 	uint16_t header_flags = htons(header.word[1]);
-	// Check that it's a response to this request
-	if ((iRequestId != (header.word[0])) ||
+	// Check that it's a response to one of our pending requests
+	for (uint8_t i=0; i < DNS_MAX_QUERIES; i++) {
+		if (iQueries[i].state == QUERY_PENDING && iQueries[i].id == header.word[0]) {
+			aSlot = i;
+			break;
+		}
+	}
+	if ((aSlot == DNS_MAX_QUERIES) ||
 	  ((header_flags & QUERY_RESPONSE_MASK) != (uint16_t)RESPONSE_FLAG) ) {
+		aSlot = DNS_MAX_QUERIES;
 		// Mark the entire packet as read
 		iUdp.flush(); // FIXME
 		return INVALID_RESPONSE;
@@ -262,6 +541,7 @@ uint16_t DNSClient_SPI2::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 	// Check for any errors in the response (or in our request)
 	// although we don't do anything to get round these
 	if ( (header_flags & TRUNCATION_FLAG) || (header_flags & RESP_MASK) ) {
+		iNegative = ((header_flags & RESP_MASK) == RESP_NAME_ERROR);
 		// Mark the entire packet as read
 		iUdp.flush(); // FIXME
 		return -5; //INVALID_RESPONSE;
@@ -270,6 +550,7 @@ uint16_t DNSClient_SPI2::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 	// And make sure we've got (at least) one answer
 	uint16_t answerCount = htons(header.word[3]);
 	if (answerCount == 0) {
+		iNegative = true; // the name exists, but has no address
 		// Mark the entire packet as read
 		iUdp.flush(); // FIXME
 		return -6; //INVALID_RESPONSE;
@@ -330,8 +611,11 @@ uint16_t DNSClient_SPI2::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 		iUdp.read((uint8_t*)&answerType, sizeof(answerType));
 		iUdp.read((uint8_t*)&answerClass, sizeof(answerClass));
 
-		// Ignore the Time-To-Live as we don't do any caching
-		iUdp.read((uint8_t *)NULL, TTL_SIZE); // don't care about the returned bytes
+		// Keep the smallest Time-To-Live along the chain for the cache
+		uint32_t ttl;
+		iUdp.read((uint8_t*)&ttl, TTL_SIZE);
+		ttl = ntohl(ttl);
+		if (i == 0 || ttl < iTTL) iTTL = ttl;
 
 		// And read out the length of this answer
 		// Don't need header_flags anymore, so we can reuse it here
@@ -346,7 +630,10 @@ uint16_t DNSClient_SPI2::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 			}
 			// FIXME: seems to lock up here on ESP8266, but why??
 //			iUdp.read(aAddress.raw_address(), 4);
-			iUdp.read(raw_address(aAddress), 4);
+			// raw_address() returns a copy, so read into our own buffer
+			uint8_t addr[4];
+			iUdp.read(addr, 4);
+			aAddress = addr;
 			return SUCCESS;
 		} else {
 			// This isn't an answer type we're after, move onto the next one
@@ -358,5 +645,6 @@ uint16_t DNSClient_SPI2::ProcessResponse(uint16_t aTimeout, IPAddress& aAddress)
 	iUdp.flush(); // FIXME
 
 	// If we get here then we haven't found an answer
+	iNegative = true;
 	return -10; //INVALID_RESPONSE;
 }
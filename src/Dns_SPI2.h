@@ -17,10 +17,37 @@
 #include "Ethernet_SPI2.h"
 #include "IPAddressHack.h"
 
+// Resolved names are kept in a small cache shared by all DNSClient_SPI2
+// instances, for as long as the answer TTL allows (capped to a day).
+// Names that don't exist are remembered for DNS_NEGATIVE_TTL seconds.
+#ifndef DNS_CACHE_SIZE
+#define DNS_CACHE_SIZE    8
+#endif
+#define DNS_NEGATIVE_TTL  60
+#define DNS_MAX_TTL       86400
+
+// Number of lookups a DNSClient_SPI2 can have in flight at once and how
+// many times each query is sent before giving up
+#ifndef DNS_MAX_QUERIES
+#define DNS_MAX_QUERIES   4
+#endif
+#define DNS_MAX_RETRIES   3
+
 class DNSClient_SPI2
 {
 public:
+	DNSClient_SPI2();
+	~DNSClient_SPI2();
+
 	void begin(const IPAddress& aDNSServer);
+	// Use several servers, the first to answer wins
+	void begin(const IPAddress* aDNSServers, uint8_t aCount);
+
+	/** Delay between sending a query to one server and the next.
+	    0 (the default) asks every server, each as soon as the query to
+	    the previous one is out.
+	*/
+	void setServerStagger(uint16_t aMilliseconds) { iStagger = aMilliseconds; }
 
 	/** Convert a numeric IP address string into a four-byte IP address.
 	    @param aIPAddrString IP address to convert
@@ -38,12 +65,70 @@ public:
 	*/
 	int getHostByName(const char* aHostname, IPAddress& aResult, uint16_t timeout=5000);
 
+	/** Start resolving a hostname without blocking.
+	    The name isn't copied: it must stay valid until the result is
+	    collected or the query is cancelled.
+	    @param aHostname Name to be resolved
+	    @param timeout Time to wait for an answer before resending the query
+	    @result a handle for resolveResult(), or a negative error code
+	*/
+	int resolveStart(const char* aHostname, uint16_t timeout=5000);
+
+	/** Send, resend and collect answers for the lookups in flight.
+	    Call it often, e.g. once per loop().
+	    @result number of lookups still waiting for an answer
+	*/
+	int resolvePoll();
+
+	/** Get the outcome of a lookup started by resolveStart().
+	    Once the result is returned, the handle is released.
+	    @result 0 if still pending, 1 and aResult on success,
+	            else error code
+	*/
+	int resolveResult(int aHandle, IPAddress& aResult);
+
+	/** Abandon a lookup and release its handle */
+	void resolveCancel(int aHandle);
+
+	/** Forget all cached answers, positive and negative */
+	static void flushCache();
+
 protected:
-	uint16_t BuildRequest(const char* aName);
-	uint16_t ProcessResponse(uint16_t aTimeout, IPAddress& aAddress);
+	typedef struct {
+		const char* name;  // not owned, see resolveStart()
+		uint32_t hash;
+		uint32_t started;  // millis() when the current round of tries began
+		uint32_t sent;     // millis() of the last transmission
+		uint16_t timeout;
+		uint16_t id;       // DNS message ID, as sent on the wire
+		uint8_t  state;
+		uint8_t  tries;
+		uint8_t  nextServer; // next server to ask in this round
+		uint8_t  failed;     // servers of this round the query didn't reach
+		int8_t   result;
+		uint8_t  addr[4];
+	} query_t;
+
+	uint16_t BuildRequest(const char* aName, uint16_t aId, uint8_t* aBuffer);
+	int SendRequest(uint8_t aSlot, uint8_t aServer);
+	int StartRound(uint8_t aSlot);
+	bool sendBusy();
+	int ProcessResponse(uint8_t& aSlot, IPAddress& aAddress);
+	void complete(uint8_t aSlot, int aResult, const IPAddress& aAddress);
+	static uint32_t nameHash(const char* aName);
+	static int cacheLookup(uint32_t aHash, IPAddress& aResult);
+	static void cacheStore(uint32_t aHash, const IPAddress& aAddress, uint32_t aTTL, bool aNegative);
 
-	IPAddress iDNSServer;
-	uint16_t iRequestId;
+	IPAddress iDNSServers[MAX_DNS_SERVERS];
+	uint8_t iServerCount;
+	uint16_t iStagger;
+	query_t iQueries[DNS_MAX_QUERIES];
+	bool iSocketOpen;
+	bool iSendPending;   // a query is still being sent, see sendBusy()
+	uint8_t iSendSlot;
+	uint16_t iSendId;
+	uint32_t iTTL;       // TTL of the last answer, in seconds
+	bool iNegative;      // the last answer says the name doesn't exist
 	EthernetUDP_SPI2 iUdp;
 };
 
@@ -0,0 +1,312 @@
+/*
+ *---------------------------------------------------------------------
+ * 2023 Dave Nardella
+ * This file il part of Ethernet_SP2, a library which allows the use of
+ * a WXXXX Wiznet chip/module on the second SPI port.
+ *---------------------------------------------------------------------
+*/
+// Bonding of the two interfaces: the stock Ethernet library on SPI and
+// Ethernet_SPI2 on SPI1 behind a single client/server/UDP interface.
+//
+// Each NIC keeps its own address, so this works per connection and per
+// datagram: a TCP connection stays on the NIC it was opened on and is lost
+// with that NIC's link, the next connect() goes to the other one.  Both
+// NICs must be able to reach the same destinations.
+//
+// Header only, because it needs the stock Ethernet library, which the
+// sketch has to include anyway.  Call EthernetBond_SPI2::maintain() from
+// loop(); it also runs maintain() on both interfaces.
+
+#ifndef ethernetbond_spi2_h_
+#define ethernetbond_spi2_h_
+
+#include <Ethernet.h>
+#include "Ethernet_SPI2.h"
+
+#define BOND_NIC_ETHERNET      0   // stock Ethernet, SPI
+#define BOND_NIC_ETHERNET_SPI2 1   // Ethernet_SPI2, SPI1
+#define BOND_NIC_NONE          0xFF
+
+enum EthernetBondMode_SPI2 {
+	BondActiveBackup_SPI2, // use the primary NIC, the other one while its link is down
+	BondRoundRobin_SPI2,   // alternate connections and datagrams between the NICs
+	BondHash_SPI2          // pick the NIC from the destination, a flow stays on one NIC
+};
+
+class EthernetBond_SPI2 {
+public:
+	EthernetBond_SPI2(EthernetBondMode_SPI2 mode = BondActiveBackup_SPI2, uint8_t primary = BOND_NIC_ETHERNET)
+	  : _mode(mode), _primary(primary), _active(primary), _next(0), _failovers(0), _callback(NULL) {
+		_up[0] = _up[1] = true;
+	}
+	void setMode(EthernetBondMode_SPI2 mode) { _mode = mode; }
+	void setPrimary(uint8_t nic) { _primary = nic; }
+	// Called when active-backup switches NIC
+	void onFailover(void (*callback)(uint8_t nic)) { _callback = callback; }
+
+	int maintain() {
+		int rc = Ethernet_SPI2.maintain();
+		Ethernet.maintain();
+		// a W5100 can't tell, its link is taken as up
+		_up[BOND_NIC_ETHERNET] = Ethernet.hardwareStatus() != EthernetNoHardware &&
+			Ethernet.linkStatus() != LinkOFF;
+		_up[BOND_NIC_ETHERNET_SPI2] = Ethernet_SPI2.hardwareStatus() != EthernetNoHardware_SPI2 &&
+			Ethernet_SPI2.linkStatus() != LinkOFF_SPI2;
+		uint8_t active = _primary;
+		if (!_up[active] && _up[active ^ 1]) active ^= 1;
+		if (active != _active) {
+			_active = active;
+			_failovers++;
+			if (_callback != NULL) _callback(active);
+		}
+		return rc;
+	}
+	bool linkUp(uint8_t nic) const { return nic <= BOND_NIC_ETHERNET_SPI2 && _up[nic]; }
+	uint8_t activeNic() const { return _active; }
+	uint16_t failoverCount() const { return _failovers; }
+
+	// NIC for a new connection or datagram to ip:port
+	uint8_t select(IPAddress ip, uint16_t port) {
+		uint8_t nic;
+		switch (_mode) {
+		  case BondRoundRobin_SPI2:
+			nic = _next;
+			_next ^= 1;
+			break;
+		  case BondHash_SPI2:
+			nic = (ip[0] ^ ip[1] ^ ip[2] ^ ip[3] ^ (port >> 8) ^ port);
+			nic = (nic ^ (nic >> 4) ^ (nic >> 2) ^ (nic >> 1)) & 1;
+			break;
+		  default:
+			return _active;
+		}
+		if (!_up[nic] && _up[nic ^ 1]) nic ^= 1;
+		return nic;
+	}
+	uint8_t select(const char *host, uint16_t port) {
+		// hash the name, it is resolved later by the chosen NIC
+		uint32_t h = 2166136261UL;
+		while (*host) h = (h ^ (uint8_t)*host++) * 16777619UL;
+		return select(IPAddress(h), port);
+	}
+
+private:
+	EthernetBondMode_SPI2 _mode;
+	uint8_t _primary;
+	uint8_t _active;
+	uint8_t _next;
+	bool _up[2];
+	uint16_t _failovers;
+	void (*_callback)(uint8_t nic);
+};
+
+class EthernetBondClient_SPI2 : public Client {
+public:
+	EthernetBondClient_SPI2(EthernetBond_SPI2& bond) : _bond(&bond), _nic(BOND_NIC_NONE) { }
+	EthernetBondClient_SPI2(EthernetBond_SPI2& bond, const EthernetClient& client)
+	  : _bond(&bond), _nic(BOND_NIC_ETHERNET), _c1(client) { }
+	EthernetBondClient_SPI2(EthernetBond_SPI2& bond, const EthernetClient_SPI2& client)
+	  : _bond(&bond), _nic(BOND_NIC_ETHERNET_SPI2), _c2(client) { }
+
+	virtual int connect(IPAddress ip, uint16_t port) {
+		stop();
+		uint8_t nic = _bond->select(ip, port);
+		if (nic_client(nic).connect(ip, port) == 1) {
+			_nic = nic;
+			return 1;
+		}
+		// give the other NIC a chance before failing
+		nic ^= 1;
+		if (_bond->linkUp(nic) && nic_client(nic).connect(ip, port) == 1) {
+			_nic = nic;
+			return 1;
+		}
+		return 0;
+	}
+	virtual int connect(const char *host, uint16_t port) {
+		stop();
+		uint8_t nic = _bond->select(host, port);
+		if (nic_client(nic).connect(host, port) == 1) {
+			_nic = nic;
+			return 1;
+		}
+		nic ^= 1;
+		if (_bond->linkUp(nic) && nic_client(nic).connect(host, port) == 1) {
+			_nic = nic;
+			return 1;
+		}
+		return 0;
+	}
+	virtual size_t write(uint8_t b) { return _nic == BOND_NIC_NONE ? 0 : nic_client(_nic).write(b); }
+	virtual size_t write(const uint8_t *buf, size_t size) {
+		return _nic == BOND_NIC_NONE ? 0 : nic_client(_nic).write(buf, size);
+	}
+	virtual int available() { return _nic == BOND_NIC_NONE ? 0 : nic_client(_nic).available(); }
+	virtual int read() { return _nic == BOND_NIC_NONE ? -1 : nic_client(_nic).read(); }
+	virtual int read(uint8_t *buf, size_t size) {
+		return _nic == BOND_NIC_NONE ? -1 : nic_client(_nic).read(buf, size);
+	}
+	virtual int peek() { return _nic == BOND_NIC_NONE ? -1 : nic_client(_nic).peek(); }
+	virtual void flush() { if (_nic != BOND_NIC_NONE) nic_client(_nic).flush(); }
+	virtual void stop() {
+		if (_nic != BOND_NIC_NONE) nic_client(_nic).stop();
+		_nic = BOND_NIC_NONE;
+	}
+	virtual uint8_t connected() { return _nic == BOND_NIC_NONE ? 0 : nic_client(_nic).connected(); }
+	virtual operator bool() { return _nic != BOND_NIC_NONE && (bool)nic_client(_nic); }
+	IPAddress remoteIP() {
+		if (_nic == BOND_NIC_ETHERNET) return _c1.remoteIP();
+		if (_nic == BOND_NIC_ETHERNET_SPI2) return _c2.remoteIP();
+		return IPAddress((uint32_t)0);
+	}
+	uint16_t remotePort() {
+		if (_nic == BOND_NIC_ETHERNET) return _c1.remotePort();
+		if (_nic == BOND_NIC_ETHERNET_SPI2) return _c2.remotePort();
+		return 0;
+	}
+	void setConnectionTimeout(uint16_t timeout) {
+		_c1.setConnectionTimeout(timeout);
+		_c2.setConnectionTimeout(timeout);
+	}
+	// NIC carrying the connection, BOND_NIC_NONE if not connected
+	uint8_t nic() const { return _nic; }
+
+	using Print::write;
+
+private:
+	Client& nic_client(uint8_t nic) {
+		if (nic == BOND_NIC_ETHERNET) return _c1;
+		return _c2;
+	}
+	EthernetBond_SPI2 *_bond;
+	uint8_t _nic;
+	EthernetClient _c1;
+	EthernetClient_SPI2 _c2;
+};
+
+// Listens on both NICs
+class EthernetBondServer_SPI2 : public Server {
+public:
+	EthernetBondServer_SPI2(EthernetBond_SPI2& bond, uint16_t port)
+	  : _bond(&bond), _s1(port), _s2(port), _next(0) { }
+	virtual void begin() {
+		_s1.begin();
+		_s2.begin();
+	}
+	// Alternates between the NICs so a busy one can't starve the other
+	EthernetBondClient_SPI2 available() {
+		for (uint8_t i = 0; i < 2; i++) {
+			uint8_t nic = _next;
+			_next ^= 1;
+			if (nic == BOND_NIC_ETHERNET) {
+				EthernetClient client = _s1.available();
+				if (client) return EthernetBondClient_SPI2(*_bond, client);
+			} else {
+				EthernetClient_SPI2 client = _s2.available();
+				if (client) return EthernetBondClient_SPI2(*_bond, client);
+			}
+		}
+		return EthernetBondClient_SPI2(*_bond);
+	}
+	EthernetBondClient_SPI2 accept() {
+		for (uint8_t i = 0; i < 2; i++) {
+			uint8_t nic = _next;
+			_next ^= 1;
+			if (nic == BOND_NIC_ETHERNET) {
+				EthernetClient client = _s1.accept();
+				if (client) return EthernetBondClient_SPI2(*_bond, client);
+			} else {
+				EthernetClient_SPI2 client = _s2.accept();
+				if (client) return EthernetBondClient_SPI2(*_bond, client);
+			}
+		}
+		return EthernetBondClient_SPI2(*_bond);
+	}
+	// Writes to the clients of both NICs
+	virtual size_t write(uint8_t b) { return write(&b, 1); }
+	virtual size_t write(const uint8_t *buf, size_t size) {
+		size_t n1 = _s1.write(buf, size);
+		size_t n2 = _s2.write(buf, size);
+		return n1 > n2 ? n1 : n2;
+	}
+	virtual operator bool() { return (bool)_s1 || (bool)_s2; }
+	using Print::write;
+
+private:
+	EthernetBond_SPI2 *_bond;
+	EthernetServer _s1;
+	EthernetServer_SPI2 _s2;
+	uint8_t _next;
+};
+
+// Bound to the same port on both NICs.  Each outgoing datagram goes
+// out of the NIC chosen by the bond, incoming ones are read from both.
+class EthernetBondUDP_SPI2 : public UDP {
+public:
+	EthernetBondUDP_SPI2(EthernetBond_SPI2& bond)
+	  : _bond(&bond), _txNic(BOND_NIC_ETHERNET), _rxNic(BOND_NIC_ETHERNET), _rxNext(0) { }
+	virtual uint8_t begin(uint16_t port) {
+		uint8_t r1 = _u1.begin(port);
+		uint8_t r2 = _u2.begin(port);
+		return r1 || r2;
+	}
+	virtual uint8_t beginMulticast(IPAddress ip, uint16_t port) {
+		uint8_t r1 = _u1.beginMulticast(ip, port);
+		uint8_t r2 = _u2.beginMulticast(ip, port);
+		return r1 || r2;
+	}
+	virtual void stop() {
+		_u1.stop();
+		_u2.stop();
+	}
+	virtual int beginPacket(IPAddress ip, uint16_t port) {
+		_txNic = _bond->select(ip, port);
+		return tx().beginPacket(ip, port);
+	}
+	virtual int beginPacket(const char *host, uint16_t port) {
+		_txNic = _bond->select(host, port);
+		return tx().beginPacket(host, port);
+	}
+	virtual int endPacket() { return tx().endPacket(); }
+	virtual size_t write(uint8_t b) { return tx().write(b); }
+	virtual size_t write(const uint8_t *buffer, size_t size) { return tx().write(buffer, size); }
+	using Print::write;
+	virtual int parsePacket() {
+		for (uint8_t i = 0; i < 2; i++) {
+			uint8_t nic = _rxNext;
+			_rxNext ^= 1;
+			int len = nic_udp(nic).parsePacket();
+			if (len > 0) {
+				_rxNic = nic;
+				return len;
+			}
+		}
+		return 0;
+	}
+	virtual int available() { return rx().available(); }
+	virtual int read() { return rx().read(); }
+	virtual int read(unsigned char* buffer, size_t len) { return rx().read(buffer, len); }
+	virtual int read(char* buffer, size_t len) { return rx().read(buffer, len); }
+	virtual int peek() { return rx().peek(); }
+	virtual void flush() { rx().flush(); }
+	virtual IPAddress remoteIP() { return rx().remoteIP(); }
+	virtual uint16_t remotePort() { return rx().remotePort(); }
+	// NIC the last packet was received on
+	uint8_t nic() const { return _rxNic; }
+
+private:
+	UDP& nic_udp(uint8_t nic) {
+		if (nic == BOND_NIC_ETHERNET) return _u1;
+		return _u2;
+	}
+	UDP& tx() { return nic_udp(_txNic); }
+	UDP& rx() { return nic_udp(_rxNic); }
+	EthernetBond_SPI2 *_bond;
+	EthernetUDP _u1;
+	EthernetUDP_SPI2 _u2;
+	uint8_t _txNic;
+	uint8_t _rxNic;
+	uint8_t _rxNext;
+};
+
+#endif
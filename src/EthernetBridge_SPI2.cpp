@@ -0,0 +1,139 @@
+/*
+ *---------------------------------------------------------------------
+ * 2023 Dave Nardella
+ * This file il part of Ethernet_SP2, a library which allows the use of
+ * a WXXXX Wiznet chip/module on the second SPI port.
+ *---------------------------------------------------------------------
+ *
+ * Learning layer 2 bridge between two raw frame ports
+ */
+
+#include <Arduino.h>
+#include "Ethernet_SPI2.h"
+#include "EthernetBridge_SPI2.h"
+
+EthernetBridge_SPI2::EthernetBridge_SPI2(EthernetBridgePort_SPI2 &port0, EthernetBridgePort_SPI2 &port1)
+  : _haveLocal(false), _ageing((uint32_t)BRIDGE_DEFAULT_AGEING * 1000)
+{
+	_port[0] = &port0;
+	_port[1] = &port1;
+	for (uint8_t d = 0; d < 2; d++) {
+		_count[d] = 0;
+		_next[d] = 0;
+		_offset[d] = 0;
+		_readAt[d] = 0;
+	}
+	flushTable();
+	resetStats();
+}
+
+void EthernetBridge_SPI2::setLocalMAC(const uint8_t *mac)
+{
+	memcpy(_localMAC, mac, 6);
+	_haveLocal = true;
+}
+
+void EthernetBridge_SPI2::flushTable()
+{
+	memset(_table, 0, sizeof(_table));
+}
+
+void EthernetBridge_SPI2::resetStats()
+{
+	memset(&_stats, 0, sizeof(_stats));
+}
+
+int8_t EthernetBridge_SPI2::lookup(const uint8_t *mac, uint32_t now)
+{
+	for (uint8_t i = 0; i < BRIDGE_MAC_TABLE_SIZE; i++) {
+		macentry_t *e = &_table[i];
+		if (e->seen == 0) continue;
+		if (now - e->seen >= _ageing) {
+			e->seen = 0; // aged out
+			continue;
+		}
+		if (memcmp(e->mac, mac, 6) == 0) return e->port;
+	}
+	return -1;
+}
+
+void EthernetBridge_SPI2::learn(const uint8_t *mac, uint8_t port, uint32_t now)
+{
+	macentry_t *slot = NULL;
+	for (uint8_t i = 0; i < BRIDGE_MAC_TABLE_SIZE; i++) {
+		macentry_t *e = &_table[i];
+		if (e->seen != 0 && memcmp(e->mac, mac, 6) == 0) {
+			slot = e; // known, maybe moved to the other port
+			break;
+		}
+		// otherwise take a free slot, or the one idle for longest
+		if (slot == NULL || (slot->seen != 0 && (e->seen == 0 || now - e->seen > now - slot->seen))) {
+			slot = e;
+		}
+	}
+	memcpy(slot->mac, mac, 6);
+	slot->port = port;
+	slot->seen = now | 1;
+}
+
+// Read a batch from one port and send it out of the other
+//
+int EthernetBridge_SPI2::pass(uint8_t from)
+{
+	uint8_t to = from ^ 1;
+	uint8_t *buf = _buf[from];
+	uint32_t now = millis();
+	int n = 0;
+
+	if (_next[from] >= _count[from]) {
+		_readAt[from] = micros();
+		n = _port[from]->readFrames(buf, BRIDGE_BUFFER_SIZE, _lens[from], BRIDGE_MAX_BATCH);
+		if (n <= 0) return 0;
+		_count[from] = n;
+		_next[from] = 0;
+		_offset[from] = 0;
+		_stats.rxFrames[from] += n;
+		uint16_t offset = 0;
+		for (uint8_t i = 0; i < n; i++) {
+			const uint8_t *src = buf + offset + 6;
+			if (!(src[0] & 0x01)) learn(src, from, now);
+			offset += _lens[from][i];
+		}
+	}
+	while (_next[from] < _count[from]) {
+		uint8_t *frame = buf + _offset[from];
+		uint16_t len = _lens[from][_next[from]];
+		bool flood = false, drop = false;
+		if (frame[0] & 0x01) {
+			flood = true; // broadcast or multicast
+		} else if (_haveLocal && memcmp(frame, _localMAC, 6) == 0) {
+			drop = true;
+		} else {
+			int8_t port = lookup(frame, now);
+			if (port == from) drop = true;
+			if (port < 0) flood = true;
+		}
+		if (drop) {
+			_stats.filtered[from]++;
+		} else if (_port[to]->sendFrame(frame, len, false)) {
+			if (flood) _stats.flooded[to]++;
+			else _stats.forwarded[to]++;
+			uint32_t latency = micros() - _readAt[from];
+			if (latency > _stats.latencyMax) _stats.latencyMax = latency;
+			_stats.latencySum += latency;
+			_stats.latencyCount++;
+		} else if (micros() - _readAt[from] < (uint32_t)BRIDGE_MAX_HOLD * 1000) {
+			return n; // no room yet, retry on the next poll
+		} else {
+			_stats.txErrors[to]++;
+		}
+		_offset[from] += len;
+		_next[from]++;
+	}
+	return n;
+}
+
+int EthernetBridge_SPI2::poll()
+{
+	return pass(0) + pass(1);
+}
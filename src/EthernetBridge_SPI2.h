@@ -0,0 +1,114 @@
+/*
+ *---------------------------------------------------------------------
+ * 2023 Dave Nardella
+ * This file il part of Ethernet_SP2, a library which allows the use of
+ * a WXXXX Wiznet chip/module on the second SPI port.
+ *---------------------------------------------------------------------
+*/
+// Learning layer 2 bridge between two raw frame ports, typically an
+// EthernetRaw_SPI2 and a MACRAW socket on the adapter of the stock
+// Ethernet library (see examples/EthernetBridge).
+//
+// The chip's own stack keeps working on an Ethernet_SPI2 port used by the
+// bridge, but it only talks to its own segment: the frames it sends never
+// reach the MACRAW socket, so hosts behind the other port can't see it.
+
+#ifndef ethernetbridge_spi2_h_
+#define ethernetbridge_spi2_h_
+
+#include "Ethernet_SPI2.h"
+
+#ifndef BRIDGE_MAC_TABLE_SIZE
+#define BRIDGE_MAC_TABLE_SIZE  32
+#endif
+// Bytes of frames read from a port at once, one buffer per direction
+#ifndef BRIDGE_BUFFER_SIZE
+#define BRIDGE_BUFFER_SIZE     3072
+#endif
+#define BRIDGE_MAX_BATCH       8
+// How long frames may wait for room in the other chip's TX buffer
+#define BRIDGE_MAX_HOLD        100 // milliseconds
+#define BRIDGE_DEFAULT_AGEING  300 // seconds
+
+// Anything that can move whole Ethernet frames (destination MAC first, no FCS)
+class EthernetBridgePort_SPI2 {
+public:
+	virtual ~EthernetBridgePort_SPI2() { }
+	// Same contract as EthernetRaw_SPI2::readFrames()
+	virtual int readFrames(uint8_t *buf, uint16_t size, uint16_t *lens, uint8_t maxFrames) = 0;
+	virtual bool sendFrame(const uint8_t *frame, uint16_t len, bool wait) = 0;
+};
+
+// Port on Ethernet_SPI2.  The EthernetRaw_SPI2 must be opened without the
+// MAC filter, the bridge needs every frame
+class EthernetRawPort_SPI2 : public EthernetBridgePort_SPI2 {
+public:
+	EthernetRawPort_SPI2(EthernetRaw_SPI2 &raw) : _raw(raw) { }
+	virtual int readFrames(uint8_t *buf, uint16_t size, uint16_t *lens, uint8_t maxFrames) {
+		return _raw.readFrames(buf, size, lens, maxFrames);
+	}
+	virtual bool sendFrame(const uint8_t *frame, uint16_t len, bool wait) {
+		return _raw.sendFrame(frame, len, wait);
+	}
+private:
+	EthernetRaw_SPI2 &_raw;
+};
+
+// Counters per port; a frame is counted on the port it went out of,
+// except rxFrames and filtered which count on the receiving port
+struct EthernetBridgeStats_SPI2 {
+	uint32_t rxFrames[2];
+	uint32_t forwarded[2]; // to a destination learned behind that port
+	uint32_t flooded[2];   // unknown, broadcast or multicast destination
+	uint32_t filtered[2];  // destination on the receiving side, or us
+	uint32_t txErrors[2];  // no room in the TX buffer for BRIDGE_MAX_HOLD, dropped
+	// From the start of the read that fetched a frame until it was
+	// handed to the other chip, in microseconds
+	uint32_t latencyMax;
+	uint32_t latencySum;
+	uint32_t latencyCount;
+};
+
+class EthernetBridge_SPI2 {
+public:
+	EthernetBridge_SPI2(EthernetBridgePort_SPI2 &port0, EthernetBridgePort_SPI2 &port1);
+	// Frames for this MAC are for the local stack and are never forwarded
+	void setLocalMAC(const uint8_t *mac);
+	// Learned addresses not seen for this long are forgotten
+	void setAgeing(uint16_t seconds) { _ageing = (uint32_t)seconds * 1000; }
+	void flushTable();
+	// Move whatever is waiting on both ports.  Call from loop() as often
+	// as possible.  Returns the number of frames read
+	int poll();
+	const EthernetBridgeStats_SPI2 &stats() const { return _stats; }
+	void resetStats();
+
+private:
+	typedef struct {
+		uint8_t  mac[6];
+		uint8_t  port;
+		uint32_t seen; // millis(), 0 = free
+	} macentry_t;
+
+	int pass(uint8_t from);
+	int8_t lookup(const uint8_t *mac, uint32_t now);
+	void learn(const uint8_t *mac, uint8_t port, uint32_t now);
+
+	EthernetBridgePort_SPI2 *_port[2];
+	macentry_t _table[BRIDGE_MAC_TABLE_SIZE];
+	uint8_t _localMAC[6];
+	bool _haveLocal;
+	uint32_t _ageing;
+	EthernetBridgeStats_SPI2 _stats;
+	// One buffer per direction.  When the other chip has no room, the
+	// rest of a batch waits in its buffer while the opposite direction
+	// keeps flowing, and no more is read from that port meanwhile
+	uint8_t _buf[2][BRIDGE_BUFFER_SIZE];
+	uint16_t _lens[2][BRIDGE_MAX_BATCH];
+	uint8_t _count[2];   // frames in the buffer
+	uint8_t _next[2];    // first frame not sent yet
+	uint16_t _offset[2]; // and where it starts
+	uint32_t _readAt[2]; // micros() when the batch was read
+};
+
+#endif
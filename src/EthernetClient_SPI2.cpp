@@ -43,8 +43,8 @@ int EthernetClient_SPI2::connect(const char * host, uint16_t port)
 		}
 		_sockindex = MAX_SOCK_NUM;
 	}
-	dns.begin(Ethernet_SPI2.dnsServerIP());
-	if (!dns.getHostByName(host, remote_addr)) return 0; // TODO: use _timeout
+	dns.begin(Ethernet_SPI2.dnsServerList(), Ethernet_SPI2.dnsServerCount());
+	if (dns.getHostByName(host, remote_addr) != 1) return 0; // TODO: use _timeout
 	return connect(remote_addr, port);
 }
 
@@ -61,7 +61,7 @@ int EthernetClient_SPI2::connect(IPAddress ip, uint16_t port)
 #else
 	if (ip == IPAddress(0ul) || ip == IPAddress(0xFFFFFFFFul)) return 0;
 #endif
-	_sockindex = Ethernet_SPI2.socketBegin(SnMR::TCP, 0);
+	_sockindex = Ethernet_SPI2.socketBegin(SnMR::TCP, 0, 0, &_opts);
 	if (_sockindex >= MAX_SOCK_NUM) return 0;
 	Ethernet_SPI2.socketConnect(_sockindex, rawIPAddress(ip), port);
 	uint32_t start = millis();
@@ -115,6 +115,25 @@ int EthernetClient_SPI2::read(uint8_t *buf, size_t size)
 	return Ethernet_SPI2.socketRecv(_sockindex, buf, size);
 }
 
+void EthernetClient_SPI2::setWindowUpdateThreshold(uint16_t bytes)
+{
+	if (_sockindex >= MAX_SOCK_NUM) return;
+	Ethernet_SPI2.socketSetRecvThreshold(_sockindex, bytes);
+}
+
+bool EthernetClient_SPI2::setOption(EthernetSPI2SocketOption option, uint16_t value)
+{
+	if (!_opts.set(option, value)) return false;
+	if (_sockindex < MAX_SOCK_NUM) Ethernet_SPI2.socketSetOptions(_sockindex, _opts);
+	return true;
+}
+
+void EthernetClient_SPI2::setKeepAlive(uint16_t seconds)
+{
+	if (_sockindex >= MAX_SOCK_NUM) return;
+	Ethernet_SPI2.socketSetKeepAlive(_sockindex, seconds);
+}
+
 int EthernetClient_SPI2::peek()
 {
 	if (_sockindex >= MAX_SOCK_NUM) return -1;
@@ -190,11 +209,7 @@ bool EthernetClient_SPI2::operator==(const EthernetClient_SPI2& rhs)
 uint16_t EthernetClient_SPI2::localPort()
 {
 	if (_sockindex >= MAX_SOCK_NUM) return 0;
-	uint16_t port;
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-	port = W5100_SPI2.readSnPORT(_sockindex);
-	SPI1.endTransaction();
-	return port;
+	return Ethernet_SPI2.socketLocalPort(_sockindex);
 }
 
 // https://github.com/per1234/EthernetMod
@@ -203,9 +218,8 @@ IPAddress EthernetClient_SPI2::remoteIP()
 {
 	if (_sockindex >= MAX_SOCK_NUM) return IPAddress((uint32_t)0);
 	uint8_t remoteIParray[4];
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-	W5100_SPI2.readSnDIPR(_sockindex, remoteIParray);
-	SPI1.endTransaction();
+	uint16_t port;
+	Ethernet_SPI2.socketPeer(_sockindex, remoteIParray, &port);
 	return IPAddress(remoteIParray);
 }
 
@@ -214,9 +228,8 @@ IPAddress EthernetClient_SPI2::remoteIP()
 uint16_t EthernetClient_SPI2::remotePort()
 {
 	if (_sockindex >= MAX_SOCK_NUM) return 0;
+	uint8_t remoteIParray[4];
 	uint16_t port;
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-	port = W5100_SPI2.readSnDPORT(_sockindex);
-	SPI1.endTransaction();
+	Ethernet_SPI2.socketPeer(_sockindex, remoteIParray, &port);
 	return port;
 }
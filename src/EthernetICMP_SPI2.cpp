@@ -0,0 +1,209 @@
+/*
+ *---------------------------------------------------------------------
+ * 2023 Dave Nardella
+ * This file il part of Ethernet_SP2, a library which allows the use of
+ * a WXXXX Wiznet chip/module on the second SPI port.
+ *---------------------------------------------------------------------
+ *
+ * ICMP echo (ping) over an IP_RAW socket
+ */
+
+#include <Arduino.h>
+#include "Ethernet_SPI2.h"
+#include "utility/w5100_SPI2.h"
+
+#define ICMP_ECHO_REPLY    0
+#define ICMP_ECHO_REQUEST  8
+#define ICMP_HEADER_SIZE   8
+#define IPRAW_HEADER_SIZE  6 // source IP and length, added by the chip
+
+static uint16_t checksum(const uint8_t *data, uint16_t len)
+{
+	uint32_t sum = 0;
+	for (uint16_t i = 0; i + 1 < len; i += 2) {
+		sum += (data[i] << 8) | data[i + 1];
+	}
+	if (len & 1) sum += data[len - 1] << 8;
+	while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+	return ~sum;
+}
+
+EthernetICMP_SPI2::EthernetICMP_SPI2() : sockindex(MAX_SOCK_NUM), _id(0), _seq(0),
+  _size(32), _interval(1000), _timeout(1000), _count(0), _forever(false), _lastSend(0)
+{
+	memset(_window, 0, sizeof(_window));
+	resetStats();
+}
+
+bool EthernetICMP_SPI2::begin()
+{
+	stop();
+	sockindex = Ethernet_SPI2.socketBegin(SnMR::IPRAW, 0, IPPROTO::ICMP);
+	if (sockindex >= MAX_SOCK_NUM) return false;
+	// tell our replies from those to other pingers on the network
+	_id = (uint16_t)(micros() ^ (millis() << 4));
+	return true;
+}
+
+void EthernetICMP_SPI2::stop()
+{
+	if (sockindex < MAX_SOCK_NUM) {
+		Ethernet_SPI2.socketClose(sockindex);
+		sockindex = MAX_SOCK_NUM;
+	}
+	_count = 0;
+	_forever = false;
+	memset(_window, 0, sizeof(_window));
+}
+
+void EthernetICMP_SPI2::resetStats()
+{
+	memset(&_stats, 0, sizeof(_stats));
+	_rttSum = 0;
+}
+
+bool EthernetICMP_SPI2::send()
+{
+	uint8_t buf[ICMP_HEADER_SIZE + ICMP_MAX_PAYLOAD];
+	uint8_t slot;
+
+	// the oldest outstanding request makes room if needed
+	for (slot = 0; slot < ICMP_WINDOW; slot++) {
+		if (!_window[slot].active) break;
+	}
+	if (slot == ICMP_WINDOW) {
+		slot = 0;
+		for (uint8_t i = 1; i < ICMP_WINDOW; i++) {
+			if (_window[i].sentAt - _window[slot].sentAt > 0x80000000UL) slot = i;
+		}
+		_stats.lost++;
+	}
+	_seq++;
+	buf[0] = ICMP_ECHO_REQUEST;
+	buf[1] = 0;
+	buf[2] = 0;
+	buf[3] = 0;
+	buf[4] = _id >> 8;
+	buf[5] = _id & 0xFF;
+	buf[6] = _seq >> 8;
+	buf[7] = _seq & 0xFF;
+	for (uint16_t i = 0; i < _size; i++) {
+		buf[ICMP_HEADER_SIZE + i] = 'a' + (i % 23);
+	}
+	uint16_t sum = checksum(buf, ICMP_HEADER_SIZE + _size);
+	buf[2] = sum >> 8;
+	buf[3] = sum & 0xFF;
+
+	uint32_t now = micros();
+	if (!Ethernet_SPI2.socketSendUDPTo(sockindex, raw_address(_target), 0,
+	  buf, ICMP_HEADER_SIZE + _size, false)) {
+		return false;
+	}
+	_window[slot].seq = _seq;
+	_window[slot].sentAt = now;
+	_window[slot].active = true;
+	_stats.sent++;
+	_lastSend = millis();
+	return true;
+}
+
+void EthernetICMP_SPI2::reply(uint16_t seq, uint32_t now)
+{
+	for (uint8_t i = 0; i < ICMP_WINDOW; i++) {
+		if (!_window[i].active || _window[i].seq != seq) continue;
+		_window[i].active = false;
+		uint32_t rtt = now - _window[i].sentAt;
+		if (_stats.received == 0) {
+			_stats.rttMin = rtt;
+			_stats.rttMax = rtt;
+		} else {
+			if (rtt < _stats.rttMin) _stats.rttMin = rtt;
+			if (rtt > _stats.rttMax) _stats.rttMax = rtt;
+			uint32_t d = rtt > _stats.rttLast ? rtt - _stats.rttLast : _stats.rttLast - rtt;
+			_stats.jitter += ((int32_t)d - (int32_t)_stats.jitter) / 16;
+		}
+		_stats.received++;
+		_stats.rttLast = rtt;
+		_rttSum += rtt;
+		_stats.rttAvg = _rttSum / _stats.received;
+		Ethernet_SPI2.addRttSample(_target, rtt);
+		return;
+	}
+	// late or duplicate reply, already counted as lost
+}
+
+void EthernetICMP_SPI2::receive()
+{
+	uint8_t buf[IPRAW_HEADER_SIZE + ICMP_HEADER_SIZE];
+
+	while (Ethernet_SPI2.socketRecvAvailable(sockindex) >= IPRAW_HEADER_SIZE) {
+		uint32_t now = micros();
+		uint16_t got = Ethernet_SPI2.socketRecvPeek(sockindex, buf, sizeof(buf));
+		if (got < IPRAW_HEADER_SIZE) break;
+		uint16_t len = (buf[4] << 8) | buf[5];
+		// drop the packet, only its header is needed
+		Ethernet_SPI2.socketRecv(sockindex, NULL, IPRAW_HEADER_SIZE + len);
+		if (len < ICMP_HEADER_SIZE || got < sizeof(buf)) continue;
+		const uint8_t *icmp = buf + IPRAW_HEADER_SIZE;
+		if (icmp[0] != ICMP_ECHO_REPLY || icmp[1] != 0) continue;
+		if (!(IPAddress(buf) == _target)) continue;
+		if (((icmp[4] << 8) | icmp[5]) != _id) continue;
+		reply((icmp[6] << 8) | icmp[7], now);
+	}
+}
+
+void EthernetICMP_SPI2::expire()
+{
+	uint32_t now = micros();
+	for (uint8_t i = 0; i < ICMP_WINDOW; i++) {
+		if (_window[i].active && now - _window[i].sentAt >= (uint32_t)_timeout * 1000) {
+			_window[i].active = false;
+			_stats.lost++;
+		}
+	}
+}
+
+bool EthernetICMP_SPI2::start(IPAddress ip, uint16_t count)
+{
+	if (sockindex >= MAX_SOCK_NUM && !begin()) return false;
+	_target = ip;
+	_count = count;
+	_forever = (count == 0);
+	memset(_window, 0, sizeof(_window));
+	if (!send()) return false;
+	if (!_forever) _count--;
+	return true;
+}
+
+void EthernetICMP_SPI2::poll()
+{
+	if (sockindex >= MAX_SOCK_NUM) return;
+	// collect the outcome of the last (deferred) request
+	Ethernet_SPI2.socketSendUDPStatus(sockindex);
+	receive();
+	expire();
+	if ((_forever || _count > 0) && millis() - _lastSend >= _interval) {
+		if (send() && !_forever) _count--;
+	}
+}
+
+bool EthernetICMP_SPI2::running()
+{
+	if (_forever || _count > 0) return true;
+	for (uint8_t i = 0; i < ICMP_WINDOW; i++) {
+		if (_window[i].active) return true;
+	}
+	return false;
+}
+
+long EthernetICMP_SPI2::ping(IPAddress ip)
+{
+	uint16_t received = _stats.received;
+	if (!start(ip, 1)) return -1;
+	while (running()) {
+		poll();
+		yield();
+	}
+	if (_stats.received == received) return -1;
+	return _stats.rttLast;
+}
@@ -0,0 +1,639 @@
+/*
+ *---------------------------------------------------------------------
+ * 2023 Dave Nardella
+ * This file il part of Ethernet_SP2, a library which allows the use of
+ * a WXXXX Wiznet chip/module on the second SPI port.
+ *---------------------------------------------------------------------
+ *
+ * Network stack on the M4 core, proxies on the M7
+ */
+
+#include <Arduino.h>
+
+#if defined(ARDUINO_ARCH_MBED) && (defined(CORE_CM7) || defined(CORE_CM4))
+
+#include "EthernetOffload_SPI2.h"
+
+static EthernetOffloadShared_SPI2 * const shared = (EthernetOffloadShared_SPI2 *)ETHERNET_OFFLOAD_ADDR;
+
+static_assert(sizeof(EthernetOffloadShared_SPI2) <= 32768, "the shared block doesn't fit in SRAM3");
+
+// Bounds of the RAM the linker script gives this core.  Weak, so a
+// script that doesn't define one leaves it NULL and its check is skipped
+extern "C" {
+extern uint32_t __data_start__[] __attribute__((weak));
+extern uint32_t __HeapLimit[] __attribute__((weak));
+extern uint32_t __StackLimit[] __attribute__((weak));
+extern uint32_t __StackTop[] __attribute__((weak));
+}
+
+// The M4 sees the D2 SRAM at 0x10000000 as well as 0x30000000
+static uintptr_t offloadAlias(uintptr_t a)
+{
+	if (a >= 0x10000000 && a <= 0x10048000) a += 0x20000000;
+	return a;
+}
+
+static bool offloadOverlaps(const void *start, const void *end)
+{
+	if (start == NULL || end == NULL) return false;
+	uintptr_t s = offloadAlias((uintptr_t)start);
+	uintptr_t e = offloadAlias((uintptr_t)end);
+	uintptr_t bs = offloadAlias(ETHERNET_OFFLOAD_ADDR);
+	uintptr_t be = bs + sizeof(EthernetOffloadShared_SPI2);
+	return bs < e && s < be;
+}
+
+// Data, bss and heap run from __data_start__ to __HeapLimit, the stack
+// from __StackLimit to __StackTop
+static bool offloadBlockFree()
+{
+	return !offloadOverlaps(__data_start__, __HeapLimit) &&
+	  !offloadOverlaps(__StackLimit, __StackTop);
+}
+
+#if defined(CORE_CM4)
+
+/*****************************************/
+/*          Service (M4 core)            */
+/*****************************************/
+
+#include "Ethernet_SPI2.h"
+#include "Dns_SPI2.h"
+
+static EthernetClient_SPI2 tcp[ETHERNET_OFFLOAD_CHANNELS];
+static EthernetUDP_SPI2 udp[ETHERNET_OFFLOAD_CHANNELS];
+
+EthernetOffloadService_SPI2::EthernetOffloadService_SPI2() : _infoMillis(0)
+{
+	memset(_mode, ChanFree, sizeof(_mode));
+	memset(_peerClosed, 0, sizeof(_peerClosed));
+	memset(_pending, 0, sizeof(_pending));
+}
+
+bool EthernetOffloadService_SPI2::begin()
+{
+	if (!offloadBlockFree()) return false;
+	shared->magic = 0;
+	shared->cmd.reset();
+	shared->evt.reset();
+	for (uint8_t ch = 0; ch < ETHERNET_OFFLOAD_CHANNELS; ch++) {
+		shared->tx[ch].reset();
+		shared->rx[ch].reset();
+	}
+	info();
+	__DMB();
+	shared->magic = OFFLOAD_MAGIC;
+	return true;
+}
+
+// The event ring can't fill up: the M7 has at most one request pending
+// per channel, plus the resolver
+void EthernetOffloadService_SPI2::event(uint8_t type, uint8_t chan, int16_t result, const uint8_t *ip)
+{
+	EthernetOffloadMsg_SPI2 m;
+	memset(&m, 0, sizeof(m));
+	m.type = type;
+	m.chan = chan;
+	m.result = result;
+	if (ip) memcpy(m.ip, ip, 4);
+	shared->evt.write(&m, sizeof(m));
+}
+
+void EthernetOffloadService_SPI2::info()
+{
+	IPAddress ip = Ethernet_SPI2.localIP();
+	for (uint8_t i = 0; i < 4; i++) shared->localIP[i] = ip[i];
+	shared->linkUp = (Ethernet_SPI2.linkStatus() == LinkON_SPI2);
+}
+
+void EthernetOffloadService_SPI2::command(EthernetOffloadMsg_SPI2 &m, const char *host)
+{
+	uint8_t ch = m.chan;
+
+	if (m.type == OffloadResolve_SPI2) {
+		DNSClient_SPI2 dns;
+		IPAddress result;
+		dns.begin(Ethernet_SPI2.dnsServerList(), Ethernet_SPI2.dnsServerCount());
+		int ret = dns.getHostByName(host, result);
+		uint8_t ip[4] = { result[0], result[1], result[2], result[3] };
+		event(OffloadResolved_SPI2, OFFLOAD_NO_CHANNEL, ret, ip);
+		return;
+	}
+	if (m.type == OffloadPing_SPI2) {
+		EthernetOffloadMsg_SPI2 p;
+		memset(&p, 0, sizeof(p));
+		p.type = OffloadPong_SPI2;
+		p.chan = OFFLOAD_NO_CHANNEL;
+		p.port = host ? offloadChecksum(host, strlen(host)) : 0;
+		memcpy(p.ip, m.ip, 4);
+		shared->evt.write(&p, sizeof(p));
+		return;
+	}
+	if (ch >= ETHERNET_OFFLOAD_CHANNELS) return;
+	switch (m.type) {
+	case OffloadConnect_SPI2: {
+		int ret = host ? tcp[ch].connect(host, m.port) : tcp[ch].connect(IPAddress(m.ip), m.port);
+		_mode[ch] = ret == 1 ? ChanTCP : ChanFree;
+		_peerClosed[ch] = false;
+		event(OffloadConnected_SPI2, ch, ret);
+		break;
+	}
+	case OffloadUdpBegin_SPI2: {
+		int ret = udp[ch].begin(m.port);
+		_mode[ch] = ret == 1 ? ChanUDP : ChanFree;
+		_pending[ch] = 0;
+		event(OffloadOpened_SPI2, ch, ret);
+		break;
+	}
+	case OffloadClose_SPI2:
+		close(ch);
+		event(OffloadClosed_SPI2, ch, 1);
+		break;
+	}
+}
+
+// Send what the M7 queued before closing, then free the channel
+void EthernetOffloadService_SPI2::close(uint8_t ch)
+{
+	EthernetRing_SPI2<ETHERNET_OFFLOAD_RING_SIZE> &tx = shared->tx[ch];
+
+	if (_mode[ch] == ChanTCP) {
+		while (tx.available() && tcp[ch].connected()) serveTCP(ch);
+		tcp[ch].stop();
+	} else if (_mode[ch] == ChanUDP) {
+		while (tx.available()) serveUDP(ch);
+		udp[ch].stop();
+	}
+	tx.discard();
+	_mode[ch] = ChanFree;
+}
+
+void EthernetOffloadService_SPI2::serveTCP(uint8_t ch)
+{
+	EthernetClient_SPI2 &client = tcp[ch];
+	EthernetRing_SPI2<ETHERNET_OFFLOAD_RING_SIZE> &tx = shared->tx[ch];
+	EthernetRing_SPI2<ETHERNET_OFFLOAD_RING_SIZE> &rx = shared->rx[ch];
+
+	uint16_t n = tx.available();
+	if (n) {
+		int room = client.availableForWrite();
+		if (n > room) n = room;
+		if (n > sizeof(_buf)) n = sizeof(_buf);
+		if (n) {
+			tx.peek(_buf, n);
+			n = client.write(_buf, n);
+			tx.read(NULL, n);
+		}
+	}
+	n = rx.space();
+	if (n > sizeof(_buf)) n = sizeof(_buf);
+	if (n && client.available()) {
+		int got = client.read(_buf, n);
+		if (got > 0) rx.writeSome(_buf, got);
+	}
+	if (!_peerClosed[ch] && !client.connected()) {
+		// connected() stays true while there is data to read
+		_peerClosed[ch] = true;
+		event(OffloadPeerClosed_SPI2, ch, 0);
+	}
+}
+
+void EthernetOffloadService_SPI2::serveUDP(uint8_t ch)
+{
+	EthernetUDP_SPI2 &u = udp[ch];
+	EthernetRing_SPI2<ETHERNET_OFFLOAD_RING_SIZE> &tx = shared->tx[ch];
+	EthernetRing_SPI2<ETHERNET_OFFLOAD_RING_SIZE> &rx = shared->rx[ch];
+	EthernetOffloadDatagram_SPI2 d;
+
+	// datagrams are written whole, a header means the data is there too
+	if (tx.read(&d, sizeof(d)) == sizeof(d)) {
+		tx.read(_buf, d.len);
+		if (u.beginPacket(IPAddress(d.ip), d.port)) {
+			u.write(_buf, d.len);
+			u.endPacket();
+		}
+	}
+	if (!_pending[ch]) {
+		int size = u.parsePacket();
+		if (size <= 0) return;
+		if (size > ETHERNET_OFFLOAD_UDP_MAX) {
+			u.flush(); // too large to carry
+			return;
+		}
+		_pending[ch] = size;
+	}
+	// keep it in the chip until the M7 makes room
+	if (rx.space() < sizeof(d) + _pending[ch]) return;
+	IPAddress ip = u.remoteIP();
+	for (uint8_t i = 0; i < 4; i++) d.ip[i] = ip[i];
+	d.port = u.remotePort();
+	d.len = u.read(_buf, _pending[ch]);
+	rx.write(&d, sizeof(d), _buf, d.len);
+	_pending[ch] = 0;
+}
+
+void EthernetOffloadService_SPI2::poll()
+{
+	EthernetOffloadMsg_SPI2 m;
+	char host[ETHERNET_OFFLOAD_HOST_MAX + 1];
+
+	while (shared->cmd.read(&m, sizeof(m)) == sizeof(m)) {
+		uint16_t len = m.len > ETHERNET_OFFLOAD_HOST_MAX ? ETHERNET_OFFLOAD_HOST_MAX : m.len;
+		shared->cmd.read(host, len);
+		shared->cmd.read(NULL, m.len - len);
+		host[len] = 0;
+		command(m, m.len ? host : NULL);
+	}
+	for (uint8_t ch = 0; ch < ETHERNET_OFFLOAD_CHANNELS; ch++) {
+		if (_mode[ch] == ChanTCP) serveTCP(ch);
+		else if (_mode[ch] == ChanUDP) serveUDP(ch);
+	}
+	Ethernet_SPI2.maintain();
+	if (millis() - _infoMillis >= 100) {
+		_infoMillis = millis();
+		info();
+	}
+}
+
+#else // CORE_CM7
+
+/*****************************************/
+/*           Proxies (M7 core)           */
+/*****************************************/
+
+uint8_t EthernetOffloadClass_SPI2::_state[ETHERNET_OFFLOAD_CHANNELS];
+int16_t EthernetOffloadClass_SPI2::_result[ETHERNET_OFFLOAD_CHANNELS];
+bool EthernetOffloadClass_SPI2::_resolving = false;
+int16_t EthernetOffloadClass_SPI2::_resolveResult = 0;
+uint8_t EthernetOffloadClass_SPI2::_resolved[4];
+bool EthernetOffloadClass_SPI2::_pinging = false;
+uint16_t EthernetOffloadClass_SPI2::_pong = 0;
+uint8_t EthernetOffloadClass_SPI2::_pongIP[4];
+
+EthernetOffloadClass_SPI2 EthernetOffload_SPI2;
+
+bool EthernetOffloadClass_SPI2::begin(unsigned long timeout)
+{
+	if (!offloadBlockFree()) return false;
+	uint32_t start = millis();
+	while (true) {
+		offloadInvalidate(&shared->magic, 4);
+		if (shared->magic == OFFLOAD_MAGIC) break;
+		if (millis() - start > timeout) return false;
+		delay(1);
+	}
+	// drop whatever was cached before the M4 reset the rings
+	offloadInvalidate(shared, sizeof(*shared));
+
+	// Round trip through the rings with a pattern that changes on every
+	// call: stale cache lines on either side break the checksum or the
+	// echoed nonce
+	char pattern[ETHERNET_OFFLOAD_HOST_MAX + 1];
+	uint32_t nonce = micros();
+	for (uint8_t i = 0; i < ETHERNET_OFFLOAD_HOST_MAX; i++) {
+		pattern[i] = 'a' + (nonce + i * 7) % 26;
+	}
+	pattern[ETHERNET_OFFLOAD_HOST_MAX] = 0;
+	uint8_t ip[4] = { (uint8_t)nonce, (uint8_t)(nonce >> 8), (uint8_t)(nonce >> 16), (uint8_t)(nonce >> 24) };
+	if (!command(OffloadPing_SPI2, OFFLOAD_NO_CHANNEL, ip, 0, pattern)) return false;
+	_pinging = true;
+	while (_pinging) {
+		if (millis() - start > timeout) return false;
+		yield();
+		poll();
+	}
+	return _pong == offloadChecksum(pattern, ETHERNET_OFFLOAD_HOST_MAX) &&
+	  memcmp(_pongIP, ip, 4) == 0;
+}
+
+IPAddress EthernetOffloadClass_SPI2::localIP()
+{
+	offloadInvalidate(shared->localIP, 4);
+	return IPAddress(shared->localIP[0], shared->localIP[1], shared->localIP[2], shared->localIP[3]);
+}
+
+bool EthernetOffloadClass_SPI2::linkUp()
+{
+	offloadInvalidate(&shared->linkUp, 1);
+	return shared->linkUp;
+}
+
+bool EthernetOffloadClass_SPI2::command(uint8_t type, uint8_t chan, const uint8_t *ip, uint16_t port, const char *host)
+{
+	EthernetOffloadMsg_SPI2 m;
+	memset(&m, 0, sizeof(m));
+	m.type = type;
+	m.chan = chan;
+	m.port = port;
+	if (ip) memcpy(m.ip, ip, 4);
+	if (host) m.len = strlen(host);
+	return shared->cmd.write(&m, sizeof(m), host, m.len);
+}
+
+void EthernetOffloadClass_SPI2::poll()
+{
+	EthernetOffloadMsg_SPI2 m;
+
+	while (shared->evt.read(&m, sizeof(m)) == sizeof(m)) {
+		if (m.type == OffloadResolved_SPI2) {
+			_resolveResult = m.result;
+			memcpy(_resolved, m.ip, 4);
+			_resolving = false;
+			continue;
+		}
+		if (m.type == OffloadPong_SPI2) {
+			_pong = m.port;
+			memcpy(_pongIP, m.ip, 4);
+			_pinging = false;
+			continue;
+		}
+		uint8_t ch = m.chan;
+		if (ch >= ETHERNET_OFFLOAD_CHANNELS) continue;
+		switch (m.type) {
+		case OffloadConnected_SPI2:
+		case OffloadOpened_SPI2:
+			// an answer that came too late is followed by OffloadClosed_SPI2
+			if (_state[ch] != ChanOpening) break;
+			_result[ch] = m.result;
+			_state[ch] = m.result == 1 ? ChanOpen : ChanFree;
+			break;
+		case OffloadPeerClosed_SPI2:
+			if (_state[ch] == ChanOpen) _state[ch] = ChanPeerClosed;
+			break;
+		case OffloadClosed_SPI2:
+			// nothing more will come on this channel
+			shared->rx[ch].discard();
+			_state[ch] = ChanFree;
+			break;
+		}
+	}
+	// close commands that found the ring full
+	for (uint8_t ch = 0; ch < ETHERNET_OFFLOAD_CHANNELS; ch++) {
+		if (_state[ch] == ChanCloseUnsent && command(OffloadClose_SPI2, ch, NULL, 0, NULL)) {
+			_state[ch] = ChanClosing;
+		}
+	}
+}
+
+// Take a free channel and ask the M4 to open it.  Returns the channel,
+// or OFFLOAD_NO_CHANNEL
+uint8_t EthernetOffloadClass_SPI2::open(uint8_t type, const uint8_t *ip, uint16_t port, const char *host, unsigned long timeout)
+{
+	uint8_t ch;
+
+	poll();
+	for (ch = 0; ch < ETHERNET_OFFLOAD_CHANNELS; ch++) {
+		if (_state[ch] == ChanFree) break;
+	}
+	if (ch == ETHERNET_OFFLOAD_CHANNELS) return OFFLOAD_NO_CHANNEL;
+	if (!command(type, ch, ip, port, host)) return OFFLOAD_NO_CHANNEL;
+	_state[ch] = ChanOpening;
+	uint32_t start = millis();
+	while (_state[ch] == ChanOpening) {
+		if (millis() - start > timeout) {
+			close(ch, 0);
+			return OFFLOAD_NO_CHANNEL;
+		}
+		yield();
+		poll();
+	}
+	if (_state[ch] != ChanOpen) return OFFLOAD_NO_CHANNEL;
+	return ch;
+}
+
+// The channel stays in use until the M4 confirms, possibly after timeout
+// The channel stays taken until the M4 confirms.  If the M4 is stuck and
+// the command ring full, poll() queues the command later on
+void EthernetOffloadClass_SPI2::close(uint8_t ch, unsigned long timeout)
+{
+	uint32_t start = millis();
+	_state[ch] = ChanCloseUnsent;
+	poll();
+	while (_state[ch] != ChanFree && millis() - start < timeout) {
+		yield();
+		poll();
+	}
+}
+
+int EthernetOffloadClass_SPI2::hostByName(const char *host, IPAddress &result, unsigned long timeout)
+{
+	if (strlen(host) > ETHERNET_OFFLOAD_HOST_MAX) return -1;
+	poll();
+	if (_resolving) return -1; // the previous one timed out and is still running
+	if (!command(OffloadResolve_SPI2, OFFLOAD_NO_CHANNEL, NULL, 0, host)) return -1;
+	_resolving = true;
+	uint32_t start = millis();
+	while (_resolving) {
+		if (millis() - start > timeout) return -1;
+		yield();
+		poll();
+	}
+	if (_resolveResult == 1) result = _resolved;
+	return _resolveResult;
+}
+
+
+int EthernetOffloadClient_SPI2::connect(IPAddress ip, uint16_t port)
+{
+	if (_chan != OFFLOAD_NO_CHANNEL) stop();
+	uint8_t addr[4] = { ip[0], ip[1], ip[2], ip[3] };
+	_chan = EthernetOffload_SPI2.open(OffloadConnect_SPI2, addr, port, NULL, _timeout);
+	return _chan != OFFLOAD_NO_CHANNEL;
+}
+
+int EthernetOffloadClient_SPI2::connect(const char *host, uint16_t port)
+{
+	if (_chan != OFFLOAD_NO_CHANNEL) stop();
+	if (strlen(host) > ETHERNET_OFFLOAD_HOST_MAX) return 0;
+	_chan = EthernetOffload_SPI2.open(OffloadConnect_SPI2, NULL, port, host, _timeout);
+	return _chan != OFFLOAD_NO_CHANNEL;
+}
+
+size_t EthernetOffloadClient_SPI2::write(uint8_t b)
+{
+	return write(&b, 1);
+}
+
+size_t EthernetOffloadClient_SPI2::write(const uint8_t *buf, size_t size)
+{
+	if (_chan == OFFLOAD_NO_CHANNEL) return 0;
+	size_t done = 0;
+	while (done < size) {
+		EthernetOffload_SPI2.poll();
+		if (EthernetOffload_SPI2._state[_chan] != EthernetOffloadClass_SPI2::ChanOpen) break;
+		uint16_t chunk = size - done > 0xFFFF ? 0xFFFF : size - done;
+		uint16_t n = shared->tx[_chan].writeSome(buf + done, chunk);
+		done += n;
+		if (n == 0) yield(); // the M4 is sending
+	}
+	if (done < size) setWriteError();
+	return done;
+}
+
+int EthernetOffloadClient_SPI2::available()
+{
+	if (_chan == OFFLOAD_NO_CHANNEL) return 0;
+	return shared->rx[_chan].available();
+}
+
+int EthernetOffloadClient_SPI2::read()
+{
+	uint8_t b;
+	if (read(&b, 1) > 0) return b;
+	return -1;
+}
+
+int EthernetOffloadClient_SPI2::read(uint8_t *buf, size_t size)
+{
+	if (_chan == OFFLOAD_NO_CHANNEL) return -1;
+	uint16_t n = shared->rx[_chan].read(buf, size > 0xFFFF ? 0xFFFF : size);
+	if (n) return n;
+	EthernetOffload_SPI2.poll();
+	return connected() ? -1 : 0;
+}
+
+int EthernetOffloadClient_SPI2::peek()
+{
+	uint8_t b;
+	if (_chan == OFFLOAD_NO_CHANNEL) return -1;
+	if (shared->rx[_chan].peek(&b, 1) == 0) return -1;
+	return b;
+}
+
+void EthernetOffloadClient_SPI2::flush()
+{
+	while (_chan != OFFLOAD_NO_CHANNEL && connected() && shared->tx[_chan].space() < ETHERNET_OFFLOAD_RING_SIZE) {
+		yield();
+	}
+}
+
+void EthernetOffloadClient_SPI2::stop()
+{
+	if (_chan == OFFLOAD_NO_CHANNEL) return;
+	EthernetOffload_SPI2.close(_chan, _timeout);
+	_chan = OFFLOAD_NO_CHANNEL;
+}
+
+uint8_t EthernetOffloadClient_SPI2::connected()
+{
+	if (_chan == OFFLOAD_NO_CHANNEL) return 0;
+	EthernetOffload_SPI2.poll();
+	uint8_t st = EthernetOffload_SPI2._state[_chan];
+	if (st == EthernetOffloadClass_SPI2::ChanOpen) return 1;
+	return st == EthernetOffloadClass_SPI2::ChanPeerClosed && available();
+}
+
+
+uint8_t EthernetOffloadUDP_SPI2::begin(uint16_t port)
+{
+	if (_chan != OFFLOAD_NO_CHANNEL) stop();
+	_chan = EthernetOffload_SPI2.open(OffloadUdpBegin_SPI2, NULL, port, NULL, 1000);
+	_remaining = 0;
+	return _chan != OFFLOAD_NO_CHANNEL;
+}
+
+void EthernetOffloadUDP_SPI2::stop()
+{
+	if (_chan == OFFLOAD_NO_CHANNEL) return;
+	EthernetOffload_SPI2.close(_chan, 1000);
+	_chan = OFFLOAD_NO_CHANNEL;
+	_remaining = 0;
+}
+
+int EthernetOffloadUDP_SPI2::beginPacket(IPAddress ip, uint16_t port)
+{
+	_txIP = ip;
+	_txPort = port;
+	_txLen = 0;
+	return _chan != OFFLOAD_NO_CHANNEL;
+}
+
+int EthernetOffloadUDP_SPI2::beginPacket(const char *host, uint16_t port)
+{
+	IPAddress ip;
+	if (EthernetOffload_SPI2.hostByName(host, ip) != 1) return 0;
+	return beginPacket(ip, port);
+}
+
+size_t EthernetOffloadUDP_SPI2::write(uint8_t b)
+{
+	return write(&b, 1);
+}
+
+size_t EthernetOffloadUDP_SPI2::write(const uint8_t *buffer, size_t size)
+{
+	if (size > sizeof(_txBuf) - _txLen) size = sizeof(_txBuf) - _txLen;
+	memcpy(_txBuf + _txLen, buffer, size);
+	_txLen += size;
+	return size;
+}
+
+int EthernetOffloadUDP_SPI2::endPacket()
+{
+	EthernetOffloadDatagram_SPI2 d;
+
+	if (_chan == OFFLOAD_NO_CHANNEL) return 0;
+	for (uint8_t i = 0; i < 4; i++) d.ip[i] = _txIP[i];
+	d.port = _txPort;
+	d.len = _txLen;
+	uint32_t start = millis();
+	while (!shared->tx[_chan].write(&d, sizeof(d), _txBuf, _txLen)) {
+		if (millis() - start > 100) return 0;
+		yield();
+	}
+	_txLen = 0;
+	return 1;
+}
+
+int EthernetOffloadUDP_SPI2::parsePacket()
+{
+	EthernetOffloadDatagram_SPI2 d;
+
+	if (_chan == OFFLOAD_NO_CHANNEL) return 0;
+	flush(); // the rest of the previous one
+	if (shared->rx[_chan].read(&d, sizeof(d)) < sizeof(d)) return 0;
+	_remoteIP = d.ip;
+	_remotePort = d.port;
+	_remaining = d.len;
+	return d.len;
+}
+
+int EthernetOffloadUDP_SPI2::available()
+{
+	return _remaining;
+}
+
+int EthernetOffloadUDP_SPI2::read()
+{
+	uint8_t b;
+	if (read(&b, 1) > 0) return b;
+	return -1;
+}
+
+int EthernetOffloadUDP_SPI2::read(unsigned char *buffer, size_t len)
+{
+	if (_remaining == 0) return -1;
+	if (len > _remaining) len = _remaining;
+	uint16_t n = shared->rx[_chan].read(buffer, len);
+	_remaining -= n;
+	return n;
+}
+
+int EthernetOffloadUDP_SPI2::peek()
+{
+	uint8_t b;
+	if (_remaining == 0 || shared->rx[_chan].peek(&b, 1) == 0) return -1;
+	return b;
+}
+
+void EthernetOffloadUDP_SPI2::flush()
+{
+	if (_remaining == 0) return;
+	shared->rx[_chan].read(NULL, _remaining);
+	_remaining = 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,356 @@
+/*
+ *---------------------------------------------------------------------
+ * 2023 Dave Nardella
+ * This file il part of Ethernet_SP2, a library which allows the use of
+ * a WXXXX Wiznet chip/module on the second SPI port.
+ *---------------------------------------------------------------------
+*/
+// Network stack on the Cortex-M4 of the GIGA R1 (and Portenta H7).
+//
+// The M4 sketch brings Ethernet_SPI2 up as usual and calls
+// EthernetOffloadService_SPI2::poll() from loop(): socket polling, SPI
+// transfers, DHCP and DNS all happen there.  The M7 sketch doesn't touch
+// the chip; it uses EthernetOffloadClient_SPI2 and EthernetOffloadUDP_SPI2,
+// which have the API of EthernetClient_SPI2 and EthernetUDP_SPI2 and move
+// data and commands through single producer, single consumer rings in
+// SRAM shared by the two cores (see examples/OffloadM4).
+//
+// On the M7 the proxies and EthernetOffload_SPI2 must be used from one
+// thread only: every ring has exactly one writer and one reader.
+
+#ifndef ethernetoffload_spi2_h_
+#define ethernetoffload_spi2_h_
+
+#if !defined(ARDUINO_ARCH_MBED) || !(defined(CORE_CM7) || defined(CORE_CM4))
+#error "EthernetOffload_SPI2 needs a dual core Mbed OS board (GIGA R1, Portenta H7)"
+#endif
+
+#include <Arduino.h>
+#include <Client.h>
+#include <Udp.h>
+#include <mbed.h>
+
+// Shared block: SRAM3 of the D2 domain, 32 KB.  It must lie outside the
+// RAM the linker scripts give either core (data, bss, heap and stack):
+// both begin() refuse to start when it doesn't, in which case define
+// another address, or shrink the RAM region of the core that uses it
+#ifndef ETHERNET_OFFLOAD_ADDR
+#define ETHERNET_OFFLOAD_ADDR        0x30040000
+#endif
+#ifndef ETHERNET_OFFLOAD_CHANNELS
+#define ETHERNET_OFFLOAD_CHANNELS    4     // sockets usable from the M7
+#endif
+#ifndef ETHERNET_OFFLOAD_RING_SIZE
+#define ETHERNET_OFFLOAD_RING_SIZE   2048  // per channel and direction, power of 2
+#endif
+#define ETHERNET_OFFLOAD_CMD_SIZE    512
+#define ETHERNET_OFFLOAD_UDP_MAX     1024  // largest datagram carried
+#define ETHERNET_OFFLOAD_HOST_MAX    64    // longest host name
+
+// The M7 has a data cache, the M4 doesn't: what the M7 writes must be
+// cleaned to SRAM and what it reads invalidated first
+#if defined(CORE_CM7)
+static inline void offloadClean(const volatile void *p, uint32_t len)
+{
+	uintptr_t start = (uintptr_t)p & ~(uintptr_t)31;
+	SCB_CleanDCache_by_Addr((uint32_t *)start, (int32_t)((uintptr_t)p + len - start));
+}
+static inline void offloadInvalidate(const volatile void *p, uint32_t len)
+{
+	uintptr_t start = (uintptr_t)p & ~(uintptr_t)31;
+	SCB_InvalidateDCache_by_Addr((uint32_t *)start, (int32_t)((uintptr_t)p + len - start));
+}
+#else
+static inline void offloadClean(const volatile void *, uint32_t) { }
+static inline void offloadInvalidate(const volatile void *, uint32_t) { }
+#endif
+
+// Lock-free ring with one producer and one consumer, possibly on different
+// cores.  head is written by the producer only, tail by the consumer only,
+// each on its own cache line.  The indexes run freely, SIZE bytes apart
+// at most.
+template<uint16_t SIZE>
+class EthernetRing_SPI2 {
+public:
+	void reset() { head = 0; tail = 0; }
+
+	// Producer side
+	uint16_t space() {
+		offloadInvalidate(&tail, 4);
+		return SIZE - (head - tail);
+	}
+	// Write a and b back to back, all or nothing
+	bool write(const void *a, uint16_t alen, const void *b = NULL, uint16_t blen = 0) {
+		if (space() < (uint32_t)alen + blen) return false;
+		uint32_t h = head;
+		copyIn(h, (const uint8_t *)a, alen);
+		if (b) copyIn(h + alen, (const uint8_t *)b, blen);
+		publish(h + alen + blen);
+		return true;
+	}
+	// Write as much of buf as fits
+	uint16_t writeSome(const uint8_t *buf, uint16_t len) {
+		uint16_t n = space();
+		if (n > len) n = len;
+		if (n == 0) return 0;
+		copyIn(head, buf, n);
+		publish(head + n);
+		return n;
+	}
+
+	// Consumer side
+	uint16_t available() {
+		offloadInvalidate(&head, 4);
+		return head - tail;
+	}
+	// Copy up to len bytes without consuming them
+	uint16_t peek(void *dst, uint16_t len) {
+		uint16_t n = available();
+		if (n > len) n = len;
+		__DMB();
+		copyOut(tail, (uint8_t *)dst, n);
+		return n;
+	}
+	// Consume up to len bytes, copied to dst unless it is NULL
+	uint16_t read(void *dst, uint16_t len) {
+		uint16_t n = available();
+		if (n > len) n = len;
+		__DMB();
+		if (dst) copyOut(tail, (uint8_t *)dst, n);
+		__DMB();
+		tail = tail + n;
+		offloadClean(&tail, 4);
+		return n;
+	}
+	void discard() { read(NULL, available()); }
+
+private:
+	volatile uint32_t head;
+	uint32_t pad0[7];
+	volatile uint32_t tail;
+	uint32_t pad1[7];
+	uint8_t data[SIZE];
+
+	void publish(uint32_t h) {
+		__DMB(); // the data before the index
+		head = h;
+		offloadClean(&head, 4);
+	}
+	void copyIn(uint32_t pos, const uint8_t *src, uint16_t len) {
+		uint16_t offset = pos & (SIZE - 1);
+		uint16_t first = (offset + len <= SIZE) ? len : SIZE - offset;
+		memcpy(data + offset, src, first);
+		offloadClean(data + offset, first);
+		if (first < len) {
+			memcpy(data, src + first, len - first);
+			offloadClean(data, len - first);
+		}
+	}
+	void copyOut(uint32_t pos, uint8_t *dst, uint16_t len) {
+		uint16_t offset = pos & (SIZE - 1);
+		uint16_t first = (offset + len <= SIZE) ? len : SIZE - offset;
+		offloadInvalidate(data + offset, first);
+		memcpy(dst, data + offset, first);
+		if (first < len) {
+			offloadInvalidate(data, len - first);
+			memcpy(dst + first, data, len - first);
+		}
+	}
+	static_assert((SIZE & (SIZE - 1)) == 0, "ring size must be a power of 2");
+};
+
+// Commands (M7 to M4) and events (M4 to M7).  A host name, if any,
+// follows the message in the ring
+enum EthernetOffloadMsgType_SPI2 {
+	OffloadConnect_SPI2 = 1, // ip or host, port; answered by OffloadConnected_SPI2
+	OffloadUdpBegin_SPI2,    // port; answered by OffloadOpened_SPI2
+	OffloadClose_SPI2,       // after the data already queued; answered by OffloadClosed_SPI2
+	OffloadResolve_SPI2,     // host; answered by OffloadResolved_SPI2
+	OffloadConnected_SPI2,   // result as EthernetClient_SPI2::connect()
+	OffloadOpened_SPI2,      // result as EthernetUDP_SPI2::begin()
+	OffloadPeerClosed_SPI2,  // the peer closed and all its data is in the rx ring
+	OffloadClosed_SPI2,      // the channel is free, nothing more comes on it
+	OffloadResolved_SPI2,    // ip, result as DNSClient_SPI2::getHostByName()
+	OffloadPing_SPI2,        // ip, pattern as host; answered by OffloadPong_SPI2
+	OffloadPong_SPI2         // ip echoed, checksum of the pattern in port
+};
+
+#define OFFLOAD_NO_CHANNEL 0xFF
+
+struct EthernetOffloadMsg_SPI2 {
+	uint8_t  type;
+	uint8_t  chan;
+	uint16_t port;
+	uint8_t  ip[4];
+	uint16_t len;    // bytes of host name following
+	int16_t  result;
+};
+
+// Checksum of the ping pattern, computed by both cores
+static inline uint16_t offloadChecksum(const char *p, uint16_t len)
+{
+	uint8_t a = 0, b = 0;
+	while (len--) {
+		a += (uint8_t)*p++;
+		b += a;
+	}
+	return ((uint16_t)b << 8) | a;
+}
+
+// Header of each datagram in the rings of a UDP channel
+struct EthernetOffloadDatagram_SPI2 {
+	uint8_t  ip[4];
+	uint16_t port;
+	uint16_t len;
+};
+
+#define OFFLOAD_MAGIC 0x45324D34UL
+
+struct EthernetOffloadShared_SPI2 {
+	volatile uint32_t magic; // set by the M4 once the rings are ready
+	uint32_t pad0[7];
+	// Written by the M4
+	volatile uint8_t localIP[4];
+	volatile uint8_t linkUp;
+	uint8_t pad1[27];
+	EthernetRing_SPI2<ETHERNET_OFFLOAD_CMD_SIZE> cmd; // M7 to M4
+	EthernetRing_SPI2<ETHERNET_OFFLOAD_CMD_SIZE> evt; // M4 to M7
+	EthernetRing_SPI2<ETHERNET_OFFLOAD_RING_SIZE> tx[ETHERNET_OFFLOAD_CHANNELS]; // M7 to M4
+	EthernetRing_SPI2<ETHERNET_OFFLOAD_RING_SIZE> rx[ETHERNET_OFFLOAD_CHANNELS]; // M4 to M7
+};
+
+#if defined(CORE_CM4)
+
+class EthernetClient_SPI2;
+class EthernetUDP_SPI2;
+
+// Runs on the M4, after Ethernet_SPI2.begin()
+class EthernetOffloadService_SPI2 {
+public:
+	EthernetOffloadService_SPI2();
+	// Reset the rings and tell the M7 the service is up.  Returns false,
+	// and the M7 never sees the service, if the shared block overlaps the
+	// RAM of the M4
+	bool begin();
+	// Serve the commands and move the data of every channel; also runs
+	// Ethernet_SPI2.maintain().  Call from loop() as often as possible.
+	// Connecting and resolving block this loop until they complete
+	void poll();
+
+private:
+	enum { ChanFree, ChanTCP, ChanUDP };
+	uint8_t _mode[ETHERNET_OFFLOAD_CHANNELS];
+	bool _peerClosed[ETHERNET_OFFLOAD_CHANNELS];
+	uint16_t _pending[ETHERNET_OFFLOAD_CHANNELS]; // datagram waiting for room
+	uint32_t _infoMillis;
+	uint8_t _buf[ETHERNET_OFFLOAD_UDP_MAX];
+
+	void command(EthernetOffloadMsg_SPI2 &m, const char *host);
+	void event(uint8_t type, uint8_t chan, int16_t result, const uint8_t *ip = NULL);
+	void serveTCP(uint8_t ch);
+	void serveUDP(uint8_t ch);
+	void close(uint8_t ch);
+	void info();
+};
+
+#else // CORE_CM7
+
+class EthernetOffloadClass_SPI2 {
+public:
+	// Wait for the service on the M4 and check a round trip through the
+	// rings.  Returns false on timeout, if the shared block overlaps the
+	// RAM of the M7, or if the round trip comes back wrong
+	static bool begin(unsigned long timeout = 10000);
+	static IPAddress localIP();
+	static bool linkUp();
+	// DNS lookup on the M4.  Returns 1 on success, as DNSClient_SPI2
+	static int hostByName(const char *host, IPAddress &result, unsigned long timeout = 5000);
+	// Collect the events from the M4; the proxies call it when needed
+	static void poll();
+
+	friend class EthernetOffloadClient_SPI2;
+	friend class EthernetOffloadUDP_SPI2;
+private:
+	enum { ChanFree, ChanOpening, ChanOpen, ChanPeerClosed, ChanClosing, ChanCloseUnsent };
+	static uint8_t _state[ETHERNET_OFFLOAD_CHANNELS];
+	static int16_t _result[ETHERNET_OFFLOAD_CHANNELS];
+	static bool _resolving;
+	static int16_t _resolveResult;
+	static uint8_t _resolved[4];
+	static bool _pinging;
+	static uint16_t _pong;
+	static uint8_t _pongIP[4];
+
+	static uint8_t open(uint8_t type, const uint8_t *ip, uint16_t port, const char *host, unsigned long timeout);
+	static void close(uint8_t chan, unsigned long timeout);
+	static bool command(uint8_t type, uint8_t chan, const uint8_t *ip, uint16_t port, const char *host);
+};
+
+extern EthernetOffloadClass_SPI2 EthernetOffload_SPI2;
+
+class EthernetOffloadClient_SPI2 : public Client {
+public:
+	EthernetOffloadClient_SPI2() : _chan(OFFLOAD_NO_CHANNEL), _timeout(5000) { }
+
+	virtual int connect(IPAddress ip, uint16_t port);
+	virtual int connect(const char *host, uint16_t port);
+	virtual size_t write(uint8_t);
+	virtual size_t write(const uint8_t *buf, size_t size);
+	virtual int available();
+	virtual int read();
+	virtual int read(uint8_t *buf, size_t size);
+	virtual int peek();
+	virtual void flush();
+	virtual void stop();
+	virtual uint8_t connected();
+	virtual operator bool() { return _chan != OFFLOAD_NO_CHANNEL; }
+	// Includes the time the M4 takes to resolve and connect
+	void setConnectionTimeout(uint16_t timeout) { _timeout = timeout; }
+
+	using Print::write;
+
+private:
+	uint8_t _chan;
+	uint16_t _timeout;
+};
+
+class EthernetOffloadUDP_SPI2 : public UDP {
+public:
+	EthernetOffloadUDP_SPI2() : _chan(OFFLOAD_NO_CHANNEL), _remotePort(0), _remaining(0),
+	  _txPort(0), _txLen(0) { }
+
+	virtual uint8_t begin(uint16_t port);
+	virtual void stop();
+	virtual int beginPacket(IPAddress ip, uint16_t port);
+	virtual int beginPacket(const char *host, uint16_t port);
+	// Queue the datagram for the M4; waits up to 100 ms for room
+	virtual int endPacket();
+	virtual size_t write(uint8_t);
+	virtual size_t write(const uint8_t *buffer, size_t size);
+
+	using Print::write;
+
+	virtual int parsePacket();
+	virtual int available();
+	virtual int read();
+	virtual int read(unsigned char *buffer, size_t len);
+	virtual int read(char *buffer, size_t len) { return read((unsigned char *)buffer, len); }
+	virtual int peek();
+	virtual void flush();
+	virtual IPAddress remoteIP() { return _remoteIP; }
+	virtual uint16_t remotePort() { return _remotePort; }
+
+private:
+	uint8_t _chan;
+	IPAddress _remoteIP;
+	uint16_t _remotePort;
+	uint16_t _remaining; // bytes left in the datagram being read
+	IPAddress _txIP;
+	uint16_t _txPort;
+	uint16_t _txLen;
+	uint8_t _txBuf[ETHERNET_OFFLOAD_UDP_MAX];
+};
+
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ *---------------------------------------------------------------------
+ * 2023 Dave Nardella
+ * This file il part of Ethernet_SP2, a library which allows the use of
+ * a WXXXX Wiznet chip/module on the second SPI port.
+ *---------------------------------------------------------------------
+ *
+ * Raw Ethernet frames through socket 0 in MACRAW mode
+ */
+
+#include <Arduino.h>
+#include "Ethernet_SPI2.h"
+#include "utility/w5100_SPI2.h"
+
+bool EthernetRaw_SPI2::begin(bool macFilter)
+{
+	stop();
+	if (!Ethernet_SPI2.socketBeginMacraw(macFilter)) return false;
+	sockindex = 0;
+	return true;
+}
+
+void EthernetRaw_SPI2::stop()
+{
+	if (sockindex < MAX_SOCK_NUM) {
+		Ethernet_SPI2.socketClose(sockindex);
+		sockindex = MAX_SOCK_NUM;
+	}
+}
+
+int EthernetRaw_SPI2::available()
+{
+	if (sockindex >= MAX_SOCK_NUM) return 0;
+	return Ethernet_SPI2.socketRecvAvailable(sockindex);
+}
+
+int EthernetRaw_SPI2::readFrame(uint8_t *buf, uint16_t size)
+{
+	uint16_t len;
+	if (sockindex >= MAX_SOCK_NUM) return 0;
+	if (Ethernet_SPI2.socketRecvFrames(sockindex, buf, size, &len, 1) == 0) return 0;
+	return len;
+}
+
+int EthernetRaw_SPI2::readFrames(uint8_t *buf, uint16_t size, uint16_t *lens, uint8_t maxFrames)
+{
+	if (sockindex >= MAX_SOCK_NUM) return 0;
+	return Ethernet_SPI2.socketRecvFrames(sockindex, buf, size, lens, maxFrames);
+}
+
+bool EthernetRaw_SPI2::sendFrame(const uint8_t *frame, uint16_t len, bool wait)
+{
+	if (sockindex >= MAX_SOCK_NUM) return false;
+	return Ethernet_SPI2.socketSendFrame(sockindex, frame, len, wait);
+}
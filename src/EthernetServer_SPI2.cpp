@@ -36,7 +36,7 @@ uint16_t EthernetServer_SPI2::server_port[MAX_SOCK_NUM];
 
 void EthernetServer_SPI2::begin()
 {
-	uint8_t sockindex = Ethernet_SPI2.socketBegin(SnMR::TCP, _port);
+	uint8_t sockindex = Ethernet_SPI2.socketBegin(SnMR::TCP, _port, 0, &_opts);
 	if (sockindex < MAX_SOCK_NUM) {
 		if (Ethernet_SPI2.socketListen(sockindex)) {
 			server_port[sockindex] = _port;
@@ -58,6 +58,7 @@ EthernetClient_SPI2 EthernetServer_SPI2::available()
 	if (chip == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
 #endif
 	for (uint8_t i=0; i < maxindex; i++) {
+		Ethernet_SPI2.socketLock(i);
 		if (server_port[i] == _port) {
 			uint8_t stat = Ethernet_SPI2.socketStatus(i);
 			if (stat == SnSR::ESTABLISHED || stat == SnSR::CLOSE_WAIT) {
@@ -76,6 +77,7 @@ EthernetClient_SPI2 EthernetServer_SPI2::available()
 				server_port[i] = 0;
 			}
 		}
+		Ethernet_SPI2.socketUnlock(i);
 	}
 	if (!listening) begin();
 	return EthernetClient_SPI2(sockindex);
@@ -93,6 +95,8 @@ EthernetClient_SPI2 EthernetServer_SPI2::accept()
 	if (chip == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
 #endif
 	for (uint8_t i=0; i < maxindex; i++) {
+		// another thread may be accepting on the same port
+		Ethernet_SPI2.socketLock(i);
 		if (server_port[i] == _port) {
 			uint8_t stat = Ethernet_SPI2.socketStatus(i);
 			if (sockindex == MAX_SOCK_NUM &&
@@ -108,6 +112,7 @@ EthernetClient_SPI2 EthernetServer_SPI2::accept()
 				server_port[i] = 0;
 			}
 		}
+		Ethernet_SPI2.socketUnlock(i);
 	}
 	if (!listening) begin();
 	return EthernetClient_SPI2(sockindex);
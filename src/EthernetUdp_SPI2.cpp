@@ -43,7 +43,7 @@
 uint8_t EthernetUDP_SPI2::begin(uint16_t port)
 {
 	if (sockindex < MAX_SOCK_NUM) Ethernet_SPI2.socketClose(sockindex);
-	sockindex = Ethernet_SPI2.socketBegin(SnMR::UDP, port);
+	sockindex = Ethernet_SPI2.socketBegin(SnMR::UDP, port, 0, &_opts);
 	if (sockindex >= MAX_SOCK_NUM) return 0;
 	_port = port;
 	_remaining = 0;
@@ -73,7 +73,7 @@ int EthernetUDP_SPI2::beginPacket(const char *host, uint16_t port)
 	DNSClient_SPI2 dns;
 	IPAddress remote_addr;
 
-	dns.begin(Ethernet_SPI2.dnsServerIP());
+	dns.begin(Ethernet_SPI2.dnsServerList(), Ethernet_SPI2.dnsServerCount());
 	ret = dns.getHostByName(host, remote_addr);
 	if (ret != 1) return ret;
 	return beginPacket(remote_addr, port);
@@ -83,12 +83,30 @@ int EthernetUDP_SPI2::beginPacket(IPAddress ip, uint16_t port)
 {
 	_offset = 0;
 	//Serial.printf("UDP beginPacket\n");
-	return Ethernet_SPI2.socketStartUDP(sockindex, rawIPAddress(ip), port);
+	// The destination is only written to the chip by endPacket(), so a new
+	// packet can be built while the previous one is still being sent
+	if (ip == IPAddress((uint32_t)0) || port == 0) return 0;
+	_destIP = ip;
+	_destPort = port;
+	return 1;
 }
 
 int EthernetUDP_SPI2::endPacket()
 {
-	return Ethernet_SPI2.socketSendUDP(sockindex);
+	if (sockindex >= MAX_SOCK_NUM) return 0;
+	int ret = Ethernet_SPI2.socketSendUDP(sockindex, rawIPAddress(_destIP), _destPort, !_asyncSend);
+	if (_asyncSend) sendStatus(); // report the previous packet, if done
+	return ret;
+}
+
+int EthernetUDP_SPI2::sendStatus()
+{
+	if (sockindex >= MAX_SOCK_NUM) return SendIdle_SPI2;
+	int ret = Ethernet_SPI2.socketSendUDPStatus(sockindex);
+	if (_sendCallback && (ret == SendOK_SPI2 || ret == SendTimeout_SPI2)) {
+		_sendCallback(*this, ret == SendOK_SPI2);
+	}
+	return ret;
 }
 
 size_t EthernetUDP_SPI2::write(uint8_t byte)
@@ -104,6 +122,15 @@ size_t EthernetUDP_SPI2::write(const uint8_t *buffer, size_t size)
 	return bytes_written;
 }
 
+int EthernetUDP_SPI2::sendTo(IPAddress ip, uint16_t port, const uint8_t *buffer, uint16_t size, bool wait)
+{
+	if (sockindex >= MAX_SOCK_NUM) return 0;
+	if (ip == IPAddress((uint32_t)0) || port == 0) return 0;
+	int ret = Ethernet_SPI2.socketSendUDPTo(sockindex, rawIPAddress(ip), port, buffer, size, wait);
+	if (!wait) sendStatus(); // report the previous datagram, if done
+	return ret;
+}
+
 int EthernetUDP_SPI2::parsePacket()
 {
 	// discard any remaining bytes in the last packet
@@ -136,6 +163,36 @@ int EthernetUDP_SPI2::parsePacket()
 	return 0;
 }
 
+int EthernetUDP_SPI2::parsePackets(EthernetUDPPacket_SPI2 *packets, uint8_t maxPackets, uint8_t *arena, uint16_t arenaSize)
+{
+	if (sockindex >= MAX_SOCK_NUM) return 0;
+
+	// discard any remaining bytes in the last packet
+	while (_remaining) {
+		read((uint8_t *)NULL, _remaining);
+	}
+
+	// Grab everything that fits, headers included, in one go and then
+	// walk the W5x00 UDP headers (IP, port, length) in RAM
+	uint16_t got = Ethernet_SPI2.socketRecvPeek(sockindex, arena, arenaSize);
+	uint16_t used = 0;
+	uint8_t count = 0;
+	while (count < maxPackets && used + 8 <= got) {
+		uint8_t *hdr = arena + used;
+		uint16_t len = (hdr[6] << 8) | hdr[7];
+		if (used + 8 + len > got) break; // partial datagram, leave it for next time
+		packets[count].remoteIP = hdr;
+		packets[count].remotePort = (hdr[4] << 8) | hdr[5];
+		packets[count].length = len;
+		packets[count].data = hdr + 8;
+		used += 8 + len;
+		count++;
+	}
+	// Consume only the whole datagrams we handed out
+	if (used > 0) Ethernet_SPI2.socketRecv(sockindex, NULL, used);
+	return count;
+}
+
 int EthernetUDP_SPI2::read()
 {
 	uint8_t byte;
@@ -181,16 +238,31 @@ int EthernetUDP_SPI2::peek()
 	return Ethernet_SPI2.socketPeek(sockindex);
 }
 
+int EthernetUDP_SPI2::peek(uint8_t *buffer, size_t len, size_t offset)
+{
+	if (sockindex >= MAX_SOCK_NUM || offset >= _remaining) return 0;
+	if (len > _remaining - offset) len = _remaining - offset;
+	return Ethernet_SPI2.socketRecvPeek(sockindex, buffer, len, offset);
+}
+
 void EthernetUDP_SPI2::flush()
 {
 	// TODO: we should wait for TX buffer to be emptied
 }
 
+bool EthernetUDP_SPI2::setOption(EthernetSPI2SocketOption option, uint16_t value)
+{
+	if (option == SockOptNoDelayedAck_SPI2 || option == SockOptKeepAlive_SPI2) return false;
+	if (!_opts.set(option, value)) return false;
+	if (sockindex < MAX_SOCK_NUM) Ethernet_SPI2.socketSetOptions(sockindex, _opts);
+	return true;
+}
+
 /* Start EthernetUDP_SPI2 socket, listening at local port PORT */
 uint8_t EthernetUDP_SPI2::beginMulticast(IPAddress ip, uint16_t port)
 {
 	if (sockindex < MAX_SOCK_NUM) Ethernet_SPI2.socketClose(sockindex);
-	sockindex = Ethernet_SPI2.socketBeginMulticast(SnMR::UDP | SnMR::MULTI, ip, port);
+	sockindex = Ethernet_SPI2.socketBeginMulticast(SnMR::UDP | SnMR::MULTI, ip, port, &_opts);
 	if (sockindex >= MAX_SOCK_NUM) return 0;
 	_port = port;
 	_remaining = 0;
@@ -32,44 +32,65 @@
 #include "utility/w5100_SPI2.h"
 #include "Dhcp_SPI2.h"
 
-IPAddress EthernetClass_SPI2::_dnsServerAddress;
+IPAddress EthernetClass_SPI2::_dnsServerAddress[MAX_DNS_SERVERS];
+uint8_t EthernetClass_SPI2::_dnsServerCount = 0;
 DhcpClass_SPI2* EthernetClass_SPI2::_dhcp = NULL;
+void (*EthernetClass_SPI2::_addressCallback)(IPAddress oldIP, IPAddress newIP) = NULL;
+bool EthernetClass_SPI2::_verifyConfig = false;
+uint16_t EthernetClass_SPI2::_chipResets = 0;
+EthernetSPI2LinkStatus EthernetClass_SPI2::_linkStatus = Unknown_SPI2;
+EthernetSPI2LinkStatus EthernetClass_SPI2::_linkReported = Unknown_SPI2;
+uint32_t EthernetClass_SPI2::_linkCheckMillis = 0;
+uint16_t EthernetClass_SPI2::_linkInterval = 250;
+uint8_t EthernetClass_SPI2::_linkPolicy = 0;
+void (*EthernetClass_SPI2::_linkCallback)(bool up) = NULL;
+void (*EthernetClass_SPI2::_halfDuplexCallback)(uint8_t speed) = NULL;
+static DhcpClass_SPI2 s_dhcp;
 
 int EthernetClass_SPI2::begin(uint8_t *mac, unsigned long timeout, unsigned long responseTimeout)
 {
-	static DhcpClass_SPI2 s_dhcp;
 	_dhcp = &s_dhcp;
 
 	// Initialise the basic info
 	if (W5100_SPI2.init() == 0) return 0;
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	W5100_SPI2.setMACAddress(mac);
 //	W5100_SPI2.setIPAddress(IPAddress(0,0,0,0).raw_address());
 	W5100_SPI2.setIPAddress(raw_address(IPAddress(0,0,0,0)));
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 
 	// Now try to get our config info from a DHCP server
 	int ret = _dhcp->beginWithDHCP(mac, timeout, responseTimeout);
 	if (ret == 1) {
 		// We've successfully found a DHCP server and got our configuration
 		// info, so set things accordingly
-		SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-/*
-		W5100_SPI2.setIPAddress(_dhcp->getLocalIp().raw_address());
-		W5100_SPI2.setGatewayIp(_dhcp->getGatewayIp().raw_address());
-		W5100_SPI2.setSubnetMask(_dhcp->getSubnetMask().raw_address());
-*/
-		W5100_SPI2.setIPAddress(raw_address(_dhcp->getLocalIp()));
-		W5100_SPI2.setGatewayIp(raw_address(_dhcp->getGatewayIp()));
-		W5100_SPI2.setSubnetMask(raw_address(_dhcp->getSubnetMask()));
-
-		SPI1.endTransaction();
-		_dnsServerAddress = _dhcp->getDnsServerIp();
+		setConfigFromDhcp();
 		socketPortRand(micros());
 	}
 	return ret;
 }
 
+int EthernetClass_SPI2::beginAsync(uint8_t *mac, IPAddress previousIP, unsigned long timeout, unsigned long responseTimeout)
+{
+	_dhcp = &s_dhcp;
+	_dhcp->end();
+
+	// Initialise the basic info
+	if (W5100_SPI2.init() == 0) return 0;
+	W5100_SPI2.beginTransaction();
+	W5100_SPI2.setMACAddress(mac);
+	W5100_SPI2.setIPAddress(raw_address(IPAddress(0,0,0,0)));
+	W5100_SPI2.endTransaction();
+
+	// The rest happens in maintain()
+	return _dhcp->beginAsync(mac, previousIP, timeout, responseTimeout);
+}
+
+void EthernetClass_SPI2::setDhcpRapidCommit(bool enable)
+{
+	s_dhcp.setRapidCommit(enable);
+}
+
 void EthernetClass_SPI2::begin(uint8_t *mac, IPAddress ip)
 {
 	// Assume the DNS server will be the machine on the same network as the local IP
@@ -96,8 +117,13 @@ void EthernetClass_SPI2::begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddr
 
 void EthernetClass_SPI2::begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet)
 {
+	// A static configuration replaces DHCP, e.g. as fallback
+	if (_dhcp != NULL) {
+		_dhcp->end();
+		_dhcp = NULL;
+	}
 	if (W5100_SPI2.init() == 0) return;
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	W5100_SPI2.setMACAddress(mac);
 /*
 	W5100_SPI2.setIPAddress(ip.raw_address());
@@ -107,8 +133,35 @@ void EthernetClass_SPI2::begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddr
 	W5100_SPI2.setIPAddress(raw_address(ip));
 	W5100_SPI2.setGatewayIp(raw_address(gateway));
 	W5100_SPI2.setSubnetMask(raw_address(subnet));
-	SPI1.endTransaction();
-	_dnsServerAddress = dns;
+	W5100_SPI2.endTransaction();
+	_dnsServerAddress[0] = dns;
+	_dnsServerCount = 1;
+}
+
+void EthernetClass_SPI2::setConfigFromDhcp()
+{
+	IPAddress oldIP = localIP();
+	IPAddress newIP = _dhcp->getLocalIp();
+	W5100_SPI2.beginTransaction();
+	W5100_SPI2.setIPAddress(raw_address(newIP));
+	W5100_SPI2.setGatewayIp(raw_address(_dhcp->getGatewayIp()));
+	W5100_SPI2.setSubnetMask(raw_address(_dhcp->getSubnetMask()));
+	W5100_SPI2.endTransaction();
+	setDnsFromDhcp();
+	if (_addressCallback != NULL && oldIP != newIP) {
+		_addressCallback(oldIP, newIP);
+	}
+}
+
+// Take the whole DNS server list of the lease
+// The lease replaces the whole list: one without DNS servers leaves none,
+// and dnsServerIP() returns 0.0.0.0 as it did before multiple servers
+void EthernetClass_SPI2::setDnsFromDhcp()
+{
+	_dnsServerCount = _dhcp->getDnsServerCount();
+	for (uint8_t i = 0; i < MAX_DNS_SERVERS; i++) {
+		_dnsServerAddress[i] = i < _dnsServerCount ? _dhcp->getDnsServerIp(i) : IPAddress((uint32_t)0);
+	}
 }
 
 void EthernetClass_SPI2::init(uint8_t sspin)
@@ -118,11 +171,86 @@ void EthernetClass_SPI2::init(uint8_t sspin)
 
 EthernetSPI2LinkStatus EthernetClass_SPI2::linkStatus()
 {
-	switch (W5100_SPI2.getLinkStatus()) {
-		case UNKNOWN:  return Unknown_SPI2;
-		case LINK_ON:  return LinkON_SPI2;
-		case LINK_OFF: return LinkOFF_SPI2;
-		default:       return Unknown_SPI2;
+	uint32_t now = millis();
+	if (_linkCheckMillis == 0 || now - _linkCheckMillis >= _linkInterval) {
+		switch (W5100_SPI2.getLinkStatus()) {
+			case LINK_ON:  _linkStatus = LinkON_SPI2; break;
+			case LINK_OFF: _linkStatus = LinkOFF_SPI2; break;
+			default:       _linkStatus = Unknown_SPI2; break;
+		}
+		_linkCheckMillis = now | 1;
+	}
+	return _linkStatus;
+}
+
+// Link monitor, run from maintain().  The chips have no link change
+// interrupt, so this polls (rate limited by linkStatus()).
+void EthernetClass_SPI2::checkLink()
+{
+	EthernetSPI2LinkStatus link = linkStatus();
+	if (link == _linkReported || link == Unknown_SPI2) return;
+	EthernetSPI2LinkStatus previous = _linkReported;
+	_linkReported = link;
+
+	if (link == LinkOFF_SPI2 && (_linkPolicy & LinkCloseTCP_SPI2)) {
+		// the peers can't be told, don't wait for the retransmissions to give up
+		uint8_t maxindex = (W5100_SPI2.getChip() == 51) ? 4 : MAX_SOCK_NUM;
+		for (uint8_t s = 0; s < maxindex && s < MAX_SOCK_NUM; s++) {
+			socketLock(s);
+			uint8_t status = socketStatus(s);
+			if (status == SnSR::SYNSENT || status == SnSR::SYNRECV ||
+			  status == SnSR::ESTABLISHED || status == SnSR::CLOSE_WAIT) {
+				socketClose(s);
+			}
+			socketUnlock(s);
+		}
+	}
+	if (link == LinkON_SPI2 && previous == LinkOFF_SPI2 &&
+	  (_linkPolicy & LinkRenewDhcp_SPI2) && _dhcp != NULL) {
+		// we may have been moved to another network
+		_dhcp->renewNow();
+	}
+	if (_linkCallback != NULL) {
+		_linkCallback(link == LinkON_SPI2);
+	}
+	if (link == LinkON_SPI2 && _halfDuplexCallback != NULL) {
+		// a duplex mismatch costs most of the throughput without any error
+		uint8_t speed = linkSpeed();
+		if (speed && !linkFullDuplex()) _halfDuplexCallback(speed);
+	}
+}
+
+uint8_t EthernetClass_SPI2::linkSpeed()
+{
+	uint8_t phycfg = W5100_SPI2.getPhyConfig();
+	if (!(phycfg & 0x01)) return 0;
+	return (phycfg & 0x02) ? 100 : 10;
+}
+
+bool EthernetClass_SPI2::linkFullDuplex()
+{
+	uint8_t phycfg = W5100_SPI2.getPhyConfig();
+	return (phycfg & 0x05) == 0x05;
+}
+
+bool EthernetClass_SPI2::setPhyMode(EthernetSPI2PhyMode mode)
+{
+	if (!W5100_SPI2.setPhyMode(mode)) return false;
+	_linkCheckMillis = 0; // the link went down with the reset
+	return true;
+}
+
+EthernetSPI2PhyMode EthernetClass_SPI2::phyMode()
+{
+	uint8_t phycfg = W5100_SPI2.getPhyConfig();
+	// OPMD clear means the mode comes from the PMODE pins
+	if (!(phycfg & 0x40)) return PhyAuto_SPI2;
+	switch ((phycfg >> 3) & 0x07) {
+		case Phy10Half_SPI2:  return Phy10Half_SPI2;
+		case Phy10Full_SPI2:  return Phy10Full_SPI2;
+		case Phy100Half_SPI2: return Phy100Half_SPI2;
+		case Phy100Full_SPI2: return Phy100Full_SPI2;
+		default:              return PhyAuto_SPI2;
 	}
 }
 
@@ -139,7 +267,23 @@ EthernetSPI2HardwareStatus EthernetClass_SPI2::hardwareStatus()
 int EthernetClass_SPI2::maintain()
 {
 	int rc = DHCP_CHECK_NONE;
-	if (_dhcp != NULL) {
+	checkLink();
+	socketKeepAlive();
+	socketTuneRetransmission();
+	if (_dhcp != NULL && _dhcp->binding()) {
+		// beginAsync() still waiting for its lease
+		int ret = _dhcp->poll_DHCP_lease();
+		if (ret == 1) {
+			setConfigFromDhcp();
+			socketPortRand(micros());
+			rc = DHCP_CHECK_BIND_OK;
+		} else if (ret < 0) {
+			// after an expired lease checkLease() tries again, while
+			// the first bind leaves the fallback to the caller
+			if (!_dhcp->restarting()) _dhcp = NULL;
+			rc = DHCP_CHECK_BIND_FAIL;
+		}
+	} else if (_dhcp != NULL) {
 		// we have a pointer to dhcp, use it
 		rc = _dhcp->checkLease();
 		switch (rc) {
@@ -149,18 +293,19 @@ int EthernetClass_SPI2::maintain()
 		case DHCP_CHECK_RENEW_OK:
 		case DHCP_CHECK_REBIND_OK:
 			//we might have got a new IP.
-			SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-
-/*
-			W5100_SPI2.setIPAddress(_dhcp->getLocalIp().raw_address());
-			W5100_SPI2.setGatewayIp(_dhcp->getGatewayIp().raw_address());
-			W5100_SPI2.setSubnetMask(_dhcp->getSubnetMask().raw_address());
-*/			
-			W5100_SPI2.setIPAddress(raw_address(_dhcp->getLocalIp()));
-			W5100_SPI2.setGatewayIp(raw_address(_dhcp->getGatewayIp()));
-			W5100_SPI2.setSubnetMask(raw_address(_dhcp->getSubnetMask()));
-			SPI1.endTransaction();
-			_dnsServerAddress = _dhcp->getDnsServerIp();
+			setConfigFromDhcp();
+			break;
+		case DHCP_CHECK_LEASE_EXPIRED:
+			//the address isn't ours anymore, stop using it
+			{
+				IPAddress oldIP = localIP();
+				W5100_SPI2.beginTransaction();
+				W5100_SPI2.setIPAddress(raw_address(IPAddress((uint32_t)0)));
+				W5100_SPI2.endTransaction();
+				if (_addressCallback != NULL) {
+					_addressCallback(oldIP, IPAddress((uint32_t)0));
+				}
+			}
 			break;
 		default:
 			//this is actually an error, it will retry though
@@ -173,97 +318,102 @@ int EthernetClass_SPI2::maintain()
 
 void EthernetClass_SPI2::MACAddress(uint8_t *mac_address)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-	W5100_SPI2.getMACAddress(mac_address);
-	SPI1.endTransaction();
+	if (_verifyConfig) verifyConfig();
+	memcpy(mac_address, W5100_SPI2.shadowSHAR, 6);
 }
 
 IPAddress EthernetClass_SPI2::localIP()
 {
-	IPAddress ret;
-	uint8_t local[4];
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-//	W5100_SPI2.getIPAddress(ret.raw_address());
-	W5100_SPI2.getIPAddress((uint8_t*)&local);
-	SPI1.endTransaction();
-	for (int c = 0; c < 4; c++)
-		ret[c] = local[c];
-	return ret;
+	if (_verifyConfig) verifyConfig();
+	return IPAddress(W5100_SPI2.shadowSIPR);
 }
 
 IPAddress EthernetClass_SPI2::subnetMask()
 {
-	IPAddress ret;
-	uint8_t local[4];
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-//	W5100_SPI2.getSubnetMask(ret.raw_address());
-	W5100_SPI2.getSubnetMask((uint8_t*)&local);
-	SPI1.endTransaction();
-	for (int c = 0; c < 4; c++)
-		ret[c] = local[c];
-	return ret;
+	if (_verifyConfig) verifyConfig();
+	return IPAddress(W5100_SPI2.shadowSUBR);
 }
 
 IPAddress EthernetClass_SPI2::gatewayIP()
 {
-	IPAddress ret;
-	uint8_t local[4];
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-//	W5100_SPI2.getGatewayIp(ret.raw_address());
-	W5100_SPI2.getGatewayIp((uint8_t*)&local);
-	SPI1.endTransaction();
-	for (int c = 0; c < 4; c++)
-		ret[c] = local[c];
-	return ret;
+	if (_verifyConfig) verifyConfig();
+	return IPAddress(W5100_SPI2.shadowGAR);
+}
+
+bool EthernetClass_SPI2::verifyConfig()
+{
+	uint8_t mac[6], ip[4], subnet[4], gateway[4];
+	W5100_SPI2.beginTransaction();
+	W5100_SPI2.getMACAddress(mac);
+	W5100_SPI2.getIPAddress(ip);
+	W5100_SPI2.getSubnetMask(subnet);
+	W5100_SPI2.getGatewayIp(gateway);
+	bool ok = memcmp(mac, W5100_SPI2.shadowSHAR, 6) == 0 &&
+		memcmp(ip, W5100_SPI2.shadowSIPR, 4) == 0 &&
+		memcmp(subnet, W5100_SPI2.shadowSUBR, 4) == 0 &&
+		memcmp(gateway, W5100_SPI2.shadowGAR, 4) == 0;
+	if (!ok) {
+		// the reset also lost the buffer sizes and retransmission settings
+		W5100_SPI2.setBufferSizes();
+		W5100_SPI2.writeSHAR(W5100_SPI2.shadowSHAR);
+		W5100_SPI2.writeSIPR(W5100_SPI2.shadowSIPR);
+		W5100_SPI2.writeSUBR(W5100_SPI2.shadowSUBR);
+		W5100_SPI2.writeGAR(W5100_SPI2.shadowGAR);
+		W5100_SPI2.writeRTR(W5100_SPI2.shadowRTR);
+		W5100_SPI2.writeRCR(W5100_SPI2.shadowRCR);
+		_chipResets++;
+	}
+	W5100_SPI2.endTransaction();
+	return ok;
 }
 
 void EthernetClass_SPI2::setMACAddress(const uint8_t *mac_address)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	W5100_SPI2.setMACAddress(mac_address);
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 }
 
 void EthernetClass_SPI2::setLocalIP(const IPAddress local_ip)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	IPAddress ip = local_ip;
 //	W5100_SPI2.setIPAddress(ip.raw_address());
 	W5100_SPI2.setIPAddress(raw_address(ip));
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 }
 
 void EthernetClass_SPI2::setSubnetMask(const IPAddress subnet)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	IPAddress ip = subnet;
 //	W5100_SPI2.setSubnetMask(ip.raw_address());
 	W5100_SPI2.setSubnetMask(raw_address(ip));
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 }
 
 void EthernetClass_SPI2::setGatewayIP(const IPAddress gateway)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	IPAddress ip = gateway;
 //	W5100_SPI2.setGatewayIp(ip.raw_address());
 	W5100_SPI2.setGatewayIp(raw_address(ip));
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 }
 
 void EthernetClass_SPI2::setRetransmissionTimeout(uint16_t milliseconds)
 {
 	if (milliseconds > 6553) milliseconds = 6553;
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	W5100_SPI2.setRetransmissionTime(milliseconds * 10);
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 }
 
 void EthernetClass_SPI2::setRetransmissionCount(uint8_t num)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	W5100_SPI2.setRetransmissionCount(num);
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 }
 
 
@@ -56,6 +56,12 @@
 // does not always seem to work in practice (maybe WIZnet bugs?)
 //#define ETHERNET_LARGE_BUFFERS
 
+// Number of DNS servers remembered from DHCP (option 6) or set by hand.
+// Lookups are sent to all of them and the first answer wins.
+#ifndef MAX_DNS_SERVERS
+#define MAX_DNS_SERVERS 3
+#endif
+
 
 #include <Arduino.h>
 #include "Client.h"
@@ -69,6 +75,59 @@ enum EthernetSPI2LinkStatus {
 	LinkOFF_SPI2
 };
 
+// W5500 PHY operation modes, the values are the PHYCFGR OPMDC field
+enum EthernetSPI2PhyMode {
+	Phy10Half_SPI2 = 0,
+	Phy10Full_SPI2 = 1,
+	Phy100Half_SPI2 = 2,
+	Phy100Full_SPI2 = 3,
+	PhyAuto_SPI2 = 7   // autonegotiate, all capabilities
+};
+
+// What the link monitor in maintain() does on link changes (flags)
+enum EthernetSPI2LinkPolicy {
+	LinkFailSends_SPI2 = 1, // sends give up at once while the link is down
+	LinkCloseTCP_SPI2  = 2, // close TCP connections when the link drops
+	LinkRenewDhcp_SPI2 = 4  // renew the DHCP lease when the link returns
+};
+
+// setsockopt style options, see setOption() of the client, server and UDP
+// classes.  They are applied when the socket opens; MSS, TOS, TTL and
+// keepalive also take effect at once on an open socket
+enum EthernetSPI2SocketOption {
+	SockOptMSS_SPI2,          // maximum segment size, 0 = chip default
+	SockOptTOS_SPI2,          // IP TOS byte, DSCP in the upper 6 bits
+	SockOptTTL_SPI2,          // 0 = chip default (128)
+	SockOptNoDelayedAck_SPI2, // TCP: acknowledge every segment at once (default 1)
+	SockOptKeepAlive_SPI2     // TCP: keepalive seconds, 0 = Ethernet_SPI2.setKeepAlive()
+};
+
+struct EthernetSocketOptions_SPI2 {
+	uint16_t mss;
+	uint8_t tos;
+	uint8_t ttl;
+	bool noDelayedAck;
+	uint16_t keepAlive;
+	EthernetSocketOptions_SPI2() : mss(0), tos(0), ttl(0), noDelayedAck(true), keepAlive(0) { }
+	bool set(uint8_t option, uint16_t value) {
+		switch (option) {
+		  case SockOptMSS_SPI2: mss = value; return true;
+		  case SockOptTOS_SPI2: tos = value; return value <= 0xFF;
+		  case SockOptTTL_SPI2: ttl = value; return value <= 0xFF;
+		  case SockOptNoDelayedAck_SPI2: noDelayedAck = (value != 0); return true;
+		  case SockOptKeepAlive_SPI2: keepAlive = value; return true;
+		}
+		return false;
+	}
+};
+
+enum EthernetSPI2SendStatus {
+	SendIdle_SPI2,
+	SendPending_SPI2,
+	SendOK_SPI2,
+	SendTimeout_SPI2
+};
+
 enum EthernetSPI2HardwareStatus {
 	EthernetNoHardware_SPI2,
 	EthernetW5100_SPI2,
@@ -79,20 +138,69 @@ enum EthernetSPI2HardwareStatus {
 class EthernetUDP_SPI2;
 class EthernetClient_SPI2;
 class EthernetServer_SPI2;
+class EthernetRaw_SPI2;
+class EthernetICMP_SPI2;
 class DhcpClass_SPI2;
 
 class EthernetClass_SPI2 {
 private:
-	static IPAddress _dnsServerAddress;
+	static IPAddress _dnsServerAddress[MAX_DNS_SERVERS];
+	static uint8_t _dnsServerCount;
 	static DhcpClass_SPI2* _dhcp;
+	static void setConfigFromDhcp();
+	static void (*_addressCallback)(IPAddress oldIP, IPAddress newIP);
+	static bool _verifyConfig;
+	static uint16_t _chipResets;
+	static EthernetSPI2LinkStatus _linkStatus;   // last PHY reading
+	static EthernetSPI2LinkStatus _linkReported; // last state reported by maintain()
+	static uint32_t _linkCheckMillis;
+	static uint16_t _linkInterval;
+	static uint8_t _linkPolicy;
+	static void (*_linkCallback)(bool up);
+	static void (*_halfDuplexCallback)(uint8_t speed);
+	static void checkLink();
+	static void setDnsFromDhcp();
 public:
 	// Initialise the Ethernet shield to use the provided MAC address and
 	// gain the rest of the configuration through DHCP.
 	// Returns 0 if the DHCP configuration failed, and 1 if it succeeded
 	static int begin(uint8_t *mac, unsigned long timeout = 60000, unsigned long responseTimeout = 4000);
+	// Same, without blocking: the exchange is driven by maintain(), which
+	// returns DHCP_CHECK_BIND_OK (6) once configured or DHCP_CHECK_BIND_FAIL
+	// (5) after timeout, when a static begin() can be used as fallback.
+	// With previousIP set, the address leased before a reboot is asked for
+	// directly (INIT-REBOOT), which takes a single round trip.
+	// Returns 0 if the hardware or socket could not be set up
+	static int beginAsync(uint8_t *mac, IPAddress previousIP = IPAddress((uint32_t)0),
+		unsigned long timeout = 60000, unsigned long responseTimeout = 4000);
 	static int maintain();
+	// Ask DHCP servers for a two message exchange (RFC 4039 Rapid Commit).
+	// Servers without support answer normally.  Off by default
+	static void setDhcpRapidCommit(bool enable);
+	// Called from maintain() when DHCP changes our address, including the
+	// first lease (from 0.0.0.0) and an expired lease (to 0.0.0.0)
+	static void onAddressChange(void (*callback)(IPAddress oldIP, IPAddress newIP)) { _addressCallback = callback; }
+	// The PHY is read at most once per setLinkCheckInterval() period
+	// (default 250 ms, 0 reads it on every call)
 	static EthernetSPI2LinkStatus linkStatus();
 	static EthernetSPI2HardwareStatus hardwareStatus();
+	static void setLinkCheckInterval(uint16_t milliseconds) { _linkInterval = milliseconds; }
+	// Called from maintain() when the link goes up or down
+	static void onLinkChange(void (*callback)(bool up)) { _linkCallback = callback; }
+	// EthernetSPI2LinkPolicy flags, none by default
+	static void setLinkPolicy(uint8_t flags) { _linkPolicy = flags; }
+	static bool linkFailFast() { return (_linkPolicy & LinkFailSends_SPI2) && linkStatus() == LinkOFF_SPI2; }
+	// Negotiated (or forced) link parameters, W5500 only.  linkSpeed()
+	// returns 10 or 100, or 0 when the link is down or the chip can't tell.
+	static uint8_t linkSpeed();
+	static bool linkFullDuplex();
+	// Force the W5500 PHY mode, skipping autonegotiation.  This resets
+	// the PHY, so the link drops and comes back.  Returns false on the
+	// other chips.
+	static bool setPhyMode(EthernetSPI2PhyMode mode);
+	static EthernetSPI2PhyMode phyMode();
+	// Called from maintain() when the link comes up at half duplex
+	static void onHalfDuplex(void (*callback)(uint8_t speed)) { _halfDuplexCallback = callback; }
 
 	// Manual configuration
 	static void begin(uint8_t *mac, IPAddress ip);
@@ -101,27 +209,81 @@ public:
 	static void begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet);
 	static void init(uint8_t sspin = 10);
 
+	// These return the configuration as last written, without SPI traffic.
+	// With setConfigVerify(true) they check it against the chip first
 	static void MACAddress(uint8_t *mac_address);
 	static IPAddress localIP();
 	static IPAddress subnetMask();
 	static IPAddress gatewayIP();
-	static IPAddress dnsServerIP() { return _dnsServerAddress; }
+	static void setConfigVerify(bool enable) { _verifyConfig = enable; }
+	// Returns false if the chip lost its configuration (it was reset or
+	// browned out); the configuration is then written again
+	static bool verifyConfig();
+	// Number of times verifyConfig() found the configuration lost
+	static uint16_t chipResetCount() { return _chipResets; }
+	static IPAddress dnsServerIP() { return _dnsServerAddress[0]; }
+	static IPAddress dnsServerIP(uint8_t index) {
+		return index < _dnsServerCount ? _dnsServerAddress[index] : IPAddress((uint32_t)0);
+	}
+	static uint8_t dnsServerCount() { return _dnsServerCount; }
+	static const IPAddress *dnsServerList() { return _dnsServerAddress; }
 
 	void setMACAddress(const uint8_t *mac_address);
 	void setLocalIP(const IPAddress local_ip);
 	void setSubnetMask(const IPAddress subnet);
 	void setGatewayIP(const IPAddress gateway);
-	void setDnsServerIP(const IPAddress dns_server) { _dnsServerAddress = dns_server; }
+	void setDnsServerIP(const IPAddress dns_server) {
+		_dnsServerAddress[0] = dns_server;
+		_dnsServerCount = 1;
+	}
+	// Set an additional server; index may be at most dnsServerCount()
+	void setDnsServerIP(uint8_t index, const IPAddress dns_server) {
+		if (index > _dnsServerCount || index >= MAX_DNS_SERVERS) return;
+		_dnsServerAddress[index] = dns_server;
+		if (index == _dnsServerCount) _dnsServerCount++;
+	}
 	void setRetransmissionTimeout(uint16_t milliseconds);
 	void setRetransmissionCount(uint8_t num);
+	// Set the retransmission timeout from round trips measured per
+	// destination (RFC 6298) rather than a fixed value.  The chip has one
+	// timeout for all sockets, so the largest one needed by the open
+	// connections is used, within minMs..maxMs.  Unknown destinations
+	// count as 200 ms.  The retry count follows, so a TCP connection gives
+	// up no sooner than with setRetransmissionTimeout/Count(); disabling
+	// restores those values
+	static void setAdaptiveRetransmission(bool enable, uint16_t minMs = 10, uint16_t maxMs = 3000);
+	// Round trips are learned from TCP handshakes and EthernetICMP_SPI2;
+	// the application can add its own (request/response times)
+	static void addRttSample(IPAddress ip, uint32_t microseconds);
+	// Smoothed round trip to ip in microseconds, 0 if unknown
+	static uint32_t smoothedRtt(IPAddress ip);
+	// UDP sends to a destination seen within the last 'seconds' skip the
+	// chip's ARP exchange (SEND_MAC with a cached MAC).  0 disables the cache
+	void setArpCacheTimeout(uint16_t seconds);
+	void flushArpCache();
+	// Keepalive interval for TCP sockets opened from now on, in seconds
+	// (0 = none, the default).  A connection whose peer stops answering
+	// times out and its socket is freed.  Rounded up to 5 s on the W5500,
+	// sent from maintain() on the other chips
+	static void setKeepAlive(uint16_t seconds);
+	// Number of socket commands (SEND, RECV, ...) issued so far, for benchmarks
+	static uint32_t socketCommandCount();
 
 	friend class EthernetClient_SPI2;
 	friend class EthernetServer_SPI2;
 	friend class EthernetUDP_SPI2;
+	friend class EthernetRaw_SPI2;
+	friend class EthernetICMP_SPI2;
 private:
-	// Opens a socket(TCP or UDP or IP_RAW mode)
-	static uint8_t socketBegin(uint8_t protocol, uint16_t port);
-	static uint8_t socketBeginMulticast(uint8_t protocol, IPAddress ip,uint16_t port);
+	// Opens a socket(TCP or UDP or IP_RAW mode).  For IP_RAW, ipproto is
+	// the IP protocol number, which must be set before the socket opens
+	static uint8_t socketBegin(uint8_t protocol, uint16_t port, uint8_t ipproto = 0,
+		const EthernetSocketOptions_SPI2 *opts = NULL);
+	static uint8_t socketBeginMulticast(uint8_t protocol, IPAddress ip,uint16_t port,
+		const EthernetSocketOptions_SPI2 *opts = NULL);
+	// Apply the options to an open socket, best effort: the chip may only
+	// use TOS and TTL from the next open
+	static void socketSetOptions(uint8_t s, const EthernetSocketOptions_SPI2 &opts);
 	static uint8_t socketStatus(uint8_t s);
 	// Close socket
 	static void socketClose(uint8_t s);
@@ -138,20 +300,46 @@ private:
 	static int socketRecv(uint8_t s, uint8_t * buf, int16_t len);
 	static uint16_t socketRecvAvailable(uint8_t s);
 	static uint8_t socketPeek(uint8_t s);
-	// sets up a UDP datagram, the data for which will be provided by one
-	// or more calls to bufferData and then finally sent with sendUDP.
-	// return true if the datagram was successfully set up, or false if there was an error
-	static bool socketStartUDP(uint8_t s, uint8_t* addr, uint16_t port);
+	// Bytes consumed before the receive window is reopened, 0 = adaptive
+	static void socketSetRecvThreshold(uint8_t s, uint16_t bytes);
+	// Copy up to len bytes from the receive buffer without consuming them.
+	// Use socketRecv(s, NULL, n) afterwards to drop what was processed
+	static uint16_t socketRecvPeek(uint8_t s, uint8_t * buf, uint16_t len, uint16_t offset = 0);
 	// copy up to len bytes of data from buf into a UDP datagram to be
 	// sent later by sendUDP.  Allows datagrams to be built up from a series of bufferData calls.
+	// Data can be buffered while the previous datagram is still being sent.
 	// return Number of bytes successfully buffered
 	static uint16_t socketBufferData(uint8_t s, uint16_t offset, const uint8_t* buf, uint16_t len);
-	// Send a UDP datagram built up from a sequence of startUDP followed by one or more
-	// calls to bufferData.
-	// return true if the datagram was successfully sent, or false if there was an error
-	static bool socketSendUDP(uint8_t s);
+	// Send a UDP datagram built up from one or more calls to bufferData to addr:port.
+	// With wait false the function returns right after SEND; the outcome
+	// is then reported by socketSendUDPStatus().
+	// return true if the datagram was successfully sent (or queued), or false if there was an error
+	static bool socketSendUDP(uint8_t s, uint8_t* addr, uint16_t port, bool wait);
+	// Same as above, but also copy the whole datagram, all inside a single SPI transaction
+	static bool socketSendUDPTo(uint8_t s, uint8_t* addr, uint16_t port, const uint8_t* buf, uint16_t len, bool wait);
+	// Poll a deferred UDP send without blocking (EthernetSPI2SendStatus)
+	static uint8_t socketSendUDPStatus(uint8_t s);
 	// Initialize the "random" source port number
 	static void socketPortRand(uint16_t n);
+	// Local port and peer of a socket, kept in RAM.  The peer of an
+	// accepted connection is read from the chip once it is established
+	static uint16_t socketLocalPort(uint8_t s);
+	static void socketPeer(uint8_t s, uint8_t *addr, uint16_t *port);
+	static void socketSetKeepAlive(uint8_t s, uint16_t seconds);
+	static void socketKeepAlive();
+	static void socketTuneRetransmission();
+	// MACRAW on socket 0, the only socket it is supported on
+	static bool socketBeginMacraw(bool macFilter);
+	// Copy whole frames (without their length header) back to back into
+	// buf, and their lengths into lens.  Returns the number of frames
+	static uint8_t socketRecvFrames(uint8_t s, uint8_t *buf, uint16_t size, uint16_t *lens, uint8_t max);
+	static bool socketSendFrame(uint8_t s, const uint8_t *buf, uint16_t len, bool wait);
+	// Hold socket s against the other threads (Mbed OS, otherwise no-ops).
+	// The socket functions take it themselves; nest it around a sequence
+	// of them that must not be interleaved
+	static void socketLock(uint8_t s);
+	static void socketUnlock(uint8_t s);
+	friend class SocketGuard_SPI2;
 };
 
 extern EthernetClass_SPI2 Ethernet_SPI2;
@@ -159,19 +347,33 @@ extern EthernetClass_SPI2 Ethernet_SPI2;
 
 #define UDP_TX_PACKET_MAX_SIZE 24
 
+// One datagram returned by EthernetUDP_SPI2::parsePackets().  data points
+// into the arena supplied by the caller and stays valid until it is reused.
+struct EthernetUDPPacket_SPI2 {
+	IPAddress remoteIP;
+	uint16_t remotePort;
+	uint16_t length;
+	uint8_t *data;
+};
+
 class EthernetUDP_SPI2 : public UDP {
 private:
 	uint16_t _port; // local port to listen on
 	IPAddress _remoteIP; // remote IP address for the incoming packet whilst it's being processed
 	uint16_t _remotePort; // remote port for the incoming packet whilst it's being processed
 	uint16_t _offset; // offset into the packet being sent
+	IPAddress _destIP; // destination of the packet being sent
+	uint16_t _destPort;
+	bool _asyncSend; // endPacket() doesn't wait for SEND_OK
+	void (*_sendCallback)(EthernetUDP_SPI2 &udp, bool ok);
+	EthernetSocketOptions_SPI2 _opts;
 
 protected:
 	uint8_t sockindex;
 	uint16_t _remaining; // remaining bytes of incoming packet yet to be processed
 
 public:
-	EthernetUDP_SPI2() : sockindex(MAX_SOCK_NUM) {}  // Constructor
+	EthernetUDP_SPI2() : _asyncSend(false), _sendCallback(NULL), sockindex(MAX_SOCK_NUM) {}  // Constructor
 	virtual uint8_t begin(uint16_t);      // initialize, start listening on specified port. Returns 1 if successful, 0 if there are no sockets available to use
 	virtual uint8_t beginMulticast(IPAddress, uint16_t);  // initialize, start listening on specified port. Returns 1 if successful, 0 if there are no sockets available to use
 	virtual void stop();  // Finish with the UDP socket
@@ -185,18 +387,40 @@ public:
 	// Returns 1 if successful, 0 if there was a problem resolving the hostname or port
 	virtual int beginPacket(const char *host, uint16_t port);
 	// Finish off this packet and send it
-	// Returns 1 if the packet was sent successfully, 0 if there was an error
+	// Returns 1 if the packet was sent successfully (or queued, in async mode), 0 if there was an error
 	virtual int endPacket();
+	// In async mode endPacket() returns as soon as the chip has started
+	// sending, so ARP resolution on a new destination doesn't block, and
+	// the next packet can be written meanwhile; the chip sends one at a
+	// time, so its endPacket() waits for the previous one.  Outcomes are
+	// reported by sendStatus() and by the callback set with onSendComplete()
+	void setAsyncSend(bool enable) { _asyncSend = enable; }
+	// Poll the oldest unreported async send (EthernetSPI2SendStatus)
+	int sendStatus();
+	void onSendComplete(void (*callback)(EthernetUDP_SPI2 &udp, bool ok)) { _sendCallback = callback; }
+	// MSS, TOS or TTL (EthernetSPI2SocketOption).  Returns false for TCP
+	// only options and out of range values
+	bool setOption(EthernetSPI2SocketOption option, uint16_t value);
 	// Write a single byte into the packet
 	virtual size_t write(uint8_t);
 	// Write size bytes from buffer into the packet
 	virtual size_t write(const uint8_t *buffer, size_t size);
+	// Send a whole datagram to ip:port in one go, without beginPacket/endPacket.
+	// With wait false it returns as soon as the chip has started sending,
+	// like endPacket() in async mode.
+	// Returns 1 if the datagram was sent (or queued), 0 on error
+	int sendTo(IPAddress ip, uint16_t port, const uint8_t *buffer, uint16_t size, bool wait = true);
 
 	using Print::write;
 
 	// Start processing the next available incoming packet
 	// Returns the size of the packet in bytes, or 0 if no packets are available
 	virtual int parsePacket();
+	// Pull as many whole datagrams as fit into arena with a single bulk read
+	// and describe them in packets[].  Returns the number of datagrams, or 0
+	// if none are available.  A datagram larger than the arena is left in
+	// the socket and must be read with parsePacket()
+	int parsePackets(EthernetUDPPacket_SPI2 *packets, uint8_t maxPackets, uint8_t *arena, uint16_t arenaSize);
 	// Number of bytes remaining in the current packet
 	virtual int available();
 	// Read a single byte from the current packet
@@ -209,6 +433,9 @@ public:
 	virtual int read(char* buffer, size_t len) { return read((unsigned char*)buffer, len); };
 	// Return the next byte from the current packet without moving on to the next byte
 	virtual int peek();
+	// Copy up to len bytes of the current packet, starting offset bytes
+	// ahead, without consuming them.  Returns the number of bytes copied
+	int peek(uint8_t *buffer, size_t len, size_t offset);
 	virtual void flush(); // Finish reading the current packet
 
 	// Return the IP address of the host who sent the current incoming packet
@@ -250,6 +477,14 @@ public:
 	virtual IPAddress remoteIP();
 	virtual uint16_t remotePort();
 	virtual void setConnectionTimeout(uint16_t timeout) { _timeout = timeout; }
+	// Reopen the receive window (Sock_RECV) after this many bytes are read,
+	// or when the buffer is drained.  0 = adapt to the read pattern (default)
+	void setWindowUpdateThreshold(uint16_t bytes);
+	// Keepalive for this connection, see EthernetClass_SPI2::setKeepAlive()
+	void setKeepAlive(uint16_t seconds);
+	// EthernetSPI2SocketOption, kept for the following connect()s too.
+	// Returns false for an unknown option or out of range value
+	bool setOption(EthernetSPI2SocketOption option, uint16_t value);
 
 	friend class EthernetServer_SPI2;
 
@@ -258,14 +493,19 @@ public:
 private:
 	uint8_t _sockindex; // MAX_SOCK_NUM means client not in use
 	uint16_t _timeout;
+	EthernetSocketOptions_SPI2 _opts;
 };
 
 
 class EthernetServer_SPI2 : public Server {
 private:
 	uint16_t _port;
+	EthernetSocketOptions_SPI2 _opts;
 public:
 	EthernetServer_SPI2(uint16_t port) : _port(port) { }
+	// EthernetSPI2SocketOption for the listening sockets opened from now
+	// on, and so for the connections they accept; call before begin()
+	bool setOption(EthernetSPI2SocketOption option, uint16_t value) { return _opts.set(option, value); }
 	EthernetClient_SPI2 available();
 	EthernetClient_SPI2 accept();
 	virtual void begin();
@@ -280,6 +520,93 @@ public:
 };
 
 
+class EthernetRaw_SPI2 {
+private:
+	uint8_t sockindex;
+public:
+	EthernetRaw_SPI2() : sockindex(MAX_SOCK_NUM) { }
+	// Open socket 0 in MACRAW mode.  It has to be free, so call this
+	// before opening any other socket.  With macFilter, unicast frames
+	// addressed to other MACs are dropped by the chip
+	bool begin(bool macFilter = true);
+	void stop();
+	// Bytes waiting in the chip, frames plus their 2 byte length headers
+	int available();
+	// Read the next frame (destination MAC first, no FCS).  Returns its
+	// length, or 0 if there is none.  A frame larger than size is dropped
+	int readFrame(uint8_t *buf, uint16_t size);
+	// Read as many whole frames as fit in buf with one SPI burst.  They
+	// are stored back to back and their lengths go to lens.  Returns the
+	// number of frames read
+	int readFrames(uint8_t *buf, uint16_t size, uint16_t *lens, uint8_t maxFrames);
+	// Send a complete frame.  With wait false this returns once the chip
+	// has the frame, and the next send waits for it to go out
+	bool sendFrame(const uint8_t *frame, uint16_t len, bool wait = true);
+	operator bool() { return sockindex < MAX_SOCK_NUM; }
+};
+
+#ifndef ICMP_MAX_PAYLOAD
+#define ICMP_MAX_PAYLOAD 256
+#endif
+#define ICMP_WINDOW      4   // echo requests waiting for a reply at once
+
+// Round trip times are in microseconds.  jitter is the smoothed mean
+// difference between consecutive round trips (RFC 3550)
+struct EthernetPingStats_SPI2 {
+	uint16_t sent;
+	uint16_t received;
+	uint16_t lost;
+	uint32_t rttMin;
+	uint32_t rttMax;
+	uint32_t rttAvg;
+	uint32_t jitter;
+	uint32_t rttLast;
+};
+
+class EthernetICMP_SPI2 {
+private:
+	uint8_t sockindex;
+	uint16_t _id;
+	uint16_t _seq;
+	uint16_t _size;
+	uint16_t _interval; // ms
+	uint16_t _timeout;  // ms
+	IPAddress _target;
+	uint16_t _count;    // requests left to send, 0 = no series running
+	bool _forever;
+	uint32_t _lastSend;
+	uint32_t _rttSum;
+	struct {
+		uint16_t seq;
+		uint32_t sentAt; // micros()
+		bool active;
+	} _window[ICMP_WINDOW];
+	EthernetPingStats_SPI2 _stats;
+	bool send();
+	void receive();
+	void expire();
+	void reply(uint16_t seq, uint32_t now);
+public:
+	EthernetICMP_SPI2();
+	// Open an IP_RAW socket for ICMP.  Returns false if none is free
+	bool begin();
+	void stop();
+	void setPayloadSize(uint16_t bytes) { _size = bytes > ICMP_MAX_PAYLOAD ? ICMP_MAX_PAYLOAD : bytes; }
+	void setInterval(uint16_t milliseconds) { _interval = milliseconds; }
+	void setTimeout(uint16_t milliseconds) { _timeout = milliseconds; }
+	// Send one echo request and wait for the reply.  Returns the round
+	// trip time in microseconds, or -1 on timeout
+	long ping(IPAddress ip);
+	// Ping ip every setInterval() ms, count times (0 = until stop()),
+	// without blocking: call poll() from loop()
+	bool start(IPAddress ip, uint16_t count = 0);
+	void poll();
+	// A series is running or replies are still expected
+	bool running();
+	const EthernetPingStats_SPI2 &stats() const { return _stats; }
+	void resetStats();
+};
+
 class DhcpClass_SPI2 {
 private:
 	uint32_t _dhcpInitialTransactionId;
@@ -290,39 +617,86 @@ private:
 	uint8_t  _dhcpSubnetMask[4] __attribute__((aligned(4)));
 	uint8_t  _dhcpGatewayIp[4] __attribute__((aligned(4)));
 	uint8_t  _dhcpDhcpServerIp[4] __attribute__((aligned(4)));
-	uint8_t  _dhcpDnsServerIp[4] __attribute__((aligned(4)));
+	uint8_t  _dhcpDnsServerIp[MAX_DNS_SERVERS][4] __attribute__((aligned(4)));
 #else
 	uint8_t  _dhcpLocalIp[4];
 	uint8_t  _dhcpSubnetMask[4];
 	uint8_t  _dhcpGatewayIp[4];
 	uint8_t  _dhcpDhcpServerIp[4];
-	uint8_t  _dhcpDnsServerIp[4];
+	uint8_t  _dhcpDnsServerIp[MAX_DNS_SERVERS][4];
 #endif
+	uint8_t  _dhcpDnsServerCount;
+	uint8_t  _replyType;      // message type of the reply being parsed
+	uint8_t  _replyOverload;  // option 52 of the reply being parsed
+	bool     _replyRapidCommit; // option 80 seen in the reply being parsed
+	bool     _rapidCommit;    // send option 80 in DISCOVER
 	uint32_t _dhcpLeaseTime;
 	uint32_t _dhcpT1, _dhcpT2;
 	uint32_t _renewInSec;
 	uint32_t _rebindInSec;
+	uint32_t _expireInSec;
+	uint8_t  _leaseOp;              // renew (RENEW_FAIL) or rebind (REBIND_FAIL) in progress
 	unsigned long _timeout;
 	unsigned long _responseTimeout;
 	unsigned long _lastCheckLeaseMillis;
+	unsigned long _startMillis;     // when the current exchange began
+	unsigned long _lastSendMillis;  // when we last sent, for responseTimeout
 	uint8_t _dhcp_state;
+	bool _binding;                  // beginAsync() in progress
+	bool _restart;                  // binding again after the lease expired
+	unsigned long _retryMillis;     // backoff before the next restart, 0 if none
+	unsigned long _failMillis;      // when the last restart failed
 	EthernetUDP_SPI2 _dhcpUdpSocket;
 
 	int request_DHCP_lease();
+	int start_DHCP_lease();
+	void bind_DHCP_lease();
+	void init_DHCP(uint8_t *mac, unsigned long timeout, unsigned long responseTimeout);
 	void reset_DHCP_lease();
+	void restart_failed();
 	void presend_DHCP();
 	void send_DHCP_MESSAGE(uint8_t, uint16_t);
 	void printByte(char *, uint8_t);
 
-	uint8_t parseDHCPResponse(unsigned long responseTimeout, uint32_t& transactionId);
+	uint8_t parseDHCPResponse(uint32_t& transactionId);
+	void parseOptions(const uint8_t *opt, uint16_t len);
+
+	// Options we use from replies, one handler each
+	typedef struct {
+		uint8_t code;
+		uint8_t minLen;
+		void (DhcpClass_SPI2::*handler)(const uint8_t *val, uint8_t len);
+	} dhcpoption_t;
+	static const dhcpoption_t _options[];
+
+	void optMessageType(const uint8_t *val, uint8_t len);
+	void optSubnetMask(const uint8_t *val, uint8_t len);
+	void optRouter(const uint8_t *val, uint8_t len);
+	void optDns(const uint8_t *val, uint8_t len);
+	void optServerId(const uint8_t *val, uint8_t len);
+	void optLeaseTime(const uint8_t *val, uint8_t len);
+	void optT1(const uint8_t *val, uint8_t len);
+	void optT2(const uint8_t *val, uint8_t len);
+	void optOverload(const uint8_t *val, uint8_t len);
+	void optRapidCommit(const uint8_t *val, uint8_t len);
 public:
 	IPAddress getLocalIp();
 	IPAddress getSubnetMask();
 	IPAddress getGatewayIp();
 	IPAddress getDhcpServerIp();
-	IPAddress getDnsServerIp();
+	IPAddress getDnsServerIp(uint8_t index = 0);
+	uint8_t getDnsServerCount() { return _dhcpDnsServerCount; }
 
 	int beginWithDHCP(uint8_t *, unsigned long timeout = 60000, unsigned long responseTimeout = 4000);
+	int beginAsync(uint8_t *, IPAddress previousIp, unsigned long timeout = 60000, unsigned long responseTimeout = 4000);
+	int poll_DHCP_lease();
+	void setRapidCommit(bool enable) { _rapidCommit = enable; }
+	void renewNow();
+	bool binding() { return _binding; }
+	// A failed bind is retried by checkLease() once a lease has expired,
+	// the first one (beginAsync()) is left to the caller
+	bool restarting() { return _restart; }
+	void end();
 	int checkLease();
 };
 
@@ -7,11 +7,11 @@
  */
 #include "IPAddressHack.h"
 
-uint8_t bytes[4];
-uint8_t * raw_address(IPAddress Address)
+IPRawAddress_SPI2 raw_address(IPAddress Address)
 {
+    IPRawAddress_SPI2 raw;
     for(int c = 0; c < 4; c++)
-        bytes[c] = Address[c];
-    return (uint8_t*)&bytes[0];
+        raw.bytes[c] = Address[c];
+    return raw;
 }
 
@@ -9,7 +9,14 @@
 #define ipaddresshack_h
 #include <Arduino.h>
 
-uint8_t* raw_address(IPAddress Address);
+// The four bytes of an IPAddress, for the functions taking a uint8_t*.
+// Returned by value so that concurrent callers don't share a buffer; the
+// copy lives until the end of the statement, don't keep the pointer.
+struct IPRawAddress_SPI2 {
+	uint8_t bytes[4];
+	operator uint8_t*() { return bytes; }
+};
+IPRawAddress_SPI2 raw_address(IPAddress Address);
 
 
 #endif
\ No newline at end of file
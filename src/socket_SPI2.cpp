@@ -45,17 +45,117 @@ typedef struct {
 	uint16_t RX_RSR; // Number of bytes received
 	uint16_t RX_RD;  // Address to read
 	uint16_t TX_FSR; // Free space ready for transmit
-	uint8_t  RX_inc; // how much have we advanced RX_RD
+	uint16_t RX_inc; // how much have we advanced RX_RD
+	uint16_t RX_thresh; // RX_inc that triggers Sock_RECV, 0 = adaptive
+	uint16_t RX_avg; // average read size, drives the adaptive threshold
+	uint16_t TX_queued;  // bytes of the next datagram past TX_WR, see queue_data()
+	uint8_t  TX_pending; // UDP SEND issued, SEND_OK not collected yet
+	uint8_t  TX_result;  // outcome of a deferred UDP SEND not reported yet
+	uint8_t  TX_learn;   // learn DHAR into the ARP cache on SEND_OK
+	uint8_t  peerKnown;  // peerIP/peerPort are valid, see Locking
+	uint8_t  peerIP[4];
+	uint16_t peerPort;
+	uint16_t localPort;
+	uint16_t keepAlive; // seconds, 0 = off
+	uint32_t keepLast;  // millis() of the last sign of life or keepalive
+	uint32_t connectAt; // micros() of Sock_CONNECT, until the handshake is timed
 } socketstate_t;
 
 static socketstate_t state[MAX_SOCK_NUM];
+static uint16_t keepalive_default = 0; // for new TCP sockets
+
+// Software ARP cache for UDP.  Destinations found here are sent with
+// SEND_MAC, so the chip doesn't ARP each time the destination changes.
+// Entries are learned from Sn_DHAR after the chip resolved a destination.
+#ifndef ARP_CACHE_SIZE
+#define ARP_CACHE_SIZE 8
+#endif
+
+typedef struct {
+	uint8_t  ip[4];
+	uint8_t  mac[6];
+	uint32_t learned; // millis() when learned, 0 = free
+} arpentry_t;
+
+static arpentry_t arp_cache[ARP_CACHE_SIZE];
+static uint32_t arp_timeout = 0; // ms, 0 = cache disabled
+
+// Round trip estimates per destination (RFC 6298), from TCP handshakes
+// and addRttSample().  In adaptive mode they drive the chip's RTR.
+#ifndef RTT_CACHE_SIZE
+#define RTT_CACHE_SIZE 8
+#endif
+
+typedef struct {
+	uint8_t  ip[4];
+	uint32_t srtt;   // us, 0 = free
+	uint32_t rttvar; // us
+	uint32_t used;   // millis() of the last sample
+} rttentry_t;
+
+static rttentry_t rtt_cache[RTT_CACHE_SIZE];
+static bool rto_adaptive = false;
+static uint32_t rto_min = 10000;   // us
+static uint32_t rto_max = 3000000; // us
+static uint32_t rto_checked = 0;   // millis() of the last retune
 
 
 static uint16_t getSnTX_FSR(uint8_t s);
 static uint16_t getSnRX_RSR(uint8_t s);
+static void setSnKeepAlive(uint8_t s, uint16_t seconds);
+static void applyOptions(uint8_t s, uint8_t protocol, const EthernetSocketOptions_SPI2 *opts);
+static void tuneRetransmission(const uint8_t *ip);
+static void rttSample(const uint8_t *ip, uint32_t rtt);
 static void write_data(uint8_t s, uint16_t offset, const uint8_t *data, uint16_t len);
+static void queue_data(uint8_t s, uint16_t offset, const uint8_t *data, uint16_t len);
 static void read_data(uint8_t s, uint16_t src, uint8_t *dst, uint16_t len);
+static bool finishSendUDP(uint8_t s);
+
+
+
+/*****************************************/
+/*              Locking                  */
+/*****************************************/
+
+// A socket function holds the socket's lock while it works on state[s]
+// and the socket registers, and takes the bus lock for each transaction
+// inside.  Always in that order: a thread holding the bus lock never
+// waits for a socket lock.  socketBegin() picks a socket under the bus
+// lock, then lets go of the bus to lock the socket and checks it again.
+//
+// One exception: tuneRetransmission() reads peerKnown and peerIP of
+// every socket with only the bus lock, as it runs inside transactions of
+// other sockets.  The owner writes those two fields only inside a
+// transaction too.
+//
+#ifdef ETHERNET_SPI2_LOCKING
+static rtos::Mutex socket_lock[MAX_SOCK_NUM];
+
+class SocketGuard_SPI2 {
+public:
+	SocketGuard_SPI2(uint8_t s) : _s(s) { EthernetClass_SPI2::socketLock(_s); }
+	~SocketGuard_SPI2() { EthernetClass_SPI2::socketUnlock(_s); }
+private:
+	uint8_t _s;
+};
+#define SOCKET_LOCK(s) SocketGuard_SPI2 socket_guard(s)
+#else
+#define SOCKET_LOCK(s)
+#endif
+
+void EthernetClass_SPI2::socketLock(uint8_t s)
+{
+#ifdef ETHERNET_SPI2_LOCKING
+	if (s < MAX_SOCK_NUM) socket_lock[s].lock();
+#endif
+}
 
+void EthernetClass_SPI2::socketUnlock(uint8_t s)
+{
+#ifdef ETHERNET_SPI2_LOCKING
+	if (s < MAX_SOCK_NUM) socket_lock[s].unlock();
+#endif
+}
 
 
 /*****************************************/
@@ -70,7 +170,8 @@ void EthernetClass_SPI2::socketPortRand(uint16_t n)
 	//Serial.printf("socketPortRand %d, srcport=%d\n", n, local_port);
 }
 
-uint8_t EthernetClass_SPI2::socketBegin(uint8_t protocol, uint16_t port)
+uint8_t EthernetClass_SPI2::socketBegin(uint8_t protocol, uint16_t port, uint8_t ipproto,
+	const EthernetSocketOptions_SPI2 *opts)
 {
 	uint8_t s, status[MAX_SOCK_NUM], chip, maxindex=MAX_SOCK_NUM;
 
@@ -81,20 +182,21 @@ uint8_t EthernetClass_SPI2::socketBegin(uint8_t protocol, uint16_t port)
 	if (chip == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
 #endif
 	//Serial.printf("W5000socket begin, protocol=%d, port=%d\n", protocol, port);
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+retry:
+	W5100_SPI2.beginTransaction();
 	// look at all the hardware sockets, use any that are closed (unused)
 	for (s=0; s < maxindex; s++) {
 		status[s] = W5100_SPI2.readSnSR(s);
-		if (status[s] == SnSR::CLOSED) goto makesocket;
+		if (status[s] == SnSR::CLOSED) goto claimsocket;
 	}
 	//Serial.printf("W5000socket step2\n");
 	// as a last resort, forcibly close any already closing
 	for (s=0; s < maxindex; s++) {
 		uint8_t stat = status[s];
-		if (stat == SnSR::LAST_ACK) goto closemakesocket;
-		if (stat == SnSR::TIME_WAIT) goto closemakesocket;
-		if (stat == SnSR::FIN_WAIT) goto closemakesocket;
-		if (stat == SnSR::CLOSING) goto closemakesocket;
+		if (stat == SnSR::LAST_ACK) goto claimsocket;
+		if (stat == SnSR::TIME_WAIT) goto claimsocket;
+		if (stat == SnSR::FIN_WAIT) goto claimsocket;
+		if (stat == SnSR::CLOSING) goto claimsocket;
 	}
 #if 0
 	Serial.printf("W5000socket step3\n");
@@ -105,17 +207,34 @@ uint8_t EthernetClass_SPI2::socketBegin(uint8_t protocol, uint16_t port)
 		if (stat == SnSR::CLOSE_WAIT) goto closemakesocket;
 	}
 #endif
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 	return MAX_SOCK_NUM; // all sockets are in use
-closemakesocket:
-	//Serial.printf("W5000socket close\n");
-	W5100_SPI2.execCmdSn(s, Sock_CLOSE);
-makesocket:
+claimsocket:
+	// the socket lock comes first (see Locking), so let go of the bus
+	// and make sure no other thread took the socket meanwhile
+	W5100_SPI2.endTransaction();
+	socketLock(s);
+	W5100_SPI2.beginTransaction();
+	if (W5100_SPI2.readSnSR(s) != status[s]) {
+		W5100_SPI2.endTransaction();
+		socketUnlock(s);
+		goto retry;
+	}
+	if (status[s] != SnSR::CLOSED) {
+		//Serial.printf("W5000socket close\n");
+		W5100_SPI2.execCmdSn(s, Sock_CLOSE);
+	}
 	//Serial.printf("W5000socket %d\n", s);
 	EthernetServer_SPI2::server_port[s] = 0;
 	delayMicroseconds(250); // TODO: is this needed??
+	if (opts && !opts->noDelayedAck && (protocol & 0x0F) == (SnMR::TCP & 0x0F)) {
+		protocol &= ~SnMR::ND;
+	}
 	W5100_SPI2.writeSnMR(s, protocol);
 	W5100_SPI2.writeSnIR(s, 0xFF);
+	if ((protocol & 0x0F) == SnMR::IPRAW) {
+		W5100_SPI2.writeSnPROTO(s, ipproto);
+	}
 	if (port > 0) {
 		W5100_SPI2.writeSnPORT(s, port);
 	} else {
@@ -123,18 +242,30 @@ makesocket:
 		if (++local_port < 49152) local_port = 49152;
 		W5100_SPI2.writeSnPORT(s, local_port);
 	}
+	applyOptions(s, protocol, opts);
 	W5100_SPI2.execCmdSn(s, Sock_OPEN);
 	state[s].RX_RSR = 0;
 	state[s].RX_RD  = W5100_SPI2.readSnRX_RD(s); // always zero?
 	state[s].RX_inc = 0;
+	state[s].RX_thresh = 0;
+	state[s].RX_avg = 0;
 	state[s].TX_FSR = 0;
+	state[s].TX_queued = 0;
+	state[s].TX_pending = 0;
+	state[s].TX_result = SendIdle_SPI2;
+	state[s].TX_learn = 0;
+	state[s].peerKnown = 0;
+	state[s].localPort = port > 0 ? port : local_port;
+	state[s].connectAt = 0;
 	//Serial.printf("W5000socket prot=%d, RX_RD=%d\n", W5100_SPI2.readSnMR(s), state[s].RX_RD);
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
+	socketUnlock(s);
 	return s;
 }
 
 // multicast version to set fields before open  thd
-uint8_t EthernetClass_SPI2::socketBeginMulticast(uint8_t protocol, IPAddress ip, uint16_t port)
+uint8_t EthernetClass_SPI2::socketBeginMulticast(uint8_t protocol, IPAddress ip, uint16_t port,
+	const EthernetSocketOptions_SPI2 *opts)
 {
 	uint8_t s, status[MAX_SOCK_NUM], chip, maxindex=MAX_SOCK_NUM;
 
@@ -145,20 +276,21 @@ uint8_t EthernetClass_SPI2::socketBeginMulticast(uint8_t protocol, IPAddress ip,
 	if (chip == 51) maxindex = 4; // W5100 chip never supports more than 4 sockets
 #endif
 	//Serial.printf("W5000socket begin, protocol=%d, port=%d\n", protocol, port);
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+retry:
+	W5100_SPI2.beginTransaction();
 	// look at all the hardware sockets, use any that are closed (unused)
 	for (s=0; s < maxindex; s++) {
 		status[s] = W5100_SPI2.readSnSR(s);
-		if (status[s] == SnSR::CLOSED) goto makesocket;
+		if (status[s] == SnSR::CLOSED) goto claimsocket;
 	}
 	//Serial.printf("W5000socket step2\n");
 	// as a last resort, forcibly close any already closing
 	for (s=0; s < maxindex; s++) {
 		uint8_t stat = status[s];
-		if (stat == SnSR::LAST_ACK) goto closemakesocket;
-		if (stat == SnSR::TIME_WAIT) goto closemakesocket;
-		if (stat == SnSR::FIN_WAIT) goto closemakesocket;
-		if (stat == SnSR::CLOSING) goto closemakesocket;
+		if (stat == SnSR::LAST_ACK) goto claimsocket;
+		if (stat == SnSR::TIME_WAIT) goto claimsocket;
+		if (stat == SnSR::FIN_WAIT) goto claimsocket;
+		if (stat == SnSR::CLOSING) goto claimsocket;
 	}
 #if 0
 	Serial.printf("W5000socket step3\n");
@@ -169,15 +301,29 @@ uint8_t EthernetClass_SPI2::socketBeginMulticast(uint8_t protocol, IPAddress ip,
 		if (stat == SnSR::CLOSE_WAIT) goto closemakesocket;
 	}
 #endif
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 	return MAX_SOCK_NUM; // all sockets are in use
-closemakesocket:
-	//Serial.printf("W5000socket close\n");
-	W5100_SPI2.execCmdSn(s, Sock_CLOSE);
-makesocket:
+claimsocket:
+	// the socket lock comes first (see Locking), so let go of the bus
+	// and make sure no other thread took the socket meanwhile
+	W5100_SPI2.endTransaction();
+	socketLock(s);
+	W5100_SPI2.beginTransaction();
+	if (W5100_SPI2.readSnSR(s) != status[s]) {
+		W5100_SPI2.endTransaction();
+		socketUnlock(s);
+		goto retry;
+	}
+	if (status[s] != SnSR::CLOSED) {
+		//Serial.printf("W5000socket close\n");
+		W5100_SPI2.execCmdSn(s, Sock_CLOSE);
+	}
 	//Serial.printf("W5000socket %d\n", s);
 	EthernetServer_SPI2::server_port[s] = 0;
 	delayMicroseconds(250); // TODO: is this needed??
+	if (opts && !opts->noDelayedAck && (protocol & 0x0F) == (SnMR::TCP & 0x0F)) {
+		protocol &= ~SnMR::ND;
+	}
 	W5100_SPI2.writeSnMR(s, protocol);
 	W5100_SPI2.writeSnIR(s, 0xFF);
 	if (port > 0) {
@@ -196,22 +342,128 @@ makesocket:
 		W5100_SPI2.writeSnDIPR(s, raw_address(ip));  //239.255.0.1
     	W5100_SPI2.writeSnDPORT(s, port);
     	W5100_SPI2.writeSnDHAR(s, mac);
+	applyOptions(s, protocol, opts);
 	W5100_SPI2.execCmdSn(s, Sock_OPEN);
 	state[s].RX_RSR = 0;
 	state[s].RX_RD  = W5100_SPI2.readSnRX_RD(s); // always zero?
 	state[s].RX_inc = 0;
+	state[s].RX_thresh = 0;
+	state[s].RX_avg = 0;
 	state[s].TX_FSR = 0;
+	state[s].TX_queued = 0;
+	state[s].TX_pending = 0;
+	state[s].TX_result = SendIdle_SPI2;
+	state[s].TX_learn = 0;
+	state[s].peerKnown = 0;
+	state[s].localPort = port > 0 ? port : local_port;
+	state[s].connectAt = 0;
 	//Serial.printf("W5000socket prot=%d, RX_RD=%d\n", W5100_SPI2.readSnMR(s), state[s].RX_RD);
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
+	socketUnlock(s);
 	return s;
 }
 // Return the socket's status
 //
+/*****************************************/
+/*            TCP keepalive              */
+/*****************************************/
+
+// The W5500 sends keepalives by itself (Sn_KPALVTR), the other chips are
+// told to by socketKeepAlive().  Either way a peer that doesn't answer
+// makes the socket time out and close, so it can be reused.  Called with
+// the SPI transaction held.
+//
+static void setSnKeepAlive(uint8_t s, uint16_t seconds)
+{
+	state[s].keepAlive = seconds;
+	state[s].keepLast = millis();
+	if (W5100_SPI2.getChip() == 55) {
+		uint16_t units = (seconds + 4) / 5;
+		W5100_SPI2.writeSnKPALVTR(s, units > 255 ? 255 : units);
+	}
+}
+
+/*****************************************/
+/*            Socket options             */
+/*****************************************/
+
+// Written at every open, before Sock_OPEN as the datasheets ask, so
+// nothing is inherited from the previous user of the socket.  The W5x00 chips have no per socket retransmission
+// settings, those stay global (setRetransmissionTimeout/Count).  Called
+// with the SPI transaction held.
+//
+static void applyOptions(uint8_t s, uint8_t protocol, const EthernetSocketOptions_SPI2 *opts)
+{
+	static const EthernetSocketOptions_SPI2 defaults;
+
+	if (!opts) opts = &defaults;
+	W5100_SPI2.writeSnMSSR(s, opts->mss);
+	W5100_SPI2.writeSnTOS(s, opts->tos);
+	W5100_SPI2.writeSnTTL(s, opts->ttl ? opts->ttl : 128);
+	state[s].keepAlive = 0;
+	if ((protocol & 0x0F) == (SnMR::TCP & 0x0F)) {
+		setSnKeepAlive(s, opts->keepAlive ? opts->keepAlive : keepalive_default);
+	}
+}
+
+void EthernetClass_SPI2::socketSetOptions(uint8_t s, const EthernetSocketOptions_SPI2 &opts)
+{
+	SOCKET_LOCK(s);
+	W5100_SPI2.beginTransaction();
+	applyOptions(s, W5100_SPI2.readSnMR(s), &opts);
+	W5100_SPI2.endTransaction();
+}
+
+void EthernetClass_SPI2::setKeepAlive(uint16_t seconds)
+{
+	keepalive_default = seconds;
+}
+
+void EthernetClass_SPI2::socketSetKeepAlive(uint8_t s, uint16_t seconds)
+{
+	SOCKET_LOCK(s);
+	W5100_SPI2.beginTransaction();
+	setSnKeepAlive(s, seconds);
+	W5100_SPI2.endTransaction();
+}
+
+// Sock_SEND_KEEP for idle connections on the W5100/W5200, from maintain()
+//
+void EthernetClass_SPI2::socketKeepAlive()
+{
+	if (W5100_SPI2.getChip() == 55) return;
+	uint32_t now = millis();
+	for (uint8_t s = 0; s < MAX_SOCK_NUM; s++) {
+		SOCKET_LOCK(s);
+		if (!state[s].keepAlive) continue;
+		if (now - state[s].keepLast < (uint32_t)state[s].keepAlive * 1000) continue;
+		state[s].keepLast = now;
+		W5100_SPI2.beginTransaction();
+		uint8_t status = W5100_SPI2.readSnSR(s);
+		if (status == SnSR::ESTABLISHED || status == SnSR::CLOSE_WAIT) {
+			W5100_SPI2.execCmdSn(s, Sock_SEND_KEEP);
+		} else if (status == SnSR::CLOSED) {
+			state[s].keepAlive = 0;
+		}
+		W5100_SPI2.endTransaction();
+	}
+}
+
 uint8_t EthernetClass_SPI2::socketStatus(uint8_t s)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	SOCKET_LOCK(s);
+	W5100_SPI2.beginTransaction();
 	uint8_t status = W5100_SPI2.readSnSR(s);
-	SPI1.endTransaction();
+	if (state[s].connectAt && status != SnSR::SYNSENT) {
+		// the handshake is over: one round trip, unless the SYN had to
+		// be sent again (Karn), which takes longer than the current RTR
+		uint32_t rtt = micros() - state[s].connectAt;
+		state[s].connectAt = 0;
+		if (status == SnSR::ESTABLISHED && rtt < (uint32_t)W5100_SPI2.readRTR() * 100) {
+			rttSample(state[s].peerIP, rtt);
+		}
+	}
+	W5100_SPI2.endTransaction();
 	return status;
 }
 
@@ -220,9 +472,16 @@ uint8_t EthernetClass_SPI2::socketStatus(uint8_t s)
 //
 void EthernetClass_SPI2::socketClose(uint8_t s)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	SOCKET_LOCK(s);
+	W5100_SPI2.beginTransaction();
 	W5100_SPI2.execCmdSn(s, Sock_CLOSE);
-	SPI1.endTransaction();
+	state[s].peerKnown = 0;
+	W5100_SPI2.endTransaction();
+	state[s].TX_queued = 0;
+	state[s].TX_pending = 0;
+	state[s].TX_result = SendIdle_SPI2;
+	state[s].TX_learn = 0;
+	state[s].connectAt = 0;
 }
 
 
@@ -230,13 +489,14 @@ void EthernetClass_SPI2::socketClose(uint8_t s)
 //
 uint8_t EthernetClass_SPI2::socketListen(uint8_t s)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	SOCKET_LOCK(s);
+	W5100_SPI2.beginTransaction();
 	if (W5100_SPI2.readSnSR(s) != SnSR::INIT) {
-		SPI1.endTransaction();
+		W5100_SPI2.endTransaction();
 		return 0;
 	}
 	W5100_SPI2.execCmdSn(s, Sock_LISTEN);
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 	return 1;
 }
 
@@ -245,12 +505,42 @@ uint8_t EthernetClass_SPI2::socketListen(uint8_t s)
 //
 void EthernetClass_SPI2::socketConnect(uint8_t s, uint8_t * addr, uint16_t port)
 {
+	SOCKET_LOCK(s);
 	// set destination IP
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
+	if (rto_adaptive) tuneRetransmission(addr);
 	W5100_SPI2.writeSnDIPR(s, addr);
 	W5100_SPI2.writeSnDPORT(s, port);
 	W5100_SPI2.execCmdSn(s, Sock_CONNECT);
-	SPI1.endTransaction();
+	state[s].connectAt = micros() | 1;
+	memcpy(state[s].peerIP, addr, 4);
+	state[s].peerPort = port;
+	state[s].peerKnown = 1;
+	W5100_SPI2.endTransaction();
+}
+
+uint16_t EthernetClass_SPI2::socketLocalPort(uint8_t s)
+{
+	SOCKET_LOCK(s);
+	return state[s].localPort;
+}
+
+void EthernetClass_SPI2::socketPeer(uint8_t s, uint8_t *addr, uint16_t *port)
+{
+	SOCKET_LOCK(s);
+	if (!state[s].peerKnown) {
+		W5100_SPI2.beginTransaction();
+		uint8_t status = W5100_SPI2.readSnSR(s);
+		W5100_SPI2.readSnDIPR(s, state[s].peerIP);
+		state[s].peerPort = W5100_SPI2.readSnDPORT(s);
+		// a listening socket only has a peer once a connection came in
+		if (status == SnSR::ESTABLISHED || status == SnSR::CLOSE_WAIT) {
+			state[s].peerKnown = 1;
+		}
+		W5100_SPI2.endTransaction();
+	}
+	memcpy(addr, state[s].peerIP, 4);
+	*port = state[s].peerPort;
 }
 
 
@@ -259,9 +549,10 @@ void EthernetClass_SPI2::socketConnect(uint8_t s, uint8_t * addr, uint16_t port)
 //
 void EthernetClass_SPI2::socketDisconnect(uint8_t s)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	SOCKET_LOCK(s);
+	W5100_SPI2.beginTransaction();
 	W5100_SPI2.execCmdSn(s, Sock_DISCON);
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 }
 
 
@@ -310,13 +601,43 @@ static void read_data(uint8_t s, uint16_t src, uint8_t *dst, uint16_t len)
 	}
 }
 
+// How many bytes may be consumed before RX_RD is written back and
+// Sock_RECV reopens the window.  Each Sock_RECV costs a register write
+// and a command wait, so bulk readers commit in large steps (at most half
+// the buffer, so the peer always sees a usable window) while small reads
+// keep committing about every 256 bytes (SSIZE/8 with 2K buffers).
+//
+static uint16_t recvThreshold(uint8_t s, uint16_t len)
+{
+	if (state[s].RX_thresh) return state[s].RX_thresh;
+	uint16_t avg = ((uint32_t)state[s].RX_avg * 3 + len) >> 2;
+	state[s].RX_avg = avg;
+	uint16_t thresh = avg * 2;
+	if (thresh < W5100_SPI2.SSIZE / 8) thresh = W5100_SPI2.SSIZE / 8;
+	if (thresh > W5100_SPI2.SSIZE / 2) thresh = W5100_SPI2.SSIZE / 2;
+	return thresh;
+}
+
+void EthernetClass_SPI2::socketSetRecvThreshold(uint8_t s, uint16_t bytes)
+{
+	SOCKET_LOCK(s);
+	if (bytes > W5100_SPI2.SSIZE) bytes = W5100_SPI2.SSIZE;
+	state[s].RX_thresh = bytes;
+}
+
+uint32_t EthernetClass_SPI2::socketCommandCount()
+{
+	return W5100_SPI2.cmdCount;
+}
+
 // Receive data.  Returns size, or -1 for no data, or 0 if connection closed
 //
 int EthernetClass_SPI2::socketRecv(uint8_t s, uint8_t *buf, int16_t len)
 {
+	SOCKET_LOCK(s);
 	// Check how much data is available
 	int ret = state[s].RX_RSR;
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	if (ret < len) {
 		uint16_t rsr = getSnRX_RSR(s);
 		ret = rsr - state[s].RX_inc;
@@ -337,13 +658,14 @@ int EthernetClass_SPI2::socketRecv(uint8_t s, uint8_t *buf, int16_t len)
 		}
 	} else {
 		if (ret > len) ret = len; // more data available than buffer length
+		state[s].keepLast = millis(); // the peer is alive
 		uint16_t ptr = state[s].RX_RD;
 		if (buf) read_data(s, ptr, buf, ret);
 		ptr += ret;
 		state[s].RX_RD = ptr;
 		state[s].RX_RSR -= ret;
 		uint16_t inc = state[s].RX_inc + ret;
-		if (inc >= 250 || state[s].RX_RSR == 0) {
+		if (inc >= recvThreshold(s, ret) || state[s].RX_RSR == 0) {
 			state[s].RX_inc = 0;
 			W5100_SPI2.writeSnRX_RD(s, ptr);
 			W5100_SPI2.execCmdSn(s, Sock_RECV);
@@ -353,18 +675,19 @@ int EthernetClass_SPI2::socketRecv(uint8_t s, uint8_t *buf, int16_t len)
 			state[s].RX_inc = inc;
 		}
 	}
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 	//Serial.printf("socketRecv, ret=%d\n", ret);
 	return ret;
 }
 
 uint16_t EthernetClass_SPI2::socketRecvAvailable(uint8_t s)
 {
+	SOCKET_LOCK(s);
 	uint16_t ret = state[s].RX_RSR;
 	if (ret == 0) {
-		SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+		W5100_SPI2.beginTransaction();
 		uint16_t rsr = getSnRX_RSR(s);
-		SPI1.endTransaction();
+		W5100_SPI2.endTransaction();
 		ret = rsr - state[s].RX_inc;
 		state[s].RX_RSR = ret;
 		//Serial.printf("sockRecvAvailable s=%d, RX_RSR=%d\n", s, ret);
@@ -372,15 +695,37 @@ uint16_t EthernetClass_SPI2::socketRecvAvailable(uint8_t s)
 	return ret;
 }
 
+// Copy len bytes of the receive queue, starting offset bytes past its head,
+// without moving RX_RD.  The data is fetched with one bulk read (two if the
+// ring wraps on W5100/W5200).
+//
+uint16_t EthernetClass_SPI2::socketRecvPeek(uint8_t s, uint8_t *buf, uint16_t len, uint16_t offset)
+{
+	SOCKET_LOCK(s);
+	uint16_t ret = state[s].RX_RSR;
+	W5100_SPI2.beginTransaction();
+	if (ret < offset + len) {
+		uint16_t rsr = getSnRX_RSR(s);
+		ret = rsr - state[s].RX_inc;
+		state[s].RX_RSR = ret;
+	}
+	ret = (ret > offset) ? ret - offset : 0;
+	if (ret > len) ret = len;
+	if (ret > 0) read_data(s, state[s].RX_RD + offset, buf, ret);
+	W5100_SPI2.endTransaction();
+	return ret;
+}
+
 // get the first byte in the receive queue (no checking)
 //
 uint8_t EthernetClass_SPI2::socketPeek(uint8_t s)
 {
+	SOCKET_LOCK(s);
 	uint8_t b;
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	uint16_t ptr = state[s].RX_RD;
 	W5100_SPI2.read((ptr & W5100_SPI2.SMASK) + W5100_SPI2.RBASE(s), &b, 1);
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 	return b;
 }
 
@@ -406,10 +751,8 @@ static uint16_t getSnTX_FSR(uint8_t s)
 }
 
 
-static void write_data(uint8_t s, uint16_t data_offset, const uint8_t *data, uint16_t len)
+static void write_buf(uint8_t s, uint16_t ptr, const uint8_t *data, uint16_t len)
 {
-	uint16_t ptr = W5100_SPI2.readSnTX_WR(s);
-	ptr += data_offset;
 	uint16_t offset = ptr & W5100_SPI2.SMASK;
 	uint16_t dstAddr = offset + W5100_SPI2.SBASE(s);
 
@@ -421,17 +764,46 @@ static void write_data(uint8_t s, uint16_t data_offset, const uint8_t *data, uin
 		W5100_SPI2.write(dstAddr, data, size);
 		W5100_SPI2.write(W5100_SPI2.SBASE(s), data + size, len - size);
 	}
+}
+
+
+static void write_data(uint8_t s, uint16_t data_offset, const uint8_t *data, uint16_t len)
+{
+	uint16_t ptr = W5100_SPI2.readSnTX_WR(s);
+	ptr += data_offset;
+	write_buf(s, ptr, data, len);
 	ptr += len;
 	W5100_SPI2.writeSnTX_WR(s, ptr);
 }
 
 
+// Copy part of a UDP datagram or MACRAW frame past TX_WR without moving
+// it: SEND sends whatever lies between TX_RD and TX_WR, so the next
+// datagram can be built while the previous one is still going out.
+// commit_data() moves TX_WR over it right before its own SEND.
+static void queue_data(uint8_t s, uint16_t offset, const uint8_t *data, uint16_t len)
+{
+	write_buf(s, W5100_SPI2.readSnTX_WR(s) + offset, data, len);
+	state[s].TX_queued = offset + len;
+}
+
+
+// Called with the SPI transaction held, once no SEND is in flight
+static void commit_data(uint8_t s)
+{
+	if (state[s].TX_queued == 0) return;
+	W5100_SPI2.writeSnTX_WR(s, W5100_SPI2.readSnTX_WR(s) + state[s].TX_queued);
+	state[s].TX_queued = 0;
+}
+
+
 /**
  * @brief	This function used to send the data in TCP mode
  * @return	1 for success else 0.
  */
 uint16_t EthernetClass_SPI2::socketSend(uint8_t s, const uint8_t * buf, uint16_t len)
 {
+	SOCKET_LOCK(s);
 	uint8_t status=0;
 	uint16_t ret=0;
 	uint16_t freesize=0;
@@ -444,19 +816,24 @@ uint16_t EthernetClass_SPI2::socketSend(uint8_t s, const uint8_t * buf, uint16_t
 
 	// if freebuf is available, start.
 	do {
-		SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+		W5100_SPI2.beginTransaction();
 		freesize = getSnTX_FSR(s);
 		status = W5100_SPI2.readSnSR(s);
-		SPI1.endTransaction();
+		W5100_SPI2.endTransaction();
 		if ((status != SnSR::ESTABLISHED) && (status != SnSR::CLOSE_WAIT)) {
 			ret = 0;
 			break;
 		}
+		if (freesize < ret && linkFailFast()) {
+			// no room and no link, the connection is lost
+			socketClose(s);
+			return 0;
+		}
 		yield();
 	} while (freesize < ret);
 
 	// copy data
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	write_data(s, 0, (uint8_t *)buf, ret);
 	W5100_SPI2.execCmdSn(s, Sock_SEND);
 
@@ -464,27 +841,33 @@ uint16_t EthernetClass_SPI2::socketSend(uint8_t s, const uint8_t * buf, uint16_t
 	while ( (W5100_SPI2.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) {
 		/* m2008.01 [bj] : reduce code */
 		if ( W5100_SPI2.readSnSR(s) == SnSR::CLOSED ) {
-			SPI1.endTransaction();
+			W5100_SPI2.endTransaction();
+			return 0;
+		}
+		W5100_SPI2.endTransaction();
+		if (linkFailFast()) {
+			socketClose(s);
 			return 0;
 		}
-		SPI1.endTransaction();
 		yield();
-		SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+		W5100_SPI2.beginTransaction();
 	}
 	/* +2008.01 bj */
 	W5100_SPI2.writeSnIR(s, SnIR::SEND_OK);
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
+	state[s].keepLast = millis(); // data was acked
 	return ret;
 }
 
 uint16_t EthernetClass_SPI2::socketSendAvailable(uint8_t s)
 {
+	SOCKET_LOCK(s);
 	uint8_t status=0;
 	uint16_t freesize=0;
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
 	freesize = getSnTX_FSR(s);
 	status = W5100_SPI2.readSnSR(s);
-	SPI1.endTransaction();
+	W5100_SPI2.endTransaction();
 	if ((status == SnSR::ESTABLISHED) || (status == SnSR::CLOSE_WAIT)) {
 		return freesize;
 	}
@@ -493,57 +876,471 @@ uint16_t EthernetClass_SPI2::socketSendAvailable(uint8_t s)
 
 uint16_t EthernetClass_SPI2::socketBufferData(uint8_t s, uint16_t offset, const uint8_t* buf, uint16_t len)
 {
+	SOCKET_LOCK(s);
 	//Serial.printf("  bufferData, offset=%d, len=%d\n", offset, len);
 	uint16_t ret =0;
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	W5100_SPI2.beginTransaction();
+	// the datagram in flight, if any, is already out of the free space
 	uint16_t txfree = getSnTX_FSR(s);
+	txfree = txfree > offset ? txfree - offset : 0;
 	if (len > txfree) {
 		ret = txfree; // check size not to exceed MAX size.
 	} else {
 		ret = len;
 	}
-	write_data(s, offset, buf, ret);
-	SPI1.endTransaction();
+	queue_data(s, offset, buf, ret);
+	W5100_SPI2.endTransaction();
 	return ret;
 }
 
-bool EthernetClass_SPI2::socketStartUDP(uint8_t s, uint8_t* addr, uint16_t port)
+/*****************************************/
+/*           UDP ARP cache               */
+/*****************************************/
+
+void EthernetClass_SPI2::setArpCacheTimeout(uint16_t seconds)
 {
-	if ( ((addr[0] == 0x00) && (addr[1] == 0x00) && (addr[2] == 0x00) && (addr[3] == 0x00)) ||
-	  ((port == 0x00)) ) {
-		return false;
-	}
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-	W5100_SPI2.writeSnDIPR(s, addr);
-	W5100_SPI2.writeSnDPORT(s, port);
-	SPI1.endTransaction();
+	arp_timeout = (uint32_t)seconds * 1000;
+	flushArpCache();
+}
+
+void EthernetClass_SPI2::flushArpCache()
+{
+	W5100_SPI2.beginTransaction();
+	memset(arp_cache, 0, sizeof(arp_cache));
+	W5100_SPI2.endTransaction();
+}
+
+// Broadcast and multicast destinations never need ARP
+static bool arpCacheable(const uint8_t *ip)
+{
+	if (ip[0] >= 224) return false;
 	return true;
 }
 
-bool EthernetClass_SPI2::socketSendUDP(uint8_t s)
+static arpentry_t * arpLookup(const uint8_t *ip)
 {
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
-	W5100_SPI2.execCmdSn(s, Sock_SEND);
+	uint32_t now = millis();
+	for (uint8_t i=0; i < ARP_CACHE_SIZE; i++) {
+		arpentry_t *e = &arp_cache[i];
+		if (e->learned == 0 || memcmp(e->ip, ip, 4) != 0) continue;
+		if (now - e->learned >= arp_timeout) {
+			e->learned = 0; // stale, resolve it again
+			return NULL;
+		}
+		return e;
+	}
+	return NULL;
+}
+
+static void arpInsert(const uint8_t *ip, const uint8_t *mac)
+{
+	arpentry_t *e = &arp_cache[0];
+	for (uint8_t i=0; i < ARP_CACHE_SIZE; i++) {
+		arpentry_t *c = &arp_cache[i];
+		if (c->learned != 0 && memcmp(c->ip, ip, 4) == 0) {
+			e = c;
+			break;
+		}
+		// otherwise recycle a free slot or the oldest one
+		if (e->learned != 0 && (c->learned == 0 ||
+		  (int32_t)(c->learned - e->learned) < 0)) {
+			e = c;
+		}
+	}
+	memcpy(e->ip, ip, 4);
+	memcpy(e->mac, mac, 6);
+	e->learned = millis() | 1;
+}
+
+// Wait for the outcome of the last Sock_SEND on a UDP socket.  Called
+// with the SPI transaction held, which is released while yielding.
+// The result of a deferred datagram is kept for socketSendUDPStatus().
+//
+static bool finishSendUDP(uint8_t s)
+{
+	bool ok = true;
 
 	/* +2008.01 bj */
 	while ( (W5100_SPI2.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) {
 		if (W5100_SPI2.readSnIR(s) & SnIR::TIMEOUT) {
-			/* +2008.01 [bj]: clear interrupt */
-			W5100_SPI2.writeSnIR(s, (SnIR::SEND_OK|SnIR::TIMEOUT));
-			SPI1.endTransaction();
-			//Serial.printf("sendUDP timeout\n");
-			return false;
+			ok = false;
+			break;
 		}
-		SPI1.endTransaction();
+		W5100_SPI2.endTransaction();
 		yield();
-		SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+		W5100_SPI2.beginTransaction();
 	}
+	/* +2008.01 [bj]: clear interrupt */
+	W5100_SPI2.writeSnIR(s, ok ? SnIR::SEND_OK : (SnIR::SEND_OK|SnIR::TIMEOUT));
+	if (state[s].TX_learn) {
+		// the chip has resolved the destination, remember its MAC
+		if (ok) {
+			uint8_t ip[4], mac[6];
+			W5100_SPI2.readSnDIPR(s, ip);
+			W5100_SPI2.readSnDHAR(s, mac);
+			arpInsert(ip, mac);
+		}
+		state[s].TX_learn = 0;
+	}
+	if (state[s].TX_pending) {
+		state[s].TX_pending = 0;
+		state[s].TX_result = ok ? SendOK_SPI2 : SendTimeout_SPI2;
+	}
+	//if (!ok) Serial.printf("sendUDP timeout\n");
+	return ok;
+}
 
-	/* +2008.01 bj */
-	W5100_SPI2.writeSnIR(s, SnIR::SEND_OK);
-	SPI1.endTransaction();
+// Program the destination and issue SEND for the datagram sitting in the
+// TX buffer.  Called with the SPI transaction held.
+//
+static bool startSendUDP(uint8_t s, uint8_t* addr, uint16_t port, bool wait)
+{
+	uint8_t dest[12];
+	arpentry_t *arp = NULL;
+
+	// the destination and TX_WR must not change under a datagram still
+	// being sent
+	if (state[s].TX_pending) finishSendUDP(s);
+	commit_data(s);
+	if (arp_timeout && arpCacheable(addr)) {
+		arp = arpLookup(addr);
+		if (!arp) state[s].TX_learn = 1;
+	}
+	// DHAR, DIPR and DPORT are contiguous: one burst for all of them
+	memcpy(dest + 6, addr, 4);
+	dest[10] = port >> 8;
+	dest[11] = port & 0xFF;
+	if (arp) {
+		memcpy(dest, arp->mac, 6);
+		W5100_SPI2.writeSnDHAR_DEST(s, dest);
+		W5100_SPI2.execCmdSn(s, Sock_SEND_MAC);
+	} else {
+		W5100_SPI2.writeSnDEST(s, dest + 6);
+		W5100_SPI2.execCmdSn(s, Sock_SEND);
+	}
+	if (!wait) {
+		state[s].TX_pending = 1;
+		return true;
+	}
+	return finishSendUDP(s);
+}
+
+bool EthernetClass_SPI2::socketSendUDP(uint8_t s, uint8_t* addr, uint16_t port, bool wait)
+{
+	SOCKET_LOCK(s);
+	if (linkFailFast()) return false;
+	W5100_SPI2.beginTransaction();
+	bool ok = startSendUDP(s, addr, port, wait);
+	W5100_SPI2.endTransaction();
 
 	//Serial.printf("sendUDP ok\n");
-	/* Sent ok */
-	return true;
+	return ok;
+}
+
+bool EthernetClass_SPI2::socketSendUDPTo(uint8_t s, uint8_t* addr, uint16_t port, const uint8_t* buf, uint16_t len, bool wait)
+{
+	SOCKET_LOCK(s);
+	if (linkFailFast()) return false;
+	W5100_SPI2.beginTransaction();
+	// A datagram can't be split, so it must fit in the free TX space.
+	// It is copied while the previous one may still be on its way;
+	// startSendUDP() waits for that one before moving TX_WR
+	if (len > getSnTX_FSR(s)) {
+		W5100_SPI2.endTransaction();
+		return false;
+	}
+	queue_data(s, 0, buf, len);
+	bool ok = startSendUDP(s, addr, port, wait);
+	W5100_SPI2.endTransaction();
+	return ok;
+}
+
+/*****************************************/
+/*     Adaptive retransmission timeout   */
+/*****************************************/
+
+static rttentry_t * rttLookup(const uint8_t *ip)
+{
+	for (uint8_t i = 0; i < RTT_CACHE_SIZE; i++) {
+		if (rtt_cache[i].srtt && memcmp(rtt_cache[i].ip, ip, 4) == 0) {
+			return &rtt_cache[i];
+		}
+	}
+	return NULL;
+}
+
+// RTO = SRTT + 4 * RTTVAR within the configured bounds.  Unknown
+// destinations get the chip's default of 200 ms
+static uint32_t rtoFor(const uint8_t *ip)
+{
+	rttentry_t *e = rttLookup(ip);
+	uint32_t rto = e ? e->srtt + 4 * e->rttvar : 200000;
+	if (rto < rto_min) rto = rto_min;
+	if (rto > rto_max) rto = rto_max;
+	return rto;
+}
+
+static void rttSample(const uint8_t *ip, uint32_t rtt)
+{
+	if (rtt == 0) rtt = 1;
+	rttentry_t *e = rttLookup(ip);
+	if (e) {
+		uint32_t err = rtt > e->srtt ? rtt - e->srtt : e->srtt - rtt;
+		e->rttvar = e->rttvar - (e->rttvar >> 2) + (err >> 2);
+		e->srtt = e->srtt - (e->srtt >> 3) + (rtt >> 3);
+		if (e->srtt == 0) e->srtt = 1;
+	} else {
+		// replace the destination idle for longest
+		e = &rtt_cache[0];
+		for (uint8_t i = 0; i < RTT_CACHE_SIZE; i++) {
+			if (!rtt_cache[i].srtt) {
+				e = &rtt_cache[i];
+				break;
+			}
+			if (millis() - rtt_cache[i].used > millis() - e->used) e = &rtt_cache[i];
+		}
+		memcpy(e->ip, ip, 4);
+		e->srtt = rtt;
+		e->rttvar = rtt >> 1;
+	}
+	e->used = millis();
+	if (rto_adaptive) tuneRetransmission(NULL);
+}
+
+// Retries a TCP segment needs, at RTR (100 us units), before giving up no
+// earlier than it would with the RTR and RCR the application set.  The
+// chip doubles the timeout on every retry, up to the largest value below
+// 0x10000, so a small RTR alone would cut the time a connection survives
+// an outage: 10 ms with 8 retries gives up after 5 s instead of 32 s
+static uint8_t retriesFor(uint32_t rtr)
+{
+	uint32_t target = 0, total = 0, t = W5100_SPI2.shadowRTR;
+	for (uint16_t i = 0; i <= W5100_SPI2.shadowRCR; i++) {
+		target += t;
+		if (t * 2 <= 0xFFFF) t *= 2;
+	}
+	uint16_t n = 0;
+	for (t = rtr; total < target && n < 256; n++) {
+		total += t;
+		if (t * 2 <= 0xFFFF) t *= 2;
+	}
+	return n ? n - 1 : 0;
+}
+
+// The chip has a single RTR for every socket.  Use the largest RTO of the
+// destinations with a TCP connection (plus ip, about to be connected), so
+// the slowest path sees no spurious retransmissions.  RCR goes along with
+// it, see retriesFor().  Called with the SPI transaction held.
+//
+static void tuneRetransmission(const uint8_t *ip)
+{
+	uint32_t rto = ip ? rtoFor(ip) : 0;
+	uint8_t maxindex = (W5100_SPI2.getChip() == 51) ? 4 : MAX_SOCK_NUM;
+
+	for (uint8_t s = 0; s < maxindex && s < MAX_SOCK_NUM; s++) {
+		if (!state[s].peerKnown) continue;
+		uint8_t status = W5100_SPI2.readSnSR(s);
+		if (status < SnSR::SYNSENT || status > SnSR::LAST_ACK) continue;
+		uint32_t r = rtoFor(state[s].peerIP);
+		if (r > rto) rto = r;
+	}
+	rto_checked = millis();
+	if (rto == 0) return; // no connection, keep the current value
+	uint32_t rtr = (rto + 99) / 100; // 100 us units
+	if (rtr > 0xFFFF) rtr = 0xFFFF;
+	uint8_t rcr = retriesFor(rtr);
+	if (W5100_SPI2.readRTR() != rtr) W5100_SPI2.writeRTR(rtr);
+	if (W5100_SPI2.readRCR() != rcr) W5100_SPI2.writeRCR(rcr);
+}
+
+void EthernetClass_SPI2::setAdaptiveRetransmission(bool enable, uint16_t minMs, uint16_t maxMs)
+{
+	W5100_SPI2.beginTransaction();
+	if (rto_adaptive && !enable) {
+		// back to what the application set
+		W5100_SPI2.writeRTR(W5100_SPI2.shadowRTR);
+		W5100_SPI2.writeRCR(W5100_SPI2.shadowRCR);
+	}
+	rto_adaptive = enable;
+	rto_min = (uint32_t)minMs * 1000;
+	rto_max = (uint32_t)maxMs * 1000;
+	if (rto_max < rto_min) rto_max = rto_min;
+	W5100_SPI2.endTransaction();
+}
+
+void EthernetClass_SPI2::addRttSample(IPAddress ip, uint32_t microseconds)
+{
+	uint8_t addr[4] = { ip[0], ip[1], ip[2], ip[3] };
+	W5100_SPI2.beginTransaction();
+	rttSample(addr, microseconds);
+	W5100_SPI2.endTransaction();
+}
+
+uint32_t EthernetClass_SPI2::smoothedRtt(IPAddress ip)
+{
+	uint8_t addr[4] = { ip[0], ip[1], ip[2], ip[3] };
+	W5100_SPI2.beginTransaction();
+	rttentry_t *e = rttLookup(addr);
+	uint32_t srtt = e ? e->srtt : 0;
+	W5100_SPI2.endTransaction();
+	return srtt;
+}
+
+// From maintain(): let RTR shrink again once slow connections are gone
+//
+void EthernetClass_SPI2::socketTuneRetransmission()
+{
+	if (!rto_adaptive) return;
+	// rto_checked is shared with the other threads' tuneRetransmission()
+	W5100_SPI2.beginTransaction();
+	if (millis() - rto_checked >= 1000) tuneRetransmission(NULL);
+	W5100_SPI2.endTransaction();
+}
+
+/*****************************************/
+/*          MACRAW (socket 0)            */
+/*****************************************/
+
+bool EthernetClass_SPI2::socketBeginMacraw(bool macFilter)
+{
+	SOCKET_LOCK(0);
+	uint8_t chip = W5100_SPI2.getChip();
+	if (!chip) return false;
+	uint8_t mode = SnMR::MACRAW;
+	if (macFilter) mode |= (chip == 55) ? SnMR::MFEN : SnMR::MF;
+	W5100_SPI2.beginTransaction();
+	if (W5100_SPI2.readSnSR(0) != SnSR::CLOSED) {
+		W5100_SPI2.endTransaction();
+		return false;
+	}
+	EthernetServer_SPI2::server_port[0] = 0;
+	W5100_SPI2.writeSnMR(0, mode);
+	W5100_SPI2.writeSnIR(0, 0xFF);
+	W5100_SPI2.execCmdSn(0, Sock_OPEN);
+	state[0].RX_RSR = 0;
+	state[0].RX_RD  = W5100_SPI2.readSnRX_RD(0);
+	state[0].RX_inc = 0;
+	state[0].TX_queued = 0;
+	state[0].TX_pending = 0;
+	state[0].TX_result = SendIdle_SPI2;
+	state[0].TX_learn = 0;
+	state[0].peerKnown = 0;
+	state[0].localPort = 0;
+	state[0].keepAlive = 0;
+	bool ok = W5100_SPI2.readSnSR(0) == SnSR::MACRAW;
+	W5100_SPI2.endTransaction();
+	return ok;
+}
+
+// Each frame in the RX ring is preceded by a 2 byte length, which counts
+// itself.  The first header is read on its own, then the frame and
+// whatever follows it in one burst; the headers in between are squeezed
+// out in RAM.  RX_RD is committed once, for the whole frames only.
+// Frames are not limited to 1514 bytes: with an FCS or VLAN tag they are
+// up to 1522.  Only a length the ring can't hold means we lost sync.
+// Called without the SPI transaction.
+//
+uint8_t EthernetClass_SPI2::socketRecvFrames(uint8_t s, uint8_t *buf, uint16_t size, uint16_t *lens, uint8_t max)
+{
+	SOCKET_LOCK(s);
+	uint8_t head[2];
+	uint8_t n = 0;
+
+	W5100_SPI2.beginTransaction();
+	uint16_t rsr = getSnRX_RSR(s);
+	uint16_t ptr = state[s].RX_RD;
+	if (rsr < 2 || max == 0) {
+		W5100_SPI2.endTransaction();
+		return 0;
+	}
+	read_data(s, ptr, head, 2);
+	uint16_t flen = (head[0] << 8) | head[1];
+	if (flen < 2 + 14 || flen > rsr || flen > W5100_SPI2.SSIZE) {
+		// lost sync with the ring, reopening is the only way back
+		uint8_t mode = W5100_SPI2.readSnMR(s);
+		W5100_SPI2.execCmdSn(s, Sock_CLOSE);
+		W5100_SPI2.writeSnMR(s, mode);
+		W5100_SPI2.execCmdSn(s, Sock_OPEN);
+		state[s].RX_RD = W5100_SPI2.readSnRX_RD(s);
+		state[s].RX_RSR = 0;
+		W5100_SPI2.endTransaction();
+		return 0;
+	}
+	flen -= 2;
+	if (flen <= size) {
+		uint16_t len = rsr - 2;
+		if (len > size) len = size;
+		read_data(s, ptr + 2, buf, len);
+		uint16_t pos = 0, used = 0;
+		while (1) {
+			// frame at buf+pos, moved down to buf+used
+			if (pos + flen > len) break; // not all read, next time
+			if (pos != used) memmove(buf + used, buf + pos, flen);
+			lens[n++] = flen;
+			used += flen;
+			pos += flen;
+			ptr += flen + 2;
+			if (n == max || pos + 2 > len) break;
+			flen = (buf[pos] << 8) | buf[pos + 1];
+			// a bad length is caught by the check above next time
+			if (flen < 2 + 14 || flen > rsr - 2 - pos) break;
+			flen -= 2;
+			pos += 2;
+		}
+	} else {
+		ptr += flen + 2; // doesn't fit, drop it
+	}
+	state[s].RX_RD = ptr;
+	state[s].RX_RSR = 0;
+	W5100_SPI2.writeSnRX_RD(s, ptr);
+	W5100_SPI2.execCmdSn(s, Sock_RECV);
+	W5100_SPI2.endTransaction();
+	return n;
+}
+
+bool EthernetClass_SPI2::socketSendFrame(uint8_t s, const uint8_t *buf, uint16_t len, bool wait)
+{
+	SOCKET_LOCK(s);
+	if (linkFailFast()) return false;
+	W5100_SPI2.beginTransaction();
+	if (len > getSnTX_FSR(s)) {
+		W5100_SPI2.endTransaction();
+		return false;
+	}
+	// as with UDP, TX_WR must not move under the frame still going out
+	queue_data(s, 0, buf, len);
+	if (state[s].TX_pending) finishSendUDP(s);
+	commit_data(s);
+	W5100_SPI2.execCmdSn(s, Sock_SEND);
+	bool ok = true;
+	if (wait) {
+		ok = finishSendUDP(s);
+	} else {
+		state[s].TX_pending = 1;
+	}
+	W5100_SPI2.endTransaction();
+	return ok;
+}
+
+uint8_t EthernetClass_SPI2::socketSendUDPStatus(uint8_t s)
+{
+	SOCKET_LOCK(s);
+	uint8_t ret = state[s].TX_result;
+	if (ret != SendIdle_SPI2) {
+		// report the datagram collected earlier first
+		state[s].TX_result = SendIdle_SPI2;
+		return ret;
+	}
+	if (!state[s].TX_pending) return SendIdle_SPI2;
+	W5100_SPI2.beginTransaction();
+	uint8_t ir = W5100_SPI2.readSnIR(s);
+	if (ir & (SnIR::SEND_OK | SnIR::TIMEOUT)) {
+		finishSendUDP(s);
+		ret = state[s].TX_result;
+		state[s].TX_result = SendIdle_SPI2;
+	} else {
+		ret = SendPending_SPI2;
+	}
+	W5100_SPI2.endTransaction();
+	return ret;
 }
@@ -61,6 +61,17 @@
 uint8_t  W5100Class_SPI2::chip = 0;
 uint8_t  W5100Class_SPI2::CH_BASE_MSB;
 uint8_t  W5100Class_SPI2::ss_pin = SS_PIN_DEFAULT;
+uint32_t W5100Class_SPI2::cmdCount = 0;
+uint8_t W5100Class_SPI2::shadowGAR[4];
+uint8_t W5100Class_SPI2::shadowSUBR[4];
+uint8_t W5100Class_SPI2::shadowSHAR[6];
+uint8_t W5100Class_SPI2::shadowSIPR[4];
+uint16_t W5100Class_SPI2::shadowRTR = 2000; // chip defaults: 200 ms, 8 retries
+uint8_t W5100Class_SPI2::shadowRCR = 8;
+#ifdef ETHERNET_SPI2_LOCKING
+rtos::Mutex W5100Class_SPI2::busLock;
+uint8_t W5100Class_SPI2::busDepth = 0;
+#endif
 #ifdef ETHERNET_LARGE_BUFFERS
 uint16_t W5100Class_SPI2::SSIZE = 2048;
 uint16_t W5100Class_SPI2::SMASK = 0x07FF;
@@ -94,7 +105,6 @@ W5100Class_SPI2 W5100_SPI2;
 uint8_t W5100Class_SPI2::init(void)
 {
 	static bool initialized = false;
-	uint8_t i;
 
 	if (initialized) return 1;
 
@@ -112,7 +122,7 @@ uint8_t W5100Class_SPI2::init(void)
 	SPI1.begin();
 	initSS();
 	resetSS();
-	SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+	beginTransaction();
 
 	// Attempt W5200 detection first, because W5200 does not properly
 	// reset its SPI state when CS goes high (inactive).  Communication
@@ -132,14 +142,6 @@ uint8_t W5100Class_SPI2::init(void)
 #endif
 		SMASK = SSIZE - 1;
 #endif
-		for (i=0; i<MAX_SOCK_NUM; i++) {
-			writeSnRX_SIZE(i, SSIZE >> 10);
-			writeSnTX_SIZE(i, SSIZE >> 10);
-		}
-		for (; i<8; i++) {
-			writeSnRX_SIZE(i, 0);
-			writeSnTX_SIZE(i, 0);
-		}
 	// Try W5500 next.  WIZnet finally seems to have implemented
 	// SPI well with this chip.  It appears to be very resilient,
 	// so try it after the fragile W5200
@@ -156,14 +158,6 @@ uint8_t W5100Class_SPI2::init(void)
 		SSIZE = 2048;
 #endif
 		SMASK = SSIZE - 1;
-		for (i=0; i<MAX_SOCK_NUM; i++) {
-			writeSnRX_SIZE(i, SSIZE >> 10);
-			writeSnTX_SIZE(i, SSIZE >> 10);
-		}
-		for (; i<8; i++) {
-			writeSnRX_SIZE(i, 0);
-			writeSnTX_SIZE(i, 0);
-		}
 #endif
 	// Try W5100 last.  This simple chip uses fixed 4 byte frames
 	// for every 8 bit access.  Terribly inefficient, but so simple
@@ -175,21 +169,12 @@ uint8_t W5100Class_SPI2::init(void)
 #ifdef ETHERNET_LARGE_BUFFERS
 #if MAX_SOCK_NUM <= 1
 		SSIZE = 8192;
-		writeTMSR(0x03);
-		writeRMSR(0x03);
 #elif MAX_SOCK_NUM <= 2
 		SSIZE = 4096;
-		writeTMSR(0x0A);
-		writeRMSR(0x0A);
 #else
 		SSIZE = 2048;
-		writeTMSR(0x55);
-		writeRMSR(0x55);
 #endif
 		SMASK = SSIZE - 1;
-#else
-		writeTMSR(0x55);
-		writeRMSR(0x55);
 #endif
 	// No hardware seems to be present.  Or it could be a W5200
 	// that's heard other SPI communication if its chip select
@@ -197,14 +182,36 @@ uint8_t W5100Class_SPI2::init(void)
 	} else {
 		//Serial.println("no chip :-(");
 		chip = 0;
-		SPI1.endTransaction();
+		endTransaction();
 		return 0; // no known chip is responding :-(
 	}
-	SPI1.endTransaction();
+	setBufferSizes();
+	endTransaction();
 	initialized = true;
 	return 1; // successful init
 }
 
+void W5100Class_SPI2::setBufferSizes(void)
+{
+	uint8_t i;
+
+	if (chip == 51) {
+		// two bits per socket: 0 = 1K, 1 = 2K, 2 = 4K, 3 = 8K
+		uint8_t msr = (SSIZE == 8192) ? 0x03 : (SSIZE == 4096) ? 0x0A : 0x55;
+		writeTMSR(msr);
+		writeRMSR(msr);
+	} else if (chip == 52 || chip == 55) {
+		for (i=0; i<MAX_SOCK_NUM; i++) {
+			writeSnRX_SIZE(i, SSIZE >> 10);
+			writeSnTX_SIZE(i, SSIZE >> 10);
+		}
+		for (; i<8; i++) {
+			writeSnRX_SIZE(i, 0);
+			writeSnTX_SIZE(i, 0);
+		}
+	}
+}
+
 // Soft reset the WIZnet chip, by writing to its MR register reset bit
 uint8_t W5100Class_SPI2::softReset(void)
 {
@@ -284,15 +291,15 @@ W5100SPI2Linkstatus W5100Class_SPI2::getLinkStatus()
 	if (!init()) return UNKNOWN;
 	switch (chip) {
 	  case 52:
-		SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+		beginTransaction();
 		phystatus = readPSTATUS_W5200();
-		SPI1.endTransaction();
+		endTransaction();
 		if (phystatus & 0x20) return LINK_ON;
 		return LINK_OFF;
 	  case 55:
-		SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+		beginTransaction();
 		phystatus = readPHYCFGR_W5500();
-		SPI1.endTransaction();
+		endTransaction();
 		if (phystatus & 0x01) return LINK_ON;
 		return LINK_OFF;
 	  default:
@@ -300,6 +307,33 @@ W5100SPI2Linkstatus W5100Class_SPI2::getLinkStatus()
 	}
 }
 
+uint8_t W5100Class_SPI2::getPhyConfig()
+{
+	uint8_t phycfg;
+
+	if (!init() || chip != 55) return 0;
+	beginTransaction();
+	phycfg = readPHYCFGR_W5500();
+	endTransaction();
+	return phycfg;
+}
+
+// PHYCFGR: RST(7) OPMD(6) OPMDC(5-3) DPX(2) SPD(1) LNK(0).  A new
+// operation mode only takes effect through a PHY reset: write it with
+// RST low, then raise RST again.
+bool W5100Class_SPI2::setPhyMode(uint8_t opmdc)
+{
+	if (!init() || chip != 55) return false;
+	uint8_t phycfg = 0x40 | ((opmdc & 0x07) << 3);
+	beginTransaction();
+	writePHYCFGR_W5500(phycfg);
+	delay(1);
+	writePHYCFGR_W5500(phycfg | 0x80);
+	phycfg = readPHYCFGR_W5500();
+	endTransaction();
+	return ((phycfg >> 3) & 0x07) == (opmdc & 0x07);
+}
+
 uint16_t W5100Class_SPI2::write(uint16_t addr, const uint8_t *buf, uint16_t len)
 {
 	uint8_t cmd[8];
@@ -476,6 +510,7 @@ uint16_t W5100Class_SPI2::read(uint16_t addr, uint8_t *buf, uint16_t len)
 void W5100Class_SPI2::execCmdSn(SOCKET s, SockCMD _cmd)
 {
 	// Send command to socket
+	cmdCount++;
 	writeSnCR(s, _cmd);
 	// Wait for command to complete
 	while (readSnCR(s)) ;
@@ -57,6 +57,14 @@
 #define SPI_ETHERNET_SETTINGS SPISettings(8000000, MSBFIRST, SPI_MODE0)
 #endif
 
+// With Mbed OS (GIGA R1, Portenta) several threads may use the network:
+// the chip is guarded by a bus lock and each socket by its own lock.
+// Define ETHERNET_SPI2_NO_LOCKING if only one thread ever does.
+#if defined(ARDUINO_ARCH_MBED) && !defined(ETHERNET_SPI2_NO_LOCKING)
+#define ETHERNET_SPI2_LOCKING
+#include <mbed.h>
+#endif
+
 
 typedef uint8_t SOCKET;
 
@@ -70,6 +78,8 @@ public:
   static const uint8_t PPPOE  = 0x05;
   static const uint8_t ND     = 0x20;
   static const uint8_t MULTI  = 0x80;
+  static const uint8_t MFEN   = 0x80; // W5500 MACRAW: MAC filter
+  static const uint8_t MF     = 0x40; // W5100/W5200 MACRAW: MAC filter
 };
 
 enum SockCMD {
@@ -136,23 +146,62 @@ class W5100Class_SPI2 {
 
 public:
   static uint8_t init(void);
-
-  inline void setGatewayIp(const uint8_t * addr) { writeGAR(addr); }
+  // Program the socket buffer sizes chosen by init().  A chip reset puts
+  // them back to the defaults, so verifyConfig() calls it again
+  static void setBufferSizes(void);
+
+  // The set functions also keep a copy in RAM (the shadow registers
+  // below), so the configuration can be read back without SPI traffic.
+  // The get functions read the chip.
+  inline void setGatewayIp(const uint8_t * addr) { writeGAR(addr); memcpy(shadowGAR, addr, 4); }
   inline void getGatewayIp(uint8_t * addr) { readGAR(addr); }
 
-  inline void setSubnetMask(const uint8_t * addr) { writeSUBR(addr); }
+  inline void setSubnetMask(const uint8_t * addr) { writeSUBR(addr); memcpy(shadowSUBR, addr, 4); }
   inline void getSubnetMask(uint8_t * addr) { readSUBR(addr); }
 
-  inline void setMACAddress(const uint8_t * addr) { writeSHAR(addr); }
+  inline void setMACAddress(const uint8_t * addr) { writeSHAR(addr); memcpy(shadowSHAR, addr, 6); }
   inline void getMACAddress(uint8_t * addr) { readSHAR(addr); }
 
-  inline void setIPAddress(const uint8_t * addr) { writeSIPR(addr); }
+  inline void setIPAddress(const uint8_t * addr) { writeSIPR(addr); memcpy(shadowSIPR, addr, 4); }
   inline void getIPAddress(uint8_t * addr) { readSIPR(addr); }
 
-  inline void setRetransmissionTime(uint16_t timeout) { writeRTR(timeout); }
-  inline void setRetransmissionCount(uint8_t retry) { writeRCR(retry); }
+  static uint8_t shadowGAR[4];
+  static uint8_t shadowSUBR[4];
+  static uint8_t shadowSHAR[6];
+  static uint8_t shadowSIPR[4];
+
+  inline void setRetransmissionTime(uint16_t timeout) { writeRTR(timeout); shadowRTR = timeout; }
+  inline void setRetransmissionCount(uint8_t retry) { writeRCR(retry); shadowRCR = retry; }
+
+  // as set by the application; adaptive retransmission tunes the chip
+  // around them with writeRTR()/writeRCR()
+  static uint16_t shadowRTR;
+  static uint8_t shadowRCR;
 
   static void execCmdSn(SOCKET s, SockCMD _cmd);
+  static uint32_t cmdCount; // socket commands issued, for benchmarks
+
+  // Every exchange with the chip goes between these.  With locking they
+  // also hold the bus lock, which the same thread may take again
+  static inline void beginTransaction() {
+#ifdef ETHERNET_SPI2_LOCKING
+    busLock.lock();
+    if (busDepth++) return;
+#endif
+    SPI1.beginTransaction(SPI_ETHERNET_SETTINGS);
+  }
+  static inline void endTransaction() {
+#ifdef ETHERNET_SPI2_LOCKING
+    if (--busDepth == 0) SPI1.endTransaction();
+    busLock.unlock();
+#else
+    SPI1.endTransaction();
+#endif
+  }
+#ifdef ETHERNET_SPI2_LOCKING
+  static rtos::Mutex busLock;
+  static uint8_t busDepth;
+#endif
 
 
   // W5100 Registers
@@ -197,6 +246,9 @@ public:
     return read(address, _buff, size);            \
   }
   static W5100SPI2Linkstatus getLinkStatus();
+  // W5500 only: PHYCFGR contents (0 on other chips) and PHY operation mode
+  static uint8_t getPhyConfig();
+  static bool setPhyMode(uint8_t opmdc);
 
 public:
   __GP_REGISTER8 (MR,     0x0000);    // Mode
@@ -286,6 +338,8 @@ public:
   __SOCKET_REGISTER_N(SnDHAR,     0x0006, 6)     // Destination Hardw Addr
   __SOCKET_REGISTER_N(SnDIPR,     0x000C, 4)     // Destination IP Addr
   __SOCKET_REGISTER16(SnDPORT,    0x0010)        // Destination Port
+  __SOCKET_REGISTER_N(SnDEST,     0x000C, 6)     // Destination IP Addr + Port in one burst
+  __SOCKET_REGISTER_N(SnDHAR_DEST,0x0006, 12)    // Destination Hardw Addr + IP Addr + Port in one burst
   __SOCKET_REGISTER16(SnMSSR,     0x0012)        // Max Segment Size
   __SOCKET_REGISTER8(SnPROTO,     0x0014)        // Protocol in IP RAW Mode
   __SOCKET_REGISTER8(SnTOS,       0x0015)        // IP TOS
@@ -298,6 +352,7 @@ public:
   __SOCKET_REGISTER16(SnRX_RSR,   0x0026)        // RX Free Size
   __SOCKET_REGISTER16(SnRX_RD,    0x0028)        // RX Read Pointer
   __SOCKET_REGISTER16(SnRX_WR,    0x002A)        // RX Write Pointer (supported?)
+  __SOCKET_REGISTER8(SnKPALVTR,   0x002F)        // Keep Alive Timer, 5 s units (W5500 only)
 
 #undef __SOCKET_REGISTER8
 #undef __SOCKET_REGISTER16